@@ -0,0 +1,210 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// this benchmark measures the simulated time it takes to transfer files of a
+// few sizes over TCP, with each congestion control algorithm. Once over a link
+// with a queue of one bandwidth-delay product, and once over a long fat link
+// with a shallow queue
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+
+#include <chrono>
+#include <functional>
+#include <cstdio>
+
+using namespace sim::asio;
+using namespace sim::asio::ip;
+using sim::simulation;
+using sim::default_config;
+using sim::congestion_control;
+using namespace std::placeholders;
+
+namespace {
+
+// two nodes connected by a link in each direction. The round-trip time is
+// twice the latency, and the queue of the link holds the given fraction of the
+// bandwidth-delay product
+struct link_config : default_config
+{
+	link_config(std::int64_t bits_per_second, int latency_ms, double queue_bdp)
+		: m_rate(bits_per_second / 8)
+		, m_latency(latency_ms)
+		, m_queue_bdp(queue_bdp)
+	{}
+
+	virtual void build(simulation& sim) override
+	{
+		default_config::build(sim);
+		int const queue_size = int(double(m_rate) * m_latency * 2 / 1000 * m_queue_bdp);
+		for (int i = 0; i < 2; ++i)
+		{
+			m_link[i] = std::make_shared<sim::queue>(std::ref(sim.get_io_service())
+				, int(m_rate), sim::chrono::duration_cast<
+					sim::chrono::high_resolution_clock::duration>(
+						sim::chrono::milliseconds(m_latency)), queue_size, "link");
+		}
+	}
+
+	virtual sim::route channel_route(address src, address dst) override
+	{ return sim::route().append(m_link[src < dst ? 0 : 1]); }
+	virtual sim::route incoming_route(address) override { return sim::route(); }
+	virtual sim::route outgoing_route(address) override { return sim::route(); }
+
+private:
+	std::int64_t const m_rate;
+	int const m_latency;
+	double const m_queue_bdp;
+	std::shared_ptr<sim::queue> m_link[2];
+};
+
+std::int64_t now_us()
+{
+	return sim::chrono::duration_cast<sim::chrono::microseconds>(
+		sim::chrono::high_resolution_clock::now()
+		- sim::chrono::high_resolution_clock::time_point()).count();
+}
+
+// connects and writes ``num_bytes`` virtual bytes. Records the time the last
+// byte is received
+struct transfer
+{
+	transfer(simulation& sim, int num_bytes)
+		: ios_a(sim, address_v4::from_string("10.0.0.1"))
+		, ios_b(sim, address_v4::from_string("10.0.0.2"))
+		, listener(ios_b)
+		, incoming(ios_b)
+		, outgoing(ios_a)
+		, num_bytes(num_bytes)
+		, written(0)
+		, received(0)
+		, start_us(0)
+		, done_us(0)
+	{
+		boost::system::error_code ec;
+		listener.open(tcp::v4(), ec);
+		listener.bind(tcp::endpoint(address(), 8080), ec);
+		listener.listen(10, ec);
+
+		// buffers this large never limit the transfer, like the ones linux
+		// grows to fit the bandwidth-delay product
+		incoming.set_option(tcp::socket::receive_buffer_size(64 * 1024 * 1024), ec);
+		outgoing.set_option(tcp::socket::send_buffer_size(64 * 1024 * 1024), ec);
+
+		listener.async_accept(incoming, std::bind(&transfer::on_accept, this, _1));
+		outgoing.async_connect(tcp::endpoint(address_v4::from_string("10.0.0.2"), 8080)
+			, std::bind(&transfer::on_connect, this, _1));
+	}
+
+	void on_accept(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		start_read();
+	}
+
+	void start_read()
+	{
+		incoming.async_read_some(buffer(recv_buf, sizeof(recv_buf))
+			, std::bind(&transfer::on_read, this, _1, _2));
+	}
+
+	void on_read(boost::system::error_code const& ec, std::size_t bytes)
+	{
+		if (ec) return;
+		received += int(bytes);
+		if (received == num_bytes)
+		{
+			done_us = now_us();
+			incoming.close();
+			return;
+		}
+		start_read();
+	}
+
+	void on_connect(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		start_us = now_us();
+		start_write();
+	}
+
+	void start_write()
+	{
+		outgoing.async_write_virtual(std::size_t(num_bytes - written)
+			, std::bind(&transfer::on_write, this, _1, _2));
+	}
+
+	void on_write(boost::system::error_code const& ec, std::size_t bytes)
+	{
+		if (ec) return;
+		written += int(bytes);
+		if (written < num_bytes) start_write();
+	}
+
+	io_service ios_a;
+	io_service ios_b;
+	tcp::acceptor listener;
+	tcp::socket incoming;
+	tcp::socket outgoing;
+	char recv_buf[64 * 1024];
+	int const num_bytes;
+	int written;
+	int received;
+	std::int64_t start_us;
+	std::int64_t done_us;
+};
+
+void run(char const* link, std::int64_t bits_per_second, int latency_ms
+	, double queue_bdp)
+{
+	char const* names[] = { "reno", "cubic", "bbr" };
+	int const sizes[] = { 100 * 1000, 1000 * 1000, 10 * 1000 * 1000
+		, 100 * 1000 * 1000 };
+
+	std::printf("%s\n        ", link);
+	for (int const size : sizes) std::printf("  %9d kB", size / 1000);
+	std::printf("\n");
+	for (int a = 0; a < 3; ++a)
+	{
+		std::printf("  %-6s", names[a]);
+		std::chrono::steady_clock::time_point const start
+			= std::chrono::steady_clock::now();
+		for (int const size : sizes)
+		{
+			link_config cfg(bits_per_second, latency_ms, queue_bdp);
+			simulation sim(cfg);
+			sim.set_congestion_control(congestion_control::algorithm_t(a));
+			transfer t(sim, size);
+			sim.run();
+			std::printf("  %9.1f ms", double(t.done_us - t.start_us) / 1000.0);
+		}
+		std::printf("  (%.1f ms)\n", std::chrono::duration_cast<
+			std::chrono::microseconds>(std::chrono::steady_clock::now() - start)
+			.count() / 1000.0);
+	}
+}
+
+}
+
+int main()
+{
+	run("100 Mbit, 20 ms round-trip, 1 BDP queue", 100 * 1000 * 1000, 10, 1);
+	run("1 Gbit, 100 ms round-trip, 0.1 BDP queue", 1000 * 1000 * 1000, 50, 0.1);
+	return 0;
+}
+
@@ -0,0 +1,295 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// this benchmark counts the heap allocations and the events run per packet sent
+// through the simulated network, once with UDP datagrams and once with a bulk TCP
+// transfer
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace sim::asio;
+using namespace sim::asio::ip;
+using sim::simulation;
+using sim::default_config;
+using namespace std::placeholders;
+
+namespace {
+	std::atomic<std::uint64_t> g_allocations(0);
+}
+
+void* operator new(std::size_t size)
+{
+	++g_allocations;
+	void* ret = std::malloc(size == 0 ? 1 : size);
+	if (ret == nullptr) throw std::bad_alloc();
+	return ret;
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+namespace {
+
+// two nodes connected by a 1 Gbit link in each direction, with 50 us of
+// latency. Unlike the DSL modems of the default configuration, the link is
+// fast enough for segments to travel as trains
+struct lan_config : default_config
+{
+	virtual void build(simulation& sim) override
+	{
+		default_config::build(sim);
+		for (int i = 0; i < 2; ++i)
+		{
+			m_link[i] = std::make_shared<sim::queue>(std::ref(sim.get_io_service())
+				, 1000 * 1000 * 1000 / 8, sim::chrono::duration_cast<
+					sim::chrono::high_resolution_clock::duration>(
+						sim::chrono::microseconds(50)), 0, "1 Gbit link");
+		}
+	}
+
+	virtual sim::route channel_route(address src, address dst) override
+	{ return sim::route().append(m_link[src < dst ? 0 : 1]); }
+	virtual sim::route incoming_route(address) override { return sim::route(); }
+	virtual sim::route outgoing_route(address) override { return sim::route(); }
+
+private:
+	std::shared_ptr<sim::queue> m_link[2];
+};
+
+void report(char const* name, std::uint64_t packets, std::uint64_t allocs
+	, std::uint64_t events, std::chrono::steady_clock::time_point start)
+{
+	const double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count() / 1000.0;
+	std::printf("%-5s packets: %8d  allocations: %9d  %5.2f allocs/packet  "
+		"%5.2f events/packet  %8.1f ms\n"
+		, name, int(packets), int(allocs), double(allocs) / packets
+		, double(events) / packets, ms);
+}
+
+// handlers are bound to member functions, to measure the allocations made by
+// the simulator rather than the ones made by copying std::function objects
+struct udp_test
+{
+	udp_test(simulation& sim, int num_packets)
+		: ios_a(sim, address_v4::from_string("10.0.0.1"))
+		, ios_b(sim, address_v4::from_string("10.0.0.2"))
+		, sender(ios_a)
+		, receiver(ios_b)
+		, timer(ios_a)
+		, dst(address_v4::from_string("10.0.0.2"), 6881)
+		, num_packets(num_packets)
+		, sent(0)
+		, received(0)
+	{
+		boost::system::error_code ec;
+		sender.open(udp::v4(), ec);
+		sender.io_control(udp::socket::non_blocking_io(true), ec);
+		receiver.open(udp::v4(), ec);
+		receiver.bind(udp::endpoint(address(), 6881), ec);
+		std::memset(send_buf, 0, sizeof(send_buf));
+
+		start_receive();
+		// the DSL modems are 200 kB/s up, send a packet every 10 ms
+		start_timer();
+	}
+
+	void start_receive()
+	{
+		receiver.async_receive_from(mutable_buffers_1(recv_buf, sizeof(recv_buf))
+			, from, std::bind(&udp_test::on_receive, this, _1, _2));
+	}
+
+	void on_receive(boost::system::error_code const& ec, std::size_t)
+	{
+		if (ec) return;
+		++received;
+		start_receive();
+	}
+
+	void start_timer()
+	{
+		timer.expires_from_now(sim::chrono::milliseconds(10));
+		timer.async_wait(std::bind(&udp_test::on_timer, this, _1));
+	}
+
+	void on_timer(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		boost::system::error_code err;
+		sender.send_to(buffer(send_buf, sizeof(send_buf)), dst, 0, err);
+		if (++sent == num_packets)
+		{
+			receiver.close();
+			return;
+		}
+		start_timer();
+	}
+
+	io_service ios_a;
+	io_service ios_b;
+	udp::socket sender;
+	udp::socket receiver;
+	high_resolution_timer timer;
+	udp::endpoint const dst;
+	udp::endpoint from;
+	char send_buf[1000];
+	char recv_buf[1500];
+	int const num_packets;
+	int sent;
+	int received;
+};
+
+struct tcp_test
+{
+	tcp_test(simulation& sim, int num_bytes, bool virtual_bytes)
+		: ios_a(sim, address_v4::from_string("10.0.0.1"))
+		, ios_b(sim, address_v4::from_string("10.0.0.2"))
+		, listener(ios_b)
+		, incoming(ios_b)
+		, outgoing(ios_a)
+		, num_bytes(num_bytes)
+		, virtual_bytes(virtual_bytes)
+		, written(0)
+		, received(0)
+	{
+		boost::system::error_code ec;
+		listener.open(tcp::v4(), ec);
+		listener.bind(tcp::endpoint(address(), 8080), ec);
+		listener.listen(10, ec);
+		std::memset(send_buf, 0, sizeof(send_buf));
+
+		listener.async_accept(incoming, std::bind(&tcp_test::on_accept, this, _1));
+		outgoing.async_connect(tcp::endpoint(address_v4::from_string("10.0.0.2"), 8080)
+			, std::bind(&tcp_test::on_connect, this, _1));
+	}
+
+	void on_accept(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		start_read();
+	}
+
+	void start_read()
+	{
+		incoming.async_read_some(buffer(recv_buf, sizeof(recv_buf))
+			, std::bind(&tcp_test::on_read, this, _1, _2));
+	}
+
+	void on_read(boost::system::error_code const& ec, std::size_t bytes)
+	{
+		if (ec) return;
+		received += int(bytes);
+		start_read();
+	}
+
+	void on_connect(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		start_write();
+	}
+
+	void start_write()
+	{
+		if (virtual_bytes)
+		{
+			outgoing.async_write_virtual(sizeof(send_buf)
+				, std::bind(&tcp_test::on_write, this, _1, _2));
+			return;
+		}
+		outgoing.async_write_some(buffer(send_buf, sizeof(send_buf))
+			, std::bind(&tcp_test::on_write, this, _1, _2));
+	}
+
+	void on_write(boost::system::error_code const& ec, std::size_t bytes)
+	{
+		if (ec) return;
+		written += int(bytes);
+		if (written >= num_bytes)
+		{
+			outgoing.close();
+			return;
+		}
+		start_write();
+	}
+
+	io_service ios_a;
+	io_service ios_b;
+	tcp::acceptor listener;
+	tcp::socket incoming;
+	tcp::socket outgoing;
+	char send_buf[16 * 1024];
+	char recv_buf[16 * 1024];
+	int const num_bytes;
+	bool const virtual_bytes;
+	int written;
+	int received;
+};
+
+void run_udp(int num_packets)
+{
+	default_config cfg;
+	simulation sim(cfg);
+	udp_test t(sim, num_packets);
+
+	std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+	std::uint64_t const before = g_allocations;
+	std::uint64_t const events = sim.run();
+	report("udp", std::uint64_t(t.received), g_allocations - before, events, start);
+}
+
+template <typename Config>
+void run_tcp(char const* name, int num_bytes, bool virtual_bytes)
+{
+	Config cfg;
+	simulation sim(cfg);
+	tcp_test t(sim, num_bytes, virtual_bytes);
+
+	std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+	std::uint64_t const before = g_allocations;
+	std::uint64_t const events = sim.run();
+	// counted as two packets per segment, a payload and an ACK, to compare
+	// with earlier versions that ACKed every segment. Every other one is
+	// ACKed now
+	report(name, std::uint64_t(t.received / 1475) * 2, g_allocations - before
+		, events, start);
+}
+
+}
+
+int main(int argc, char const* argv[])
+{
+	const int num_packets = argc > 1 ? std::atoi(argv[1]) : 20000;
+	run_udp(num_packets);
+	run_tcp<default_config>("tcp", num_packets * 1475, false);
+	// the same transfer, with packets that carry virtual bytes
+	run_tcp<default_config>("tcp-v", num_packets * 1475, true);
+	// and over a LAN
+	run_tcp<lan_config>("tcp-l", num_packets * 1475, true);
+	return 0;
+}
+
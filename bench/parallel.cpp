@@ -0,0 +1,185 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// this benchmark runs a swarm of nodes exchanging UDP packets, with some
+// amount of work done for every packet, on an increasing number of threads.
+// Once over a network with 30 ms latency between all nodes, and once with the
+// nodes grouped into LANs without latency
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace sim::asio;
+using sim::simulation;
+using sim::default_config;
+using namespace std::placeholders;
+
+namespace {
+
+struct node
+{
+	node(simulation& sim, int idx, int num_nodes, int work)
+		: m_ios(sim, ip::address_v4(0x0a000001 + idx))
+		, m_sock(m_ios)
+		, m_timer(m_ios)
+		, m_idx(idx)
+		, m_num_nodes(num_nodes)
+		, m_work(work)
+	{
+		boost::system::error_code ec;
+		m_sock.open(ip::udp::v4(), ec);
+		m_sock.bind(ip::udp::endpoint(ip::address(), 6881), ec);
+		m_sock.io_control(ip::udp::socket::non_blocking_io(true), ec);
+		receive();
+		m_timer.expires_from_now(sim::chrono::milliseconds(1 + idx % 10));
+		m_timer.async_wait(std::bind(&node::on_timer, this, _1));
+	}
+
+	void receive()
+	{
+		m_sock.async_receive_from(mutable_buffers_1(m_buf, sizeof(m_buf))
+			, m_from, std::bind(&node::on_receive, this, _1, _2));
+	}
+
+	// stand-in for the protocol logic of a real node
+	void work()
+	{
+		for (int i = 0; i < m_work; ++i)
+			m_state = m_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	}
+
+	void on_receive(boost::system::error_code const& ec, std::size_t /* bytes */)
+	{
+		if (ec) return;
+		work();
+		receive();
+	}
+
+	void on_timer(boost::system::error_code const& ec)
+	{
+		if (ec || ++m_sent > 50) return;
+		work();
+		int const target = int((m_state >> 33) % m_num_nodes);
+		m_sock.send_to(buffer(m_buf, 100)
+			, ip::udp::endpoint(ip::address_v4(0x0a000001 + target), 6881), 0
+			, m_ec);
+		m_timer.expires_from_now(sim::chrono::milliseconds(10));
+		m_timer.async_wait(std::bind(&node::on_timer, this, _1));
+	}
+
+	io_service m_ios;
+	ip::udp::socket m_sock;
+	high_resolution_timer m_timer;
+	ip::udp::endpoint m_from;
+	boost::system::error_code m_ec;
+	int const m_idx;
+	int const m_num_nodes;
+	int const m_work;
+	int m_sent = 0;
+	std::uint64_t m_state = 1;
+	char m_buf[1500];
+};
+
+// nodes are in LANs of 16. Packets within a LAN go through a rate limited
+// switch, without any latency, which means the nodes of a LAN must run on
+// the same thread
+struct lan_config : default_config
+{
+	explicit lan_config(int num_nodes) : m_num_nodes(num_nodes) {}
+
+	virtual void build(simulation& sim) override
+	{
+		default_config::build(sim);
+		for (int i = 0; i < (m_num_nodes + 15) / 16; ++i)
+		{
+			m_lan.push_back(std::make_shared<sim::queue>(
+				std::ref(sim.get_io_service()), 10 * 1000 * 1000
+				, sim::chrono::high_resolution_clock::duration(0), 0, "LAN"));
+		}
+	}
+
+	virtual sim::route channel_route(ip::address src, ip::address dst) override
+	{
+		int const lan = node_cluster(src);
+		if (lan != node_cluster(dst)) return default_config::channel_route(src, dst);
+		return sim::route().append(m_lan[lan]);
+	}
+
+	virtual int node_cluster(ip::address ip) override
+	{ return int(ip.to_v4().to_ulong() - 0x0a000001) / 16; }
+
+private:
+	int const m_num_nodes;
+	std::vector<std::shared_ptr<sim::queue>> m_lan;
+};
+
+// returns the wall clock time, in milliseconds
+double run(sim::configuration& cfg, int num_nodes, int work, int num_threads)
+{
+	simulation sim(cfg);
+	sim.set_num_threads(num_threads);
+
+	std::vector<std::unique_ptr<node>> nodes;
+	for (int i = 0; i < num_nodes; ++i)
+		nodes.emplace_back(new node(sim, i, num_nodes, work));
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const std::size_t events = sim.run();
+	const double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count() / 1000.0;
+
+	std::printf("%-5s nodes: %5d work: %6d threads: %2d events: %8d  %8.1f ms"
+		, dynamic_cast<lan_config*>(&cfg) ? "lan" : "mesh"
+		, num_nodes, work, num_threads, int(events), ms);
+	return ms;
+}
+
+}
+
+int main(int argc, char const* argv[])
+{
+	const int num_nodes = argc > 1 ? std::atoi(argv[1]) : 10000;
+	const int max_threads = argc > 2 ? std::atoi(argv[2])
+		: int((std::max)(1u, std::thread::hardware_concurrency()));
+
+	for (int work : {100, 10000})
+	{
+		for (bool lan : {false, true})
+		{
+			double serial = 0;
+			for (int threads = 1; threads <= max_threads; threads *= 2)
+			{
+				default_config mesh;
+				lan_config lans(num_nodes);
+				const double ms = run(lan ? static_cast<sim::configuration&>(lans)
+					: mesh, num_nodes, work, threads);
+				if (threads == 1) serial = ms;
+				std::printf("  speedup: %5.2f\n", serial / ms);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// this benchmark measures the overhead of posting handlers to the simulation,
+// interleaved with timers, the way socket operations complete
+
+#include "simulator/simulator.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace sim::asio;
+using sim::simulation;
+using sim::default_config;
+using namespace std::placeholders;
+
+namespace {
+
+struct node
+{
+	node(io_service& ios, int& budget) : m_ios(ios), m_timer(ios), m_budget(budget) {}
+
+	void on_post()
+	{
+		if (--m_budget <= 0) return;
+		// every 16th completion waits for a timer, the rest complete
+		// immediately
+		if ((++m_counter & 15) == 0)
+		{
+			m_timer.expires_from_now(sim::chrono::microseconds(m_counter % 1000 + 1));
+			m_timer.async_wait(std::bind(&node::on_timer, this, _1));
+			return;
+		}
+		m_ios.post(std::bind(&node::on_post, this));
+	}
+
+	void on_timer(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		on_post();
+	}
+
+	io_service& m_ios;
+	high_resolution_timer m_timer;
+	int& m_budget;
+	int m_counter = 0;
+};
+
+void run(int num_nodes, int num_events)
+{
+	default_config cfg;
+	simulation sim(cfg);
+	io_service ios(sim, ip::address_v4::from_string("1.2.3.4"));
+
+	int budget = num_events;
+	std::vector<std::unique_ptr<node>> nodes;
+	for (int i = 0; i < num_nodes; ++i)
+		nodes.emplace_back(new node(ios, budget));
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (auto& n : nodes) ios.post(std::bind(&node::on_post, n.get()));
+	const std::size_t events = sim.run();
+
+	const double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count() / 1000.0;
+
+	std::printf("nodes: %6d events: %9d  %8.1f ms  %6.2f Mevents/s\n"
+		, num_nodes, int(events), ms, events / ms / 1000.0);
+}
+
+}
+
+int main(int argc, char const* argv[])
+{
+	const int num_events = argc > 1 ? std::atoi(argv[1]) : 5000000;
+
+	for (int num_nodes : {10, 1000, 10000})
+		run(num_nodes, num_events);
+	return 0;
+}
+
@@ -0,0 +1,126 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// this benchmark compares the timer queue implementations the simulation can
+// use. Every timer that fires re-arms itself and reschedules another pending
+// timer, which is the typical pattern of timeouts in a swarm simulation.
+
+#include "simulator/simulator.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace sim::asio;
+using sim::simulation;
+using sim::default_config;
+using namespace std::placeholders;
+
+namespace {
+
+struct bench_state
+{
+	std::vector<std::unique_ptr<high_resolution_timer>> timers;
+	std::uint32_t rnd;
+	int fired;
+	int limit;
+
+	sim::chrono::high_resolution_clock::duration random_delay()
+	{
+		rnd = rnd * 1103515245 + 12345;
+		// mostly short timeouts, some long ones
+		const int r = (rnd >> 8) % 10000;
+		if (r < 100) return sim::chrono::seconds(r + 1);
+		return sim::chrono::microseconds((r + 1) * 10);
+	}
+
+	int random_timer()
+	{
+		rnd = rnd * 1103515245 + 12345;
+		return int((rnd >> 8) % timers.size());
+	}
+};
+
+void arm(bench_state& s, int idx);
+
+void on_timer(bench_state& s, int idx, boost::system::error_code const& ec)
+{
+	if (ec) return;
+	if (++s.fired >= s.limit) return;
+
+	arm(s, idx);
+
+	// reschedule some other timer that's still pending
+	arm(s, s.random_timer());
+}
+
+void arm(bench_state& s, int idx)
+{
+	high_resolution_timer& t = *s.timers[idx];
+	t.expires_from_now(s.random_delay());
+	t.async_wait(std::bind(&on_timer, std::ref(s), idx, _1));
+}
+
+void run(char const* name, simulation::scheduler_t sched, int num_timers
+	, int num_fires)
+{
+	default_config cfg;
+	simulation sim(cfg, sched);
+	io_service ios(sim, ip::address_v4::from_string("1.2.3.4"));
+
+	bench_state s;
+	s.rnd = 0x1337;
+	s.fired = 0;
+	s.limit = num_fires;
+	for (int i = 0; i < num_timers; ++i)
+		s.timers.emplace_back(new high_resolution_timer(ios));
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < num_timers; ++i) arm(s, i);
+	sim.run();
+
+	// drop the remaining timers before the simulation
+	for (auto& t : s.timers) t->cancel();
+	sim.run();
+
+	const double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count() / 1000.0;
+
+	std::printf("%-14s timers: %7d fires: %8d  %8.1f ms  %6.2f Mfires/s\n"
+		, name, num_timers, s.fired, ms, s.fired / ms / 1000.0);
+}
+
+}
+
+int main(int argc, char const* argv[])
+{
+	const int num_fires = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+	for (int num_timers : {1000, 100000})
+	{
+		run("multiset", simulation::multiset_scheduler, num_timers, num_fires);
+		run("4-ary heap", simulation::heap_scheduler, num_timers, num_fires);
+		run("timing wheel", simulation::timing_wheel_scheduler, num_timers, num_fires);
+	}
+	return 0;
+}
+
@@ -0,0 +1,322 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef EVENT_QUEUE_HPP_INCLUDED
+#define EVENT_QUEUE_HPP_INCLUDED
+
+#include "simulator/simulator.hpp"
+
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <array>
+#include <mutex>
+
+namespace sim { namespace aux
+{
+	// this is the interface of the data structure the simulation keeps its
+	// pending events in (timers and posted handlers). Events are ordered by
+	// their time, and events at the same time are ordered by the node that
+	// scheduled them and their sequence number (see event_queue_hook). Every
+	// implementation must produce events in exactly the same order, to keep
+	// simulations deterministic regardless of which one is used.
+	struct SIMULATOR_DECL event_queue
+	{
+		event_queue();
+		virtual ~event_queue() {}
+
+		// add an event that's not currently in the queue. Its time and
+		// sequence number must already be set
+		virtual void insert(event* t) = 0;
+
+		// reschedule an event that's already in the queue
+		virtual void update(event* t
+			, chrono::high_resolution_clock::time_point time
+			, std::uint32_t origin
+			, std::uint64_t sequence) = 0;
+
+		// remove an event that's in the queue
+		virtual void remove(event* t) = 0;
+
+		// add an event that's most likely not due before any other event
+		// previously added with append(), such as a handler posted at the
+		// current time. These events are kept in a FIFO, linked through their
+		// hooks, which is a lot cheaper than insert(). If the event would break
+		// the order of the FIFO, it's inserted instead. Appended events can't be
+		// updated or removed
+		void append(event* e);
+
+		// returns the event that's due first, without removing it. Returns
+		// nullptr if the queue is empty
+		event* front();
+
+		// remove the event that's due first
+		void pop_front();
+
+		bool empty() const { return m_fifo_head == nullptr && ordered_size() == 0; }
+		std::size_t size() const { return m_fifo_size + ordered_size(); }
+
+		// returns true if lhs should be invoked before rhs
+		static bool compare(event const* lhs
+			, event const* rhs)
+		{
+			event_queue_hook const& l = lhs->queue_hook();
+			event_queue_hook const& r = rhs->queue_hook();
+			if (l.time != r.time) return l.time < r.time;
+			if (l.origin != r.origin) return l.origin < r.origin;
+			return l.sequence < r.sequence;
+		}
+
+	protected:
+
+		// these are implemented by the specific data structure, and only
+		// concern the events added with insert()
+		virtual event* ordered_front() = 0;
+		virtual void ordered_pop_front() = 0;
+		virtual std::size_t ordered_size() const = 0;
+
+	private:
+
+		// the events added with append(), in order
+		event* m_fifo_head;
+		event* m_fifo_tail;
+		std::size_t m_fifo_size;
+	};
+
+	// this is the original timer queue. A node based tree with one allocation
+	// per scheduled event
+	struct SIMULATOR_DECL multiset_event_queue final : event_queue
+	{
+		virtual void insert(event* t) override;
+		virtual void update(event* t
+			, chrono::high_resolution_clock::time_point time
+			, std::uint32_t origin
+			, std::uint64_t sequence) override;
+		virtual void remove(event* t) override;
+
+	protected:
+
+		virtual event* ordered_front() override;
+		virtual void ordered_pop_front() override;
+		virtual std::size_t ordered_size() const override { return m_queue.size(); }
+
+	private:
+
+		struct event_compare
+		{
+			bool operator()(event const* lhs
+				, event const* rhs) const
+			{ return event_queue::compare(lhs, rhs); }
+		};
+
+		typedef std::multiset<event*, event_compare> queue_t;
+		queue_t m_queue;
+	};
+
+	// a 4-ary min-heap of events. Each event knows its own position in the
+	// heap, which makes removing and rescheduling O(log n) without searching
+	struct SIMULATOR_DECL heap_event_queue final : event_queue
+	{
+		virtual void insert(event* t) override;
+		virtual void update(event* t
+			, chrono::high_resolution_clock::time_point time
+			, std::uint32_t origin
+			, std::uint64_t sequence) override;
+		virtual void remove(event* t) override;
+
+	protected:
+
+		virtual event* ordered_front() override;
+		virtual void ordered_pop_front() override;
+		virtual std::size_t ordered_size() const override { return m_heap.size(); }
+
+	private:
+
+		// restore the heap property after the key of t changed
+		void fix(event* t);
+		void sift_up(std::size_t i);
+		void sift_down(std::size_t i);
+		void place(std::size_t i, event* t)
+		{
+			m_heap[i] = t;
+			t->queue_hook().index = i;
+		}
+
+		std::vector<event*> m_heap;
+	};
+
+	// a hierarchical timing wheel. Events are hashed into buckets by their
+	// time, at a granularity of ``resolution``. Inserting, removing and
+	// rescheduling events is O(1). Once the wheel reaches a bucket, its events
+	// are moved into a small heap to invoke them in exact order, so the
+	// resolution only affects performance, not the order events are invoked
+	// in.
+	struct SIMULATOR_DECL timing_wheel final : event_queue
+	{
+		explicit timing_wheel(chrono::high_resolution_clock::duration resolution
+			= chrono::microseconds(1));
+
+		virtual void insert(event* t) override;
+		virtual void update(event* t
+			, chrono::high_resolution_clock::time_point time
+			, std::uint32_t origin
+			, std::uint64_t sequence) override;
+		virtual void remove(event* t) override;
+
+	protected:
+
+		virtual event* ordered_front() override;
+		virtual void ordered_pop_front() override;
+		virtual std::size_t ordered_size() const override { return m_size; }
+
+	private:
+
+		// every level has 256 buckets, and each level covers 256 times the
+		// time span of the level below it. 8 levels cover the full 64 bit range
+		// of ticks
+		enum { slot_bits = 8, num_slots = 1 << slot_bits, num_levels = 8 };
+
+		std::uint64_t tick(chrono::high_resolution_clock::time_point t) const;
+
+		// insert t into the bucket it belongs in, relative to m_current, or
+		// into m_due if it expires at the current tick (or earlier)
+		void link(event* t);
+		void unlink(event* t);
+
+		// move the wheel forward to the next non-empty bucket and move its
+		// events into m_due. Returns false if the wheel is empty
+		bool advance();
+
+		// the number of nanoseconds per tick
+		const std::int64_t m_resolution;
+
+		// the tick the wheel is at. All events in the buckets are due after
+		// this tick
+		std::uint64_t m_current;
+
+		// the total number of events in the wheel and in m_due
+		std::size_t m_size;
+
+		// the first event in each bucket. Bucket (level * num_slots + slot)
+		std::vector<event*> m_buckets;
+
+		// one bit per bucket, set if the bucket is non-empty. This makes
+		// finding the next non-empty bucket cheap
+		std::array<std::uint64_t, num_levels * num_slots / 64> m_occupied;
+
+		// events due at the current tick or earlier, in exact order
+		heap_event_queue m_due;
+	};
+
+	// a handler posted to an io_service. These are allocated by the
+	// simulation and recycled once the handler has been invoked, to avoid a
+	// heap allocation per post
+	struct SIMULATOR_DECL posted_handler final : event
+	{
+		explicit posted_handler(simulation& sim) : m_sim(sim) {}
+
+		virtual void invoke() override;
+		virtual void abandon() override;
+
+		boost::function<void()> handler;
+
+	private:
+		simulation& m_sim;
+	};
+
+	// a packet handed over from one node to another, across a network route
+	// with a fixed delay. These are recycled by the simulation, like posted
+	// handlers
+	struct SIMULATOR_DECL packet_event final : event
+	{
+		explicit packet_event(simulation& sim) : m_sim(sim) {}
+
+		virtual void invoke() override;
+		virtual void abandon() override;
+
+		packet pkt;
+
+	private:
+		simulation& m_sim;
+	};
+
+	SIMULATOR_DECL std::unique_ptr<event_queue> make_event_queue(
+		simulation::scheduler_t s);
+
+	struct address_pair_hash
+	{
+		std::size_t operator()(std::pair<asio::ip::address, asio::ip::address> const& k) const
+		{ return hash(k.first) * 31 + hash(k.second); }
+
+		static std::size_t hash(asio::ip::address const& a)
+		{
+			if (a.is_v4()) return std::size_t(a.to_v4().to_ulong());
+			std::size_t ret = 0;
+			for (unsigned char const b : a.to_v6().to_bytes())
+				ret = ret * 31 + b;
+			return ret;
+		}
+	};
+
+	// the events of a group of nodes, invoked by the same thread. See
+	// simulation::set_num_threads()
+	struct SIMULATOR_DECL partition
+	{
+		explicit partition(simulation::scheduler_t s)
+			: queue(make_event_queue(s))
+			, route_generation(0)
+		{}
+		~partition();
+
+		std::unique_ptr<event_queue> queue;
+
+		// posted handler objects that aren't in use, to be reused by the next
+		// call to post() from this partition
+		std::vector<posted_handler*> free_handlers;
+
+		// the same for packets handed over to other nodes
+		std::vector<packet_event*> free_packets;
+
+		// the first hop of the network between nodes, by destination node and
+		// delay, see simulation::network_route(). They're shared by every
+		// packet sent from this partition, rather than allocated per packet
+		std::map<std::pair<std::uint32_t, chrono::high_resolution_clock::rep>
+			, std::shared_ptr<sink>> boundaries;
+
+		// the routes of UDP packets sent from this partition, by source and
+		// destination address, see simulation::udp_route(). They're dropped
+		// once route_generation is behind the simulation's
+		std::unordered_map<std::pair<asio::ip::address, asio::ip::address>
+			, std::shared_ptr<route const>, address_pair_hash> routes;
+		std::uint64_t route_generation;
+
+		// packets handed over by nodes in other partitions. They are moved
+		// into the queue before the next window starts
+		std::mutex inbox_mutex;
+		std::vector<event*> inbox;
+
+		// the time of the last event invoked in this partition
+		chrono::high_resolution_clock::time_point last_time;
+	};
+
+} // aux
+} // sim
+
+#endif
+
@@ -0,0 +1,98 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef FLOW_NETWORK_HPP_INCLUDED
+#define FLOW_NETWORK_HPP_INCLUDED
+
+#include "simulator/simulator.hpp"
+
+#include <vector>
+#include <memory>
+
+namespace sim { namespace aux
+{
+	// the flows of the flow-level network model (see
+	// simulation::set_network_model()). Each flow is sent over the sinks of
+	// its route that have a flow_capacity(), and the flows through a sink
+	// share its capacity max-min fairly. Between flows starting or finishing
+	// every flow is sent at a constant rate, so only the time the next flow
+	// finishes needs an event
+	struct SIMULATOR_DECL flow_network
+	{
+		explicit flow_network(simulation& sim);
+		~flow_network();
+
+		// start sending p to node ``dst``, from its next hop to the last hop
+		// of its route. Its size on the wire is its payload plus its overhead.
+		// A flow to no_node isn't delivered
+		static std::uint32_t const no_node = 0xffffffff;
+		void add(std::uint32_t dst, flow_handler* h, packet p);
+
+		// stop notifying h about its flows
+		void detach(flow_handler* h);
+
+		std::size_t num_flows() const { return m_flows.size(); }
+
+	private:
+
+		struct flow
+		{
+			packet pkt;
+			flow_handler* handler;
+			std::uint32_t dst;
+
+			// the sum of the flow_latency() of the hops
+			chrono::high_resolution_clock::duration latency;
+
+			// the hops limiting the rate of the flow
+			std::vector<sink*> links;
+
+			// the number of bytes left to send, and the bytes per second
+			// they're sent at. Flows whose rate hasn't been computed yet have a
+			// rate of 0, and flows not going through any link an infinite rate
+			double remaining;
+			double rate;
+		};
+
+		// bring the flows up to the current time, deliver the ones that are
+		// done, and recompute the rates of the rest
+		void update();
+		void on_timer(boost::system::error_code const& ec);
+
+		// assigns the max-min fair rates to the flows
+		void compute_rates();
+
+		simulation& m_sim;
+
+		// fires when the next flow is done
+		asio::high_resolution_timer m_timer;
+
+		// in the order the flows were started
+		std::vector<std::unique_ptr<flow>> m_flows;
+
+		// the time the remaining bytes of the flows were last updated
+		chrono::high_resolution_clock::time_point m_last_update;
+
+		// flows started at the same time are added to the network together,
+		// with a single update posted by the first one
+		bool m_update_posted;
+	};
+}}
+
+#endif // FLOW_NETWORK_HPP_INCLUDED
+
@@ -21,28 +21,61 @@ All rights reserved.
 
 #include "simulator/simulator.hpp"
 
+#include <vector>
+#include <cstdint>
+
 namespace sim
 {
 
 	// this is a queue. It can be configured to contrain
 	struct SIMULATOR_DECL queue : sink
 	{
-		queue(asio::io_service& ios, int bandwidth
+		// bandwidth is in bytes per second and max_queue_size in bytes. 0
+		// means unlimited
+		queue(asio::io_service& ios, std::int64_t bandwidth
 			, chrono::high_resolution_clock::duration propagation_delay
-			, int max_queue_size, std::string name = "queue");
+			, std::int64_t max_queue_size, std::string name = "queue");
+
+		~queue();
 
 		virtual void incoming_packet(aux::packet p) override final;
 
 		virtual std::string label() const override final;
 
+		// a queue without a bandwidth limit and without a size limit only
+		// delays packets
+		virtual chrono::high_resolution_clock::duration fixed_delay() const
+			override final;
+
+		// flows share the bandwidth, and are delayed by the latency
+		virtual std::int64_t flow_capacity() const override final
+		{ return m_bandwidth; }
+		virtual chrono::high_resolution_clock::duration flow_latency() const
+			override final
+		{ return m_forwarding_latency; }
+
 	private:
 
-		void begin_send_next_packet();
+		// arms the timer for the departure of the packet at the front of the
+		// queue
+		void send_next_packet();
 		void next_packet_sent();
 
+		// the segments of a train are queued (or dropped) one by one, but
+		// leave in evenly spaced runs that are forwarded as trains of their own
+		void incoming_train(aux::packet p);
+
+		// takes the packets and segments that have been sent by ``now`` off
+		// m_queue_size
+		void release_sent(chrono::high_resolution_clock::time_point now);
+
+		// the time it takes to send packet_size bytes at m_bandwidth
+		chrono::high_resolution_clock::duration serialization_delay(
+			int packet_size);
+
 		// the queue can't hold more than this number of bytes. Once it's full,
 		// any new packets arriving will be dropped (tail drop)
-		const int m_max_queue_size;
+		const std::int64_t m_max_queue_size;
 
 		// the amount of time it takes to forward a packet. Every packet is
 		// delayed by at least this much before being forwarded
@@ -50,18 +83,66 @@ namespace sim
 
 		// the number of bytes per second that can be sent. This includes the
 		// packet overhead
-		const int m_bandwidth;
+		const std::int64_t m_bandwidth;
 
-		// the number of bytes currently in the packet queue
-		int m_queue_size;
+		// the time it takes to send one byte, in nanoseconds, as a 32.32 fixed
+		// point number. It's split in its integer and fractional parts, to
+		// multiply it by a packet size without overflowing 64 bits
+		std::uint64_t m_ns_per_byte;
+		std::uint64_t m_ns_per_byte_frac;
 
-		std::string m_node_name;
+		// the fraction of a nanosecond (in units of 2^-32) the serialization
+		// times have been rounded down by so far. It's carried over to the next
+		// packet, to not lose any time at high rates, where a byte takes less
+		// than a nanosecond to send
+		std::uint64_t m_frac_carry;
 
-		// this is the queue of packets and the time each packet was enqueued
-		std::deque<std::pair<chrono::high_resolution_clock::time_point, aux::packet>> m_queue;
-		asio::high_resolution_timer m_forward_timer;
+		// the number of bytes currently in the packet queue. Every segment of
+		// a train counts until it has been sent, even though the train is
+		// forwarded with its first segment
+		std::int64_t m_queue_size;
 
+		std::string m_node_name;
+
+		// this is the queue of packets and the time each packet leaves the
+		// queue.
+		// The front of the queue is at m_queue_head. Packets are popped by
+		// advancing the head, and the vector is only compacted once it's empty
+		// or mostly consumed, to keep its capacity around rather than
+		// allocating a new chunk every few packets
+		std::vector<std::pair<chrono::high_resolution_clock::time_point, aux::packet>> m_queue;
+		std::size_t m_queue_head;
+
+		// the departure time and size of every packet and segment that's
+		// counted in m_queue_size, in the order they leave. The front is at
+		// m_releases_head, like for m_queue
+		std::vector<std::pair<chrono::high_resolution_clock::time_point, int>> m_releases;
+		std::size_t m_releases_head;
+
+		// the departure of the packet at the front of the queue. The packets
+		// in the queue hold their routes, which hold this queue. If the
+		// simulation is destructed before they leave, they're dropped, or
+		// they would never be freed
+		struct departure_event final : aux::event
+		{
+			explicit departure_event(queue& q) : m_queue(q), m_scheduled(false) {}
+			virtual void invoke() override;
+			virtual void abandon() override;
+
+			queue& m_queue;
+			bool m_scheduled;
+		};
+
+		asio::io_service& m_ios;
+		departure_event m_departure;
+
+		// the time the last packet in the queue will have been sent. New
+		// packets can't start being sent before this
 		chrono::high_resolution_clock::time_point m_last_forward;
+
+		// the departure time of every segment of the train being queued.
+		// It's kept around to not allocate it for every train
+		std::vector<chrono::high_resolution_clock::time_point> m_departures;
 	};
 
 }
@@ -26,8 +26,7 @@ All rights reserved.
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/asio/read.hpp>
-#include <deque>
-#include <mutex>
+#include <boost/container/small_vector.hpp>
 
 #if defined _MSC_VER && _MSC_VER < 1900
 #include <stdio.h>
@@ -57,12 +56,16 @@ inline int snprintf(char* buf, int len, char const* fmt, ...)
 
 #include <boost/system/error_code.hpp>
 #include <boost/function.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
 #include <map>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #include <set>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <atomic>
 
 #ifdef SIMULATOR_BUILDING_SHARED
 #define SIMULATOR_DECL BOOST_SYMBOL_EXPORT
@@ -80,13 +83,76 @@ inline int snprintf(char* buf, int len, char const* fmt, ...)
 
 namespace sim
 {
+	namespace asio
+	{
+		struct high_resolution_timer;
+	}
+
 	namespace aux
 	{
 		struct channel;
 		struct packet;
+		struct payload;
 		struct sink_forwarder;
+		struct event_queue;
+		struct posted_handler;
+		struct packet_event;
+		struct node_demux;
+		struct partition;
+		struct flow_network;
 	}
 
+	namespace chrono
+	{
+#if defined BOOST_ASIO_HAS_STD_CHRONO
+	using std::chrono::seconds;
+	using std::chrono::milliseconds;
+	using std::chrono::microseconds;
+	using std::chrono::nanoseconds;
+	using std::chrono::minutes;
+	using std::chrono::hours;
+	using std::chrono::duration_cast;
+	using std::chrono::time_point;
+	using std::chrono::duration;
+#else
+	using boost::chrono::seconds;
+	using boost::chrono::milliseconds;
+	using boost::chrono::microseconds;
+	using boost::chrono::nanoseconds;
+	using boost::chrono::minutes;
+	using boost::chrono::hours;
+	using boost::chrono::duration_cast;
+	using boost::chrono::time_point;
+	using boost::chrono::duration;
+#endif
+
+	// std.chrono / boost.chrono compatible high_resolution_clock using a simulated time
+	struct SIMULATOR_DECL high_resolution_clock
+	{
+		typedef boost::int64_t rep;
+#if defined BOOST_ASIO_HAS_STD_CHRONO
+		typedef std::nano period;
+		typedef std::chrono::time_point<high_resolution_clock, nanoseconds> time_point;
+		typedef std::chrono::duration<boost::int64_t, std::nano> duration;
+#else
+		typedef boost::nano period;
+		typedef time_point<high_resolution_clock, nanoseconds> time_point;
+		typedef duration<boost::int64_t, boost::nano> duration;
+#endif
+		static const bool is_steady = true;
+		static time_point now();
+
+		// private interface
+		static void fast_forward(high_resolution_clock::duration d);
+
+		// makes now() and fast_forward() on the calling thread refer to the
+		// clock pointed to by t (nullptr unbinds the thread). Returns the clock
+		// the thread was bound to before
+		static time_point* bind(time_point* t);
+	};
+
+	} // chrono
+
 	// this is an interface for somthing that can accept incoming packets,
 	// such as queues, sockets, NATs and TCP congestion windows
 	struct SIMULATOR_DECL sink
@@ -97,10 +163,33 @@ namespace sim
 		virtual std::string label() const = 0;
 
 		virtual std::string attributes() const { return "shape=box"; }
+
+		// if all this sink does is to delay packets by a fixed amount of time
+		// (no bandwidth limit, no queue and no other side effects) return that
+		// delay, otherwise a negative duration. A route between two nodes made
+		// up of only such sinks is replaced by handing the packet straight to
+		// the destination node, which is what lets nodes run in parallel (see
+		// simulation::set_num_threads())
+		virtual chrono::high_resolution_clock::duration fixed_delay() const
+		{ return chrono::high_resolution_clock::duration(-1); }
+
+		// these describe the sink to the flow-level network model (see
+		// simulation::set_network_model()). The number of bytes per second
+		// shared by the flows passing through it, or 0 if it doesn't limit
+		// their rate. And the time it takes the bytes of a flow to pass through
+		// it
+		virtual std::int64_t flow_capacity() const { return 0; }
+		virtual chrono::high_resolution_clock::duration flow_latency() const
+		{
+			chrono::high_resolution_clock::duration const d = fixed_delay();
+			return d < chrono::high_resolution_clock::duration(0)
+				? chrono::high_resolution_clock::duration(0) : d;
+		}
 	};
 
 	// this represents a network route (a series of sinks to pass a packet
-	// through)
+	// through). Once built, a route is shared by all packets sent over it, as
+	// a std::shared_ptr<route const>, see aux::packet::hops
 	struct SIMULATOR_DECL route
 	{
 		friend route operator+(route lhs, route rhs)
@@ -121,62 +210,224 @@ namespace sim
 		{ hops.insert(hops.end(), r.hops.begin(), r.hops.end()); return *this; }
 		route& append(std::shared_ptr<sink> s) { hops.push_back(std::move(s)); return *this; }
 		bool empty() const { return hops.empty(); }
+		std::size_t size() const { return hops.size(); }
+		sink* hop(std::size_t i) const { return hops[i].get(); }
 		std::shared_ptr<sink> last() const
 		{ return hops.back(); }
 
 	private:
-		std::deque<std::shared_ptr<sink>> hops;
+		// routes are short. They're stored inline, to make building one
+		// cheap
+		boost::container::small_vector<std::shared_ptr<sink>, 6> hops;
 	};
 
 	void forward_packet(aux::packet p);
 
 	struct simulation;
 
-	namespace chrono
+	// the congestion control of a TCP socket. It owns the congestion window,
+	// and is told about every ACK and about segments being lost. See
+	// simulation::set_congestion_control() and
+	// tcp::socket::set_congestion_control()
+	struct SIMULATOR_DECL congestion_control
 	{
-#if defined BOOST_ASIO_HAS_STD_CHRONO
-	using std::chrono::seconds;
-	using std::chrono::milliseconds;
-	using std::chrono::microseconds;
-	using std::chrono::nanoseconds;
-	using std::chrono::minutes;
-	using std::chrono::hours;
-	using std::chrono::duration_cast;
-	using std::chrono::time_point;
-	using std::chrono::duration;
-#else
-	using boost::chrono::seconds;
-	using boost::chrono::milliseconds;
-	using boost::chrono::microseconds;
-	using boost::chrono::nanoseconds;
-	using boost::chrono::minutes;
-	using boost::chrono::hours;
-	using boost::chrono::duration_cast;
-	using boost::chrono::time_point;
-	using boost::chrono::duration;
-#endif
+		enum algorithm_t
+		{
+			// slow start, additive increase and halving on loss (with fast
+			// recovery)
+			reno,
+			// the window grows as a cubic function of the time since the last
+			// loss, and is cut to 70% on loss (RFC 8312)
+			cubic,
+			// a model-based controller, like BBR. It estimates the bottleneck
+			// bandwidth and the round-trip time from the ACKs, and keeps about
+			// two bandwidth-delay products in flight. It doesn't back off on
+			// loss
+			bbr
+		};
 
-	// std.chrono / boost.chrono compatible high_resolution_clock using a simulated time
-	struct SIMULATOR_DECL high_resolution_clock
-	{
-		typedef boost::int64_t rep;
-#if defined BOOST_ASIO_HAS_STD_CHRONO
-		typedef std::nano period;
-		typedef std::chrono::time_point<high_resolution_clock, nanoseconds> time_point;
-		typedef std::chrono::duration<boost::int64_t, std::nano> duration;
-#else
-		typedef boost::nano period;
-		typedef time_point<high_resolution_clock, nanoseconds> time_point;
-		typedef duration<boost::int64_t, boost::nano> duration;
-#endif
-		static const bool is_steady = true;
-		static time_point now();
+		// every algorithm starts with a window of 10 segments (RFC 6928)
+		static std::unique_ptr<congestion_control> create(algorithm_t a, int mss);
 
-		// private interface
-		static void fast_forward(high_resolution_clock::duration d);
+		// what the sender learns from an ACK
+		struct ack_sample
+		{
+			// the number of bytes it took out of flight
+			std::int64_t acked;
+
+			// the round-trip time of the last segment it ACKed, and the bytes
+			// per second delivered to the receiver since that segment was
+			// sent. Both are 0 if it didn't ACK any
+			chrono::high_resolution_clock::duration rtt;
+			double delivery_rate;
+
+			// the bytes delivered to the receiver, in total, and when the last
+			// segment it ACKed was sent. The ACKs of the segments sent after
+			// delivered reached prior_delivered belong to the next round-trip
+			std::int64_t delivered;
+			std::int64_t prior_delivered;
+		};
+		virtual void on_ack(ack_sample const& s) = 0;
+
+		// a segment was deemed lost. It's called once per window of data, the
+		// losses of the segments sent before the first one was noticed are
+		// part of the same congestion event
+		virtual void on_congestion() = 0;
+
+		// nothing was ACKed for a whole retransmission timeout, every segment
+		// in flight is deemed lost
+		virtual void on_timeout() = 0;
+
+		// the congestion window, in bytes. At least one segment
+		virtual std::int64_t cwnd() const = 0;
+
+		virtual ~congestion_control() {}
 	};
 
-	} // chrono
+	namespace aux
+	{
+		// the sender of a flow (see simulation::send_flow()) is told once all
+		// of its bytes have been sent
+		struct SIMULATOR_DECL flow_handler
+		{
+			virtual void flow_sent() = 0;
+		protected:
+			~flow_handler() {}
+		};
+
+		// the bytes carried by a packet. The bytes are held by an immutable,
+		// reference counted chunk, and a payload refers to a slice of it.
+		// Splitting a send buffer into segments, forwarding and queuing packets
+		// and consuming them in partial reads never copies or moves the bytes
+		struct SIMULATOR_DECL payload
+		{
+			payload() : m_seed(0), m_offset(0), m_size(0), m_virtual(false) {}
+
+			// copies the first n bytes of bufs into a new chunk. This is the only
+			// copy made of the bytes before they're copied into the receive
+			// buffer
+			static payload copy(std::vector<boost::asio::const_buffer> const& bufs
+				, std::size_t n);
+
+			// a new chunk of n bytes, filled in by the caller through data. It
+			// must be filled in before the payload (or a slice of it) is sent
+			static payload allocate(std::size_t n, std::uint8_t*& data);
+
+			// n virtual bytes. They aren't stored anywhere, byte i is
+			// virtual_byte(seed, offset + i), generated when it's copied out
+			static payload generate(std::uint64_t seed, std::uint64_t offset
+				, std::size_t n);
+
+			// the n bytes starting at offset, sharing this payload's chunk
+			payload slice(std::size_t offset, std::size_t n) const;
+
+			// adds the bytes of p to the end of this payload, if they follow
+			// this one's in the same chunk (or stream of virtual bytes).
+			// Returns false otherwise
+			bool append(payload const& p);
+
+			// removes n bytes from the front
+			void consume(std::size_t n);
+
+			// copies (or generates) the first n bytes into dst
+			void copy_to(void* dst, std::size_t n) const;
+
+			// only valid for payloads that aren't virtual
+			std::uint8_t const* data() const
+			{
+				assert(!m_virtual);
+				return m_chunk.get() + m_offset;
+			}
+			std::size_t size() const { return m_size; }
+			bool empty() const { return m_size == 0; }
+			bool is_virtual() const { return m_virtual; }
+
+		private:
+			boost::shared_ptr<std::uint8_t const[]> m_chunk;
+
+			// the seed virtual bytes are generated from
+			std::uint64_t m_seed;
+
+			// the offset into m_chunk or, for virtual payloads, into the stream
+			// of bytes generated from m_seed
+			std::uint64_t m_offset;
+			std::uint32_t m_size;
+			bool m_virtual;
+		};
+	}
+
+	namespace aux
+	{
+		struct event;
+
+		// this is the scheduling state of an event. It's kept inside the event
+		// and maintained by the event queue it's scheduled in, which lets the
+		// queue remove or reschedule an event without searching for it and
+		// without allocating a node per event
+		struct event_queue_hook
+		{
+			event_queue_hook()
+				: origin(0)
+				, owner(0)
+				, sequence(0)
+				, index(0)
+				, bucket(-1)
+				, prev(nullptr)
+				, next(nullptr)
+			{}
+
+			// the time the event is due (for timers, the expiration time)
+			chrono::high_resolution_clock::time_point time;
+
+			// events due at the same time are ordered by the node that scheduled
+			// them (origin), and then in the order that node scheduled them
+			// (sequence). Since the sequence numbers are per node, the order
+			// doesn't depend on how the events of different nodes interleave,
+			// which is what lets nodes run in parallel with the same result.
+			// These are assigned by the simulation every time the event is
+			// (re)scheduled
+			std::uint32_t origin;
+
+			// the node the event belongs to. This determines which thread invokes
+			// it, and which node is considered to be running while it's invoked
+			std::uint32_t owner;
+
+			std::uint64_t sequence;
+
+			// the position of the event in a heap
+			std::size_t index;
+
+			// the timing wheel bucket this event is linked into, or -1 if it's
+			// not in a bucket. prev and next link the events in a bucket
+			int bucket;
+			event* prev;
+			event* next;
+		};
+
+		// everything the simulation schedules derives from this. Timers and
+		// handlers posted to an io_service are kept in the same queue, which
+		// defines the order they run in
+		struct SIMULATOR_DECL event
+		{
+			// internal interface
+
+			event_queue_hook& queue_hook() { return m_queue_hook; }
+			event_queue_hook const& queue_hook() const { return m_queue_hook; }
+
+			// called by the simulation when the event is due. It has already been
+			// removed from the queue
+			virtual void invoke() = 0;
+
+			// called if the simulation is destructed while the event is still in
+			// its queue
+			virtual void abandon() = 0;
+
+		protected:
+			~event() {}
+
+			event_queue_hook m_queue_hook;
+		};
+	}
 
 	namespace asio
 	{
@@ -191,7 +442,7 @@ namespace sim
 
 	struct io_service;
 
-	struct SIMULATOR_DECL high_resolution_timer
+	struct SIMULATOR_DECL high_resolution_timer : aux::event
 	{
 		friend struct sim::simulation;
 
@@ -203,6 +454,11 @@ namespace sim
 			const time_type& expiry_time);
 		high_resolution_timer(io_service& io_service,
 			const duration_type& expiry_time);
+		~high_resolution_timer();
+
+		// the timer queue keeps pointers to timers, they can't be copied
+		high_resolution_timer(high_resolution_timer const&) = delete;
+		high_resolution_timer& operator=(high_resolution_timer const&) = delete;
 
 		std::size_t cancel(boost::system::error_code& ec);
 		std::size_t cancel();
@@ -222,15 +478,19 @@ namespace sim
 		void wait();
 		void wait(boost::system::error_code& ec);
 
-		void async_wait(boost::function<void(boost::system::error_code)> handler);
+		void async_wait(boost::function<void(boost::system::error_code const&)> handler);
 
 		io_service& get_io_service() const { return m_io_service; }
 
 	private:
 
+		// the timer expired
+		virtual void invoke() override;
+		virtual void abandon() override;
+
+		// post the handler, if there is one
 		void fire(boost::system::error_code ec);
 
-		time_type m_expiration_time;
 		boost::function<void(boost::system::error_code const&)> m_handler;
 		io_service& m_io_service;
 		bool m_expired;
@@ -249,6 +509,7 @@ namespace sim
 			, m_open(false)
 			, m_non_blocking(false)
 			, m_max_receive_queue_size(64 * 1024)
+			, m_max_send_queue_size(64 * 1024)
 		{
 		}
 
@@ -271,10 +532,10 @@ namespace sim
 			return ec;
 		}
 
-		boost::system::error_code set_option(send_buffer_size const&
+		boost::system::error_code set_option(send_buffer_size const& op
 			, boost::system::error_code& ec)
 		{
-			// TODO: implement
+			m_max_send_queue_size = op.value();
 			return ec;
 		}
 
@@ -296,6 +557,13 @@ namespace sim
 			return ec;
 		}
 
+		boost::system::error_code get_option(send_buffer_size& op
+			, boost::system::error_code& ec)
+		{
+			op = m_max_send_queue_size;
+			return ec;
+		}
+
 		template <class IoControl>
 		boost::system::error_code io_control(IoControl const&
 			, boost::system::error_code& ec) { return ec; }
@@ -347,6 +615,10 @@ namespace sim
 		// make the queue size not grow too long in time.
 		int m_max_receive_queue_size;
 
+		// the max number of bytes written to a TCP socket that haven't been
+		// sent yet
+		int m_max_send_queue_size;
+
 	};
 
 	namespace ip {
@@ -782,7 +1054,24 @@ namespace sim
 
 		typedef basic_endpoint<tcp> endpoint;
 
-		struct SIMULATOR_DECL socket : socket_base<tcp>, sink
+		// socket options
+		using no_delay = boost::asio::ip::tcp::no_delay;
+
+		// like TCP_CORK on linux. asio doesn't have it, and it's never passed
+		// to a real socket, so it's the simulator's own option type
+		struct cork
+		{
+			cork() : m_value(false) {}
+			explicit cork(bool v) : m_value(v) {}
+			cork& operator=(bool v) { m_value = v; return *this; }
+			bool value() const { return m_value; }
+			explicit operator bool() const { return m_value; }
+			bool operator!() const { return !m_value; }
+		private:
+			bool m_value;
+		};
+
+		struct SIMULATOR_DECL socket : socket_base<tcp>, sink, aux::flow_handler
 		{
 			typedef ip::tcp::endpoint endpoint_type;
 			typedef ip::tcp protocol_type;
@@ -872,16 +1161,79 @@ namespace sim
 				async_read_some_impl(b, handler);
 			}
 
+			// like write_some() and async_write_some(), but writes up to n
+			// virtual bytes. They go through the send buffer like any other
+			// write, so at most as many as send_buffer_size has room for are
+			// taken, but the send buffer and the packets only carry their
+			// size. Byte k of the outgoing stream (counting every
+			// byte written to the socket) is virtual_byte(seed, k), and it's
+			// only generated once the receiver reads it. This is meant for
+			// simulations that only care about the timing of bulk transfers
+			std::size_t write_virtual(std::size_t n
+				, boost::system::error_code& ec, std::uint64_t seed = 0)
+			{
+				assert(m_non_blocking && "blocking operations not supported");
+				return write_virtual_impl(n, seed, ec);
+			}
+
+			void async_write_virtual(std::size_t n
+				, boost::function<void(boost::system::error_code const&
+					, std::size_t)> const& handler, std::uint64_t seed = 0)
+			{
+				if (m_send_handler) abort_send_handler();
+				async_write_virtual_impl(n, seed, handler);
+			}
+
 			std::size_t available(boost::system::error_code & ec) const;
 			std::size_t available() const;
 
 			boost::system::error_code cancel(boost::system::error_code& ec);
 			void cancel();
 
+			// the congestion control algorithm of this socket. It defaults to
+			// the one of the simulation (see
+			// simulation::set_congestion_control()), and takes effect on the
+			// next connection
+			void set_congestion_control(congestion_control::algorithm_t a);
+
+			// the state of the connection, like TCP_INFO on linux
+			struct stats
+			{
+				// the congestion window and the bytes sent but not ACKed yet
+				std::int64_t cwnd;
+				std::int64_t bytes_in_flight;
+
+				// the number of bytes that may still be sent before the other
+				// end's receive window is full, and the number of bytes the
+				// window of this end has room for. The receive window is the
+				// receive_buffer_size option, minus the bytes received but not
+				// read yet
+				std::int64_t send_window;
+				std::int64_t receive_window;
+
+				// the bytes in the send buffer, written but not sent yet
+				std::int64_t bytes_unsent;
+			};
+			stats get_stats() const;
+
 			using socket_base::set_option;
 			using socket_base::get_option;
 			using socket_base::io_control;
 
+			// Nagle's algorithm is on by default, a segment shorter than the
+			// MSS waits for the ones in flight to be ACKed. no_delay turns it
+			// off. cork holds back every segment that isn't full, until it's
+			// turned off again (or the socket is closed). Turning no_delay on,
+			// or cork off, sends what was held back
+			boost::system::error_code set_option(no_delay const& op
+				, boost::system::error_code& ec);
+			boost::system::error_code set_option(cork const& op
+				, boost::system::error_code& ec);
+			boost::system::error_code get_option(no_delay& op
+				, boost::system::error_code& ec);
+			boost::system::error_code get_option(cork& op
+				, boost::system::error_code& ec);
+
 			// private interface
 
 			// implements sink
@@ -910,13 +1262,73 @@ namespace sim
 				boost::function<void(boost::system::error_code const&, std::size_t)> const& handler);
 			std::size_t write_some_impl(std::vector<asio::const_buffer> const& bufs
 				, boost::system::error_code& ec);
+			void async_write_virtual_impl(std::size_t n, std::uint64_t seed
+				, boost::function<void(boost::system::error_code const&, std::size_t)> const& handler);
+			std::size_t write_virtual_impl(std::size_t n, std::uint64_t seed
+				, boost::system::error_code& ec);
 			std::size_t read_some_impl(std::vector<asio::mutable_buffer> const& bufs
 				, boost::system::error_code& ec);
 
+			// returns the route to the remote end, if the socket can take more
+			// bytes. Otherwise sets ec and returns an empty route
+			std::shared_ptr<route const> check_writable(boost::system::error_code& ec);
+
+			// the bytes written to the socket that haven't been sent yet, one
+			// payload per write (consecutive virtual writes share one). They're
+			// sent as the congestion window and the receive window of the other
+			// end make room, followed by the FIN once the socket is closed.
+			// Writes complete once their bytes are in the send buffer
+			std::deque<aux::payload> m_unsent;
+			std::size_t m_unsent_size;
+			bool m_fin_pending;
+			void send_unsent();
+
+			// removes the first n bytes from m_unsent. Bytes of more than one
+			// write are merged if they follow each other in the same chunk or
+			// stream of virtual bytes, and copied into a chunk of their own
+			// otherwise
+			aux::payload take_unsent(std::size_t n);
+
+			// the no_delay and cork options
+			bool m_no_delay;
+			bool m_corked;
+
+			// the sequence number after the last segment shorter than the MSS
+			// that was sent. Like on linux (Minshall's variant), Nagle's
+			// algorithm only holds back a short segment while another one is
+			// in flight, so the end of a bulk transfer isn't held back
+			std::uint64_t m_short_end_seq;
+
+			// the send_buffer_size option, but at least a segment, like on
+			// linux. The socket wakes up the writer once the free space is at
+			// least half of what's used, like linux does too
+			std::size_t send_buffer_limit() const;
+			bool is_writable() const;
+
+			// the receive_buffer_size option, but at least a segment (linux has
+			// a minimum too). A window smaller than that could be closed before
+			// anything is sent, with nothing to probe it with
+			std::size_t receive_buffer_limit() const;
+
+			// sends b as a train of ``segments`` segments of m_mss bytes, or as
+			// a single segment
+			void send_segment(aux::payload b, std::shared_ptr<route const> const& hops
+				, std::uint32_t segments = 1);
 			void send_packet(aux::packet p);
 
-			// called when a packet is dropped
-			void packet_dropped(aux::packet p);
+			// ACKs are cumulative, everything before seq_nr has been received.
+			// Packets received out of order are ACKed right away, by their own
+			// range of sequence numbers (selectively)
+			void send_ack(std::uint64_t seq_nr, bool selective
+				, std::uint32_t segments = 1);
+			void on_ack_timer(boost::system::error_code const& ec);
+
+			// handles an ACK, and returns what it tells the congestion control
+			congestion_control::ack_sample packets_acked(aux::packet const& ack);
+
+			// in the flow model, the bytes of a write are sent as a single flow
+			void send_flow(aux::payload b, std::shared_ptr<route const> const& hops);
+			virtual void flow_sent() override;
 
 			boost::function<void(boost::system::error_code const&)> m_connect_handler;
 
@@ -932,11 +1344,50 @@ namespace sim
 
 			std::vector<asio::const_buffer> m_send_buffer;
 
-			// this is the incoming queue of packets for each socket
-			std::vector<aux::packet> m_incoming_queue;
-
-			// the number of bytes in the incoming packet queue
-			int m_queue_size;
+			// if the outstanding write operation is async_write_virtual(), this
+			// is the number of bytes to write, and the seed they're generated
+			// from
+			std::size_t m_send_virtual;
+			std::uint64_t m_send_seed;
+
+			// the number of bytes written to the socket so far. The position in
+			// the outgoing stream of the next byte written. The next one sent
+			// is m_unsent_size bytes before it
+			std::uint64_t m_bytes_written;
+
+			// the position in the outgoing stream the other end's receive
+			// window ends at. Nothing past it is sent. While it's closed and
+			// nothing is in flight, the RTO timer sends window probes
+			std::uint64_t m_send_window_end;
+			void send_window_probe();
+
+			// the received stream of bytes that haven't been read yet, as the
+			// payloads they arrived in. They're only copied once, into the read
+			// buffer. The front is at m_incoming_head. Like the queue of
+			// sim::queue, the vector is only compacted once it's empty or mostly
+			// consumed
+			std::vector<aux::payload> m_incoming;
+			std::size_t m_incoming_head;
+
+			// the number of bytes in m_incoming
+			std::size_t m_incoming_size;
+
+			// the number of bytes read from the incoming stream so far, and the
+			// end of the last receive window advertised. The window ends
+			// receive_buffer_limit() bytes past the last byte read, it never
+			// shrinks. Once reading opens it up by enough, a window update is
+			// sent (the receiver side of silly window syndrome avoidance)
+			std::uint64_t m_bytes_read;
+			std::uint64_t m_receive_window_end;
+			std::uint64_t receive_window_end() const;
+			void maybe_send_window_update();
+
+			// the error (like EOF) received after the bytes in m_incoming. It's
+			// reported once they've all been read
+			boost::system::error_code m_incoming_error;
+
+			// adds the bytes, or the error, of an in-order packet to the stream
+			void incoming_stream(aux::packet p);
 
 			// if we have an outstanding read on this socket, this is set to the
 			// handler.
@@ -965,25 +1416,136 @@ namespace sim
 			std::uint64_t m_next_outgoing_seq;
 			std::uint64_t m_next_incoming_seq;
 
-			// the sequence number of the last dropped packet. We should only cut
-			// the cwnd in half once per round-trip. If a whole window is lost, we
-			// need to only halve it once
-			std::uint64_t m_last_drop_seq;
-
-			// the current congestion window size (in bytes)
-			int m_cwnd;
-
-			// the number of bytes that have been sent but not ACKed yet
-			int m_bytes_in_flight;
-
-			// reorder buffer for when packets are dropped
-			std::map<std::uint64_t, aux::packet> m_reorder_buffer;
-
-			// the sizes of packets given their sequence number
-			std::unordered_map<std::uint64_t, int> m_outstanding_packet_sizes;
-
-			// packets to re-send (because they were dropped)
-			std::vector<aux::packet> m_outgoing_packets;
+			// the losses of segments before this sequence number are part of the
+			// last congestion event. It's the next sequence number at the time
+			// of the first loss, that way the window is only cut once per
+			// round-trip, even if a whole window is lost (fast recovery)
+			std::uint64_t m_recovery_seq;
+
+			congestion_control::algorithm_t m_cc_algorithm;
+			std::unique_ptr<congestion_control> m_cc;
+
+			// starts m_cc over, for a new connection
+			void reset_congestion_control();
+
+			// the current congestion window size (in bytes), as of the last
+			// time m_cc was told anything
+			std::int64_t m_cwnd;
+
+			// the number of bytes that have been sent but not ACKed yet. The
+			// ones deemed lost are counted until they're re-sent, in
+			// m_bytes_lost too
+			std::int64_t m_bytes_in_flight;
+			std::int64_t m_bytes_lost;
+
+			// the number of bytes ACKed so far. The delivery rate is measured
+			// by the bytes ACKed between sending a segment and its ACK
+			std::int64_t m_delivered;
+
+			// in the flow model, this is true while the last write is being
+			// sent. Only one flow is sent at a time
+			bool m_sending_flow;
+
+			// reorder buffer for when packets are dropped. The packets received
+			// ahead of m_next_incoming_seq, in a circular array indexed by their
+			// sequence number modulo its size. The size is a power of two, grown
+			// to reach the furthest packet. A train is in the slot of its first
+			// sequence number. Empty slots hold uninitialized packets
+			std::vector<aux::packet> m_reorder_buffer;
+			void reorder_insert(aux::packet p);
+
+			// adds the in-order packet p to the stream, along with the part of
+			// any packet in the reorder buffer it overlaps, as a train re-sent
+			// with other boundaries may
+			void take_in_order(aux::packet p);
+
+			// the segments that haven't been ACKed yet, indexed by their
+			// sequence number minus m_first_unacked. The size of a segment
+			// deemed lost is negated until it's re-sent.
+			// Segments ACKed out of order are 0, until the ones before them are
+			// ACKed too. The FIN counts as one byte (with no data), like its
+			// sequence number does in real TCP
+			struct unacked_segment
+			{
+				int size;
+				// when it was (last) sent, and m_delivered at the time
+				chrono::high_resolution_clock::time_point sent;
+				std::int64_t delivered;
+				// the number of segments sent before it (the last time)
+				std::uint64_t xmit;
+				bool retransmitted;
+				// the bytes, to re-send them
+				aux::payload data;
+			};
+			std::deque<unacked_segment> m_unacked;
+			std::uint64_t m_first_unacked;
+
+			// a segment is deemed lost once a segment sent at least 3 segments
+			// after it (the duplicate ACK threshold) has been ACKed. Like RACK,
+			// it's the order they were last sent in that counts, not their
+			// sequence numbers, which lets re-sent segments be deemed lost
+			// again. m_xmit is the number of segments sent so far, and
+			// m_rack_xmit the highest xmit of the segments ACKed
+			std::uint64_t m_xmit;
+			std::uint64_t m_rack_xmit;
+			void detect_losses();
+
+			// to not look at every segment in flight for every ACK, the
+			// segments that may be deemed lost are kept in send order.
+			// m_loss_scan is the sequence number of the first segment that has
+			// only been sent once and may still be lost, and m_resent holds the
+			// sequence number and xmit of every re-sent segment, in the order
+			// they were re-sent. Entries for segments that were re-sent again
+			// (with another xmit) or ACKed since are skipped
+			std::uint64_t m_loss_scan;
+			std::deque<std::pair<std::uint64_t, std::uint64_t>> m_resent;
+
+			// the sequence numbers of the segments deemed lost, in the order
+			// they're re-sent in as ACKs make room in the window (fast
+			// retransmit). Segments ACKed since are skipped
+			std::deque<std::uint64_t> m_lost;
+			void resend_lost();
+
+			// the retransmission timeout (RFC 6298), from the smoothed
+			// round-trip time and its variation. If nothing is ACKed for that
+			// long, every segment in flight is deemed lost. It's doubled for
+			// every timeout in a row. Like the delayed ACK timer, the timer
+			// isn't moved when m_rto_due is pushed back, it re-arms itself
+			chrono::high_resolution_clock::duration m_srtt;
+			chrono::high_resolution_clock::duration m_rttvar;
+			chrono::high_resolution_clock::duration m_rto;
+			int m_rto_backoff;
+			chrono::high_resolution_clock::time_point m_rto_due;
+			asio::high_resolution_timer m_rto_timer;
+			bool m_rto_timer_armed;
+			void update_rto(chrono::high_resolution_clock::duration rtt);
+			void start_rto_timer();
+			void on_rto_timer(boost::system::error_code const& ec);
+
+			// the number of in-order packets received since the last ACK was
+			// sent. Every other packet is ACKed, or once the first of them has
+			// waited for the delayed ACK timeout, at m_ack_due. The timer isn't
+			// cancelled when an ACK is sent, once armed it fires at the time it
+			// was set for and is re-armed if needed
+			int m_packets_to_ack;
+			chrono::high_resolution_clock::time_point m_ack_due;
+			asio::high_resolution_timer m_ack_timer;
+			bool m_ack_timer_armed;
+
+			// set when the socket is closed with bytes still in flight. It
+			// keeps the connection until they've been ACKed, re-sending the
+			// lost ones, and ignores everything but ACKs. Closing it again, or
+			// the other end closing, tears it down
+			bool m_lingering;
+			void finish_close();
+
+			// a socket destructed or opened again while lingering hands its
+			// connection over to a new one, owned by the io_service (an
+			// orphan). The orphan keeps lingering, and is released once it's
+			// done. If the io_service is destructed first, it gives up
+			void hand_over_lingering();
+			void take_over_lingering(socket& s);
+			bool m_orphan;
 		};
 
 		struct SIMULATOR_DECL acceptor : socket
@@ -1071,10 +1633,12 @@ namespace sim
 	// and time.
 	struct SIMULATOR_DECL io_service
 	{
-		struct work : boost::asio::io_service::work
+		// the simulation runs until there are no more events, whether there is
+		// outstanding work or not. This is only here for compatibility with
+		// asio
+		struct work
 		{
-			work(io_service& ios) :
-				boost::asio::io_service::work(ios.get_internal_service()) {}
+			work(io_service&) {}
 		};
 
 		io_service(sim::simulation& sim);
@@ -1109,11 +1673,19 @@ namespace sim
 		void post(boost::function<void()> handler);
 
 		// internal interface
-		boost::asio::io_service& get_internal_service();
 
 		void add_timer(high_resolution_timer* t);
+		void update_timer(high_resolution_timer* t
+			, chrono::high_resolution_clock::time_point expiration);
 		void remove_timer(high_resolution_timer* t);
 
+		// schedules an event of the simulator itself, such as the departure
+		// of a packet from a queue, to be invoked at ``time``. Like a timer,
+		// it's abandoned if the simulation is destructed first
+		void add_event(aux::event* e
+			, chrono::high_resolution_clock::time_point time);
+		void remove_event(aux::event* e);
+
 		ip::tcp::endpoint bind_socket(ip::tcp::socket* socket, ip::tcp::endpoint ep
 			, boost::system::error_code& ec);
 		void unbind_socket(ip::tcp::socket* socket
@@ -1127,8 +1699,26 @@ namespace sim
 		std::shared_ptr<aux::channel> internal_connect(ip::tcp::socket* s
 			, ip::tcp::endpoint const& target, boost::system::error_code& ec);
 
-		route find_udp_socket(asio::ip::udp::socket const& socket
-			, ip::udp::endpoint const& ep);
+		// takes ownership of a TCP socket that was destructed with bytes
+		// still to be sent, until it's done lingering (see
+		// ip::tcp::socket::close())
+		void add_lingering_socket(std::unique_ptr<ip::tcp::socket> s);
+		void remove_lingering_socket(ip::tcp::socket* s);
+
+		std::shared_ptr<route const> find_udp_socket(
+			asio::ip::udp::socket const& socket, ip::udp::endpoint const& ep);
+
+		// send a packet from a socket on this node. While the packet makes its
+		// way to the network, this node is considered the one running
+		void forward_packet(aux::packet p);
+
+		// called when a packet reaches the end of a route to this node
+		void incoming_syn(aux::packet p);
+		void incoming_udp(ip::udp::endpoint const& ep, aux::packet p);
+
+		// the simulation assigns every io_service an id, in the order they are
+		// created
+		std::uint32_t node_id() const { return m_node_id; }
 
 		route const& get_outgoing_route(ip::address ip) const
 		{ return m_outgoing_route.find(ip)->second; }
@@ -1136,6 +1726,9 @@ namespace sim
 		route const& get_incoming_route(ip::address ip) const
 		{ return m_incoming_route.find(ip)->second; }
 
+		// the last hop of every route to this node
+		std::shared_ptr<sink> get_demux() const;
+
 		int get_path_mtu(asio::ip::address source, asio::ip::address dest) const;
 		std::vector<ip::address> const& get_ips() const { return m_ips; }
 
@@ -1151,7 +1744,28 @@ namespace sim
 		std::map<ip::address, route> m_outgoing_route;
 		std::map<ip::address, route> m_incoming_route;
 
+		// the sockets bound on this node. They are only ever looked up by the
+		// node itself, when a packet arrives
+		std::map<ip::tcp::endpoint, ip::tcp::socket*> m_listen_sockets;
+		std::map<ip::udp::endpoint, ip::udp::socket*> m_udp_sockets;
+
+		// the TCP sockets destructed while lingering, still sending the bytes
+		// in their send buffer and the FIN
+		std::vector<std::unique_ptr<ip::tcp::socket>> m_lingering_sockets;
+
+		// the last hop of routes to this node. It outlives the io_service, in
+		// case packets are still in flight when it's destructed
+		std::shared_ptr<aux::node_demux> m_demux;
+
+		std::uint32_t m_node_id;
+
+		// the sequence number of the next event scheduled by this node (see
+		// aux::event_queue_hook)
+		std::uint64_t m_sequence;
+
 		bool m_stopped;
+
+		friend struct sim::simulation;
 	};
 
 	template <typename Protocol>
@@ -1198,6 +1812,25 @@ namespace sim
 		// that are sent
 		virtual int path_mtu(asio::ip::address ip1, asio::ip::address ip2) = 0;
 
+		// return the smallest delay a packet may have between leaving one node
+		// and arriving at another node in a different cluster (see
+		// node_cluster()), over a channel_route() where every hop has a
+		// fixed_delay(). This is the lookahead that lets nodes run in parallel
+		// (see simulation::set_num_threads()). The default of 0 means the
+		// network can't be partitioned and the simulation always runs on a
+		// single thread
+		virtual chrono::high_resolution_clock::duration min_channel_latency()
+		{ return chrono::high_resolution_clock::duration(0); }
+
+		// nodes whose IP addresses are in the same cluster always run on the
+		// same thread. The channel_route() between them may have any latency,
+		// min_channel_latency() only has to hold between clusters. This is
+		// meant for groups of nodes on a LAN, with little or no latency between
+		// them. Nodes sharing sinks in their incoming or outgoing routes are
+		// put in the same cluster automatically. A negative value means the
+		// node isn't in a cluster
+		virtual int node_cluster(asio::ip::address /* ip */) { return -1; }
+
 		// called for every hostname lookup made by the client. ``reqyestor`` is
 		// the node performing the lookup, ``hostname`` is the name being looked
 		// up. Resolve the name into addresses and fill in ``result`` or set
@@ -1222,6 +1855,10 @@ namespace sim
 		virtual route outgoing_route(asio::ip::address ip) override;
 		virtual int path_mtu(asio::ip::address ip1, asio::ip::address ip2)
 			override;
+		// this is the latency of m_network. If a subclass overrides
+		// channel_route(), it must override this too
+		virtual chrono::high_resolution_clock::duration min_channel_latency()
+			override;
 		virtual chrono::high_resolution_clock::duration hostname_lookup(
 			asio::ip::address const& requestor
 			, std::string hostname
@@ -1237,51 +1874,202 @@ namespace sim
 
 	struct SIMULATOR_DECL simulation
 	{
-		// it calls fire() when a timer fires
-		friend struct high_resolution_timer;
+		// they return themselves to the free list once invoked
+		friend struct aux::posted_handler;
+		friend struct aux::packet_event;
+
+		// the data structure used to keep track of pending events. They all
+		// invoke events in the same order, but have different performance
+		// characteristics. The multiset allocates a node per event,
+		// the heap is a 4-ary heap with the heap index stored in the event
+		// and the timing wheel is a hierarchical timing wheel with O(1)
+		// insertion and rescheduling
+		enum scheduler_t
+		{
+			multiset_scheduler,
+			heap_scheduler,
+			timing_wheel_scheduler
+		};
+
+		// the level of detail TCP transfers are simulated at, see
+		// set_network_model()
+		enum network_model_t
+		{
+			packet_model,
+			flow_model
+		};
 
-		simulation(configuration& config);
+		// every simulation has its own clock, starting at time zero.
+		// chrono::high_resolution_clock::now() refers to the clock of the
+		// simulation that's running on the calling thread or, outside of
+		// run(), the one most recently constructed on it. Separate simulations
+		// may run concurrently, on different threads. A simulation must be
+		// destructed on the thread that constructed it
+		simulation(configuration& config, scheduler_t s = heap_scheduler);
+		~simulation();
 
 		std::size_t run(boost::system::error_code& ec);
 		std::size_t run();
 
+		// invoke the events that are due at the current time, without moving
+		// the clock forward. poll_one() invokes at most one
 		std::size_t poll(boost::system::error_code& ec);
 		std::size_t poll();
 
 		std::size_t poll_one(boost::system::error_code& ec);
 		std::size_t poll_one();
 
+		// invoke the events scheduled before ``t`` and then move the clock
+		// forward to ``t`` (unless stopped). Events at ``t`` are left for the
+		// next call, so a series of run_until() calls invokes every event once.
+		// run_for() runs until ``d`` from now. Both return the number of events
+		// invoked
+		std::size_t run_until(chrono::high_resolution_clock::time_point t);
+		std::size_t run_for(chrono::high_resolution_clock::duration d);
+
+		// invoke at most ``n`` events. This always runs on a single thread
+		std::size_t run_events(std::size_t n);
+
 		void stop();
 		bool stopped() const;
 		void reset();
+
+		// let run() invoke the events of different nodes on up to ``n``
+		// threads. The clusters of nodes (io_services with IP addresses) are
+		// split into groups by their creation order, and each group is run by
+		// its own thread. Nodes in the same cluster always run on the same
+		// thread. The threads advance in lock-step, in windows of simulated
+		// time no longer than the configuration's min_channel_latency(), which
+		// is the earliest time a packet sent by one cluster can reach another.
+		// Events of io_services without an IP address (such as timers on
+		// get_io_service()) are invoked while all other threads are waiting.
+		// The result is identical to running on a single thread, as long as:
+		//
+		// * nodes only interact with each other by sending packets (handlers
+		//   may not touch another node's sockets, timers or state)
+		// * the configuration callbacks are thread safe, and io_services are
+		//   not created or destructed while running
+		// * every channel_route() between clusters of nodes (see
+		//   configuration::node_cluster()) is made up of fixed_delay() sinks.
+		//   Sinks in channel routes within a cluster aren't used by other
+		//   clusters
+		//
+		// if the network can't be partitioned, run() uses a single thread.
+		// stop() takes effect at the end of the current window, and an
+		// exception thrown by a handler terminates the program
+		void set_num_threads(int n);
+		int num_threads() const { return m_num_threads; }
+
+		// called in a child process of fork_at(), with the index of its branch
+		typedef std::function<void(int branch)> fork_handler;
+
+		// once the simulation reaches time ``t``, fork the process into
+		// ``num_branches`` child processes that all continue the simulation
+		// from the same state. The memory of the warmed-up simulation is shared
+		// copy-on-write. In each child, ``h`` is called with the index of its
+		// branch before any more events are invoked, to make the branches
+		// diverge (say, by failing a node). run() returns in the child once its
+		// branch is done, and branch() tells which branch it is, to tag its
+		// output. The child is expected to report its results and exit.
+		//
+		// the original process waits for all children to exit and then
+		// returns from run(), as if stopped. The exit codes of its children are
+		// in branch_exit_codes(). Calling reset() and run() again continues the
+		// unmodified simulation. A simulation with pending fork points runs on a
+		// single thread. This is only supported on POSIX systems
+		void fork_at(chrono::high_resolution_clock::time_point t
+			, int num_branches, fork_handler h);
+
+		// the branch this process is running, or -1 in the original process
+		int branch() const { return m_branch; }
+
+		// in the packet_model (the default), every TCP segment and ACK is a
+		// packet, going through the queues of its route. In the flow_model,
+		// the bytes of every TCP write are sent as a fluid flow instead. The
+		// flows going through a sink share its flow_capacity() max-min fairly,
+		// and rates are only recomputed when a flow starts or finishes. The
+		// bytes of a write are delivered together, once the last of them has
+		// been sent and has passed the flow_latency() of every hop. The socket
+		// API is the same, but a transfer takes a handful of events rather
+		// than two per segment. There's no congestion control, flows start at
+		// their fair share right away, and packets (UDP, connection setup)
+		// don't take any capacity away from flows. This is meant for
+		// throughput studies of bulk transfers. Set it before any TCP
+		// connection is made. A simulation in the flow_model always runs on a
+		// single thread
+		void set_network_model(network_model_t m);
+		network_model_t network_model() const { return m_network_model; }
+
+		// the congestion control algorithm TCP sockets use, unless they're
+		// set to use another one. It takes effect on the connections made
+		// after it's set. The default is reno
+		void set_congestion_control(congestion_control::algorithm_t a)
+		{ m_congestion_control = a; }
+		congestion_control::algorithm_t congestion_control_algorithm() const
+		{ return m_congestion_control; }
+
+		// the routes UDP packets take are looked up in the configuration once
+		// per pair of addresses, and then cached. A configuration whose
+		// channel_route(), incoming_route() or outgoing_route() change over
+		// time must call this after a change. TCP connections keep the routes
+		// they were established with. Adding or removing a node invalidates
+		// the routes too
+		void invalidate_routes();
+
+		// the exit codes of the children of the last fork, indexed by branch.
+		// -1 for a child that was killed by a signal
+		std::vector<int> const& branch_exit_codes() const
+		{ return m_branch_exit_codes; }
+
 		// private interface
 
+		void post(asio::io_service& ios, boost::function<void()> handler);
+		void dispatch(asio::io_service& ios, boost::function<void()> handler);
+
 		void add_timer(asio::high_resolution_timer* t);
+		void update_timer(asio::high_resolution_timer* t
+			, chrono::high_resolution_clock::time_point expiration);
 		void remove_timer(asio::high_resolution_timer* t);
 
-		boost::asio::io_service& get_internal_service()
-		{ return m_service; }
+		void add_event(aux::event* e, asio::io_service& ios
+			, chrono::high_resolution_clock::time_point time);
+		void remove_event(aux::event* e);
 
 		asio::io_service& get_io_service() { return m_internal_ios; }
 
-		asio::ip::tcp::endpoint bind_socket(asio::ip::tcp::socket* socket
-			, asio::ip::tcp::endpoint ep
-			, boost::system::error_code& ec);
-		void unbind_socket(asio::ip::tcp::socket* socket
-			, asio::ip::tcp::endpoint ep);
+		// the node that has the IP address ``ip``, or nullptr
+		asio::io_service* find_node(asio::ip::address const& ip) const;
 
-		asio::ip::udp::endpoint bind_udp_socket(asio::ip::udp::socket* socket
-			, asio::ip::udp::endpoint ep
-			, boost::system::error_code& ec);
-		void unbind_udp_socket(asio::ip::udp::socket* socket
-			, asio::ip::udp::endpoint ep);
+		// the route packets take between two nodes. If all the hops in the
+		// configuration's channel_route() have a fixed delay, they are
+		// replaced by a single hop handing the packet to the destination node
+		route network_route(asio::ip::address src, asio::ip::address dst);
+
+		// the complete route of a UDP packet sent from address src on node
+		// ``from`` to dst, or nullptr if there's no node with address dst.
+		// Routes are cached per partition, until invalidate_routes()
+		std::shared_ptr<route const> udp_route(asio::io_service& from
+			, asio::ip::address const& src, asio::ip::address const& dst);
 
-		std::shared_ptr<aux::channel> internal_connect(asio::ip::tcp::socket* s
-			, asio::ip::tcp::endpoint const& target, boost::system::error_code& ec);
+		// send p from node ``from``. The hops up to the network are traversed
+		// as if ``from`` was running
+		void forward_packet(asio::io_service& from, aux::packet p);
 
-		route find_udp_socket(
-			asio::ip::udp::socket const& socket
-			, asio::ip::udp::endpoint const& ep);
+		// in the flow_model, send p to the node with address ``dst`` as a
+		// flow over its route. It's delivered to the last hop of the route.
+		// ``h`` is called once all the bytes have been sent, unless it's
+		// detached before then. A detached flow is still delivered
+		void send_flow(asio::ip::address const& dst, aux::flow_handler* h
+			, aux::packet p);
+		void detach_flow(aux::flow_handler* h);
+
+		// hand p over to node ``dst``, ``delay`` from now
+		void deliver_packet(std::uint32_t dst
+			, chrono::high_resolution_clock::duration delay, aux::packet p);
+
+		// the node whose event is being invoked by the calling thread, or the
+		// simulation's internal io_service
+		asio::io_service& current_node();
 
 		configuration& config() const { return m_config; }
 
@@ -1290,39 +2078,97 @@ namespace sim
 		std::vector<asio::io_service*> get_all_io_services() const;
 
 	private:
-		struct timer_compare
-		{
-			bool operator()(asio::high_resolution_timer const* lhs
-				, asio::high_resolution_timer const* rhs)
-			{ return lhs->expires_at() < rhs->expires_at(); }
-		};
+
+		// assign the event's key and add it to the queue of the partition its
+		// owner is in. Events of io_services without an IP address are owned
+		// by the node scheduling them
+		void schedule(aux::event* e, asio::io_service& ios
+			, chrono::high_resolution_clock::time_point time, bool append);
+		aux::event_queue& queue_for(std::uint32_t owner);
+
+		// invoke e, with its owner as the running node
+		void invoke(aux::event* e);
+
+		// split the nodes into partitions. Returns false if the network
+		// can't be run in parallel. The partitions are kept between runs
+		bool partition_nodes();
+		// move all events back to partition 0, and have the next run split
+		// the nodes again
+		void merge_partitions();
+		// invoke at most max_events events, that are scheduled before limit
+		std::size_t run_impl(chrono::high_resolution_clock::time_point limit
+			, std::size_t max_events);
+		std::size_t run_parallel(chrono::high_resolution_clock::time_point limit);
+
+		// invoked once the simulation reaches a fork point
+		void fork_branches(int num_branches, fork_handler const& h);
+
+		aux::posted_handler* allocate_handler();
+		void free_handler(aux::posted_handler* h);
+
+		aux::packet_event* allocate_packet_event();
+		void free_packet_event(aux::packet_event* e);
 
 		configuration& m_config;
+		scheduler_t m_scheduler;
+		network_model_t m_network_model;
+		congestion_control::algorithm_t m_congestion_control;
+
+		// the simulated time. While running on multiple threads, every thread
+		// has its own clock and this is set to the latest of them at the end
+		chrono::high_resolution_clock::time_point m_time;
+
+		// these are the io services that represent nodes on the network,
+		// indexed by node id. Entries of destructed io_services are nullptr
+		std::vector<asio::io_service*> m_nodes;
+
+		// the index of the partition each node's events are in, indexed by
+		// node id
+		std::vector<int> m_node_partition;
+
+		std::map<asio::ip::address, asio::io_service*> m_node_by_ip;
+
+		// every partition has its own event queue (all non-expired timers and
+		// all posted handlers that haven't run yet). When running on a single
+		// thread, partition 0 is the only one. Otherwise partition 0 holds the
+		// events of the nodes without IP addresses
+		std::vector<std::unique_ptr<aux::partition>> m_partitions;
+
+		int m_num_threads;
 
-		// these are the io services that represent nodes on the network
-		std::unordered_set<asio::io_service*> m_nodes;
+		// this is true once partition_nodes() has split the nodes, or found
+		// that they can't be split. m_warned_serial is set once it has warned
+		// about the latter
+		bool m_partitioned;
+		bool m_warned_serial;
 
-		// all non-expired timers
-		typedef std::multiset<asio::high_resolution_timer*, timer_compare> timer_queue_t;
-		timer_queue_t m_timer_queue;
-		std::mutex m_timer_queue_mutex;
-		// underlying message queue
-		boost::asio::io_service m_service;
+		// this is true while run() is invoking events on multiple threads
+		bool m_parallel;
+
+		// the min_channel_latency() of the configuration, during a parallel
+		// run
+		chrono::high_resolution_clock::duration m_lookahead;
+
+		std::atomic<bool> m_stopped;
+
+		// incremented by invalidate_routes(). Partitions compare it to the
+		// generation of their cached routes. Declared before m_internal_ios,
+		// whose constructor adds it to the simulation
+		std::atomic<std::uint64_t> m_route_generation;
 
 		// used for internal timers
 		asio::io_service m_internal_ios;
 
-		typedef std::map<asio::ip::tcp::endpoint, asio::ip::tcp::socket*>
-			listen_sockets_t;
-		typedef listen_sockets_t::iterator listen_socket_iter_t;
-		listen_sockets_t m_listen_sockets;
+		// the flows of the flow_model. It's created by set_network_model()
+		std::unique_ptr<aux::flow_network> m_flows;
 
-		typedef std::map<asio::ip::udp::endpoint, asio::ip::udp::socket*>
-			udp_sockets_t;
-		typedef udp_sockets_t::iterator udp_socket_iter_t;
-		udp_sockets_t m_udp_sockets;
+		// the timers of fork_at(). They are never removed, and the number of
+		// them that haven't fired yet is m_pending_forks
+		std::vector<std::unique_ptr<asio::high_resolution_timer>> m_fork_timers;
+		int m_pending_forks;
 
-		bool m_stopped;
+		int m_branch;
+		std::vector<int> m_branch_exit_codes;
 	};
 
 	namespace aux
@@ -1331,9 +2177,13 @@ namespace sim
 		{
 			packet()
 				: type(uninitialized)
-				, from(new asio::ip::udp::endpoint)
 				, overhead{20}
+				, next_hop(0)
 				, seq_nr{0}
+				, segments(1)
+				, segment_size(0)
+				, span(0)
+				, window(0)
 			{}
 
 			// this is move-only
@@ -1347,7 +2197,8 @@ namespace sim
 			// to keep things simple, don't drop ACKs or errors
 			bool ok_to_drop() const
 			{
-				return type != syn_ack && type != ack && type != error;
+				return type != syn_ack && type != ack && type != sack
+					&& type != error;
 			}
 
 			enum type_t
@@ -1355,7 +2206,8 @@ namespace sim
 				uninitialized, // invalid type (used for debugging)
 				syn, // TCP connect
 				syn_ack, // TCP connection accepted
-				ack, // the seq_nr is interpreted as "we received this"
+				ack, // every seq_nr before this one was received
+				sack, // the seq_nr is interpreted as "we received this"
 				error, // the error_code (ec) is set
 				payload // the buffer is filled
 			} type;
@@ -1363,24 +2215,30 @@ namespace sim
 			boost::system::error_code ec;
 
 			// actual payload
-			std::vector<boost::uint8_t> buffer;
+			aux::payload buffer;
 
 			// used for UDP packets
-			// this is a unique_ptr just to make this type movable. the endpoint
-			// itself isn't
-#if LIBSIMULATOR_USE_MOVE
-			std::unique_ptr<asio::ip::udp::endpoint> from;
-#else
-			std::shared_ptr<asio::ip::udp::endpoint> from;
-#endif
+			asio::ip::udp::endpoint from;
+			asio::ip::udp::endpoint to;
 
 			// the number of bytes of overhead for this packet. The total packet
 			// size is the number of bytes in the buffer + this number
 			int overhead;
 
-			// each hop in the route will pop itself off and forward the packet to
-			// the next hop
-			route hops;
+			// the route this packet takes. It's never modified, and it's shared
+			// by every packet sent over it, like all the packets of a TCP
+			// connection. Each hop forwards the packet to hop number next_hop
+			// and increments it, without touching any reference counts. A
+			// packet waiting in a queue keeps that queue alive this way, see
+			// queue::departure_event
+			std::shared_ptr<route const> hops;
+			std::uint32_t next_hop;
+
+			void set_route(std::shared_ptr<route const> r)
+			{
+				hops = std::move(r);
+				next_hop = 0;
+			}
 
 			// for SYN packets, this is set to the channel we're trying to
 			// establish
@@ -1389,13 +2247,25 @@ namespace sim
 			// sequence number of this packet (used for debugging)
 			std::uint64_t seq_nr;
 
-			// this function must be called with this packet in case the packet is
-			// dropped.
-#if LIBSIMULATOR_USE_MOVE
-			std::unique_ptr<std::function<void(aux::packet)>> drop_fun;
-#else
-			std::shared_ptr<std::function<void(aux::packet)>> drop_fun;
-#endif
+			// a TCP packet may be a train of consecutive segments, like the
+			// super-segments of TSO/GSO, with the sequence numbers seq_nr,
+			// seq_nr + 1 and so on. Every segment carries segment_size bytes of
+			// the buffer and its share of the overhead. A train arrives at a hop
+			// with its first segment, the rest of them arrive evenly spread out
+			// over span. For a selective ACK, segments is the number of
+			// sequence numbers it ACKs
+			std::uint32_t segments;
+			std::uint32_t segment_size;
+			chrono::high_resolution_clock::duration span;
+
+			// for TCP ACKs, the receive window. It's the position in the stream
+			// (counting every byte of payload) the sender may send up to
+			std::uint64_t window;
+
+			// splits off the first n segments of a train, and returns them as a
+			// packet of their own. This packet keeps the rest. The span of both
+			// is left to the caller
+			packet split(std::uint32_t n);
 		};
 
 		struct SIMULATOR_DECL sink_forwarder : sink
@@ -1413,6 +2283,9 @@ namespace sim
 
 			void clear() { m_dst = nullptr; }
 
+			// the packets on their way go to dst instead, from now on
+			void reset(sink* dst) { m_dst = dst; }
+
 		private:
 			sink* m_dst;
 		};
@@ -1434,14 +2307,19 @@ namespace sim
 		*/
 		struct SIMULATOR_DECL channel
 		{
-			channel() {}
+			channel() : initial_window() {}
 			// index 0 is the incoming route to the socket that initiated the connection.
-			// index 1 may be empty while the connection is half-open
-			route hops[2];
+			// index 1 may be empty while the connection is half-open. The routes
+			// are shared by all packets sent over the connection
+			std::shared_ptr<route const> hops[2];
 
 			// the endpoint of each end of the channel
 			asio::ip::tcp::endpoint ep[2];
 
+			// the receive window each end announced in its SYN or SYN-ACK. The
+			// ACKs carry it from then on (see packet::window)
+			std::uint64_t initial_window[2];
+
 			int remote_idx(asio::ip::tcp::endpoint self) const;
 			int self_idx(asio::ip::tcp::endpoint self) const;
 		};
@@ -1449,6 +2327,12 @@ namespace sim
 	} // aux
 
 	void SIMULATOR_DECL dump_network_graph(simulation const& s, std::string filename);
+
+	// the content of virtual bytes, see tcp::socket::async_write_virtual().
+	// This is byte ``offset`` of the stream generated from ``seed``. The
+	// stream of seed 0 is all zeros
+	std::uint8_t SIMULATOR_DECL virtual_byte(std::uint64_t seed
+		, std::uint64_t offset);
 }
 
 #endif // SIMULATOR_HPP_INCLUDED
@@ -0,0 +1,105 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SWEEP_HPP_INCLUDED
+#define SWEEP_HPP_INCLUDED
+
+#include "simulator/simulator.hpp"
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+
+namespace sim
+{
+
+	// runs a job once per point of a parameter sweep, each in a child process
+	// forked off of the calling one. Anything set up before calling run() (such
+	// as a configuration and the nodes of a simulation) is shared copy-on-write
+	// by all children, and doesn't have to be built once per point. Each child
+	// sends a result record back to the parent over a pipe.
+	// This is only supported on POSIX systems. The process should not have any
+	// other threads running when calling run(), since only the calling thread
+	// exists in the children.
+	struct SIMULATOR_DECL sweep
+	{
+		struct result
+		{
+			result() : point(-1), exit_code(-1), signal(0) {}
+
+			// the index of the parameter point
+			int point;
+
+			// the exit code of the child process. This is 0 if the job returned
+			// normally, 1 if it threw an exception and -1 if it was killed
+			int exit_code;
+
+			// the signal that killed the child, or 0
+			int signal;
+
+			// the bytes returned by the job
+			std::string record;
+
+			bool ok() const { return exit_code == 0 && signal == 0; }
+
+			// interpret the record as a trivially copyable type, as returned by
+			// sweep::make_record(). Returns false if the child failed or the
+			// record has the wrong size
+			template <typename Record>
+			bool get(Record& r) const
+			{
+				static_assert(std::is_trivially_copyable<Record>::value
+					, "records are sent as raw bytes");
+				if (!ok() || record.size() != sizeof(Record)) return false;
+				std::memcpy(&r, record.data(), sizeof(Record));
+				return true;
+			}
+		};
+
+		// the job is run in the child process, and passed the index of the
+		// parameter point it's run for. It returns the record to send back
+		typedef std::function<std::string(int point)> job_t;
+
+		// the number of children running at the same time. 0 means one per
+		// hardware thread
+		explicit sweep(int max_workers = 0);
+
+		// run job for every point in [0, num_points) and wait for all of them
+		// to complete. The results are indexed by point. Throws
+		// boost::system::system_error if a child process can't be started
+		std::vector<result> run(int num_points, job_t const& job);
+
+		int max_workers() const { return m_max_workers; }
+
+		template <typename Record>
+		static std::string make_record(Record const& r)
+		{
+			static_assert(std::is_trivially_copyable<Record>::value
+				, "records are sent as raw bytes");
+			return std::string(reinterpret_cast<char const*>(&r), sizeof(Record));
+		}
+
+	private:
+		int m_max_workers;
+	};
+}
+
+#endif // SWEEP_HPP_INCLUDED
+
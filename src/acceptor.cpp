@@ -190,14 +190,14 @@ namespace ip {
 				, end(m_incoming_queue.end()); i != end; ++i)
 			{
 				aux::packet p;
-				*p.from = asio::ip::udp::endpoint(
+				p.from = asio::ip::udp::endpoint(
 					m_bound_to.address(), m_bound_to.port());
 				p.type = aux::packet::error;
 				p.ec = boost::system::error_code(error::connection_reset);
 				p.overhead = 28;
-				p.hops = p.channel->hops[0];
+				p.set_route((*i)->hops[0]);
 
-				forward_packet(std::move(p));
+				m_io_service.forward_packet(std::move(p));
 			}
 			m_incoming_queue.clear();
 
@@ -230,7 +230,7 @@ namespace ip {
 
 		// notify the other end
 		aux::packet p;
-		*p.from = asio::ip::udp::endpoint(
+		p.from = asio::ip::udp::endpoint(
 			m_bound_to.address(), m_bound_to.port());
 		if (ec)
 		{
@@ -243,9 +243,9 @@ namespace ip {
 			p.channel = c;
 		}
 		p.overhead = 28;
-		p.hops = p.channel->hops[0];
+		p.set_route(c->hops[0]);
 
-		forward_packet(std::move(p));
+		m_io_service.forward_packet(std::move(p));
 
 		assert(m_accept_handler);
 		m_io_service.post(std::bind(m_accept_handler, ec));
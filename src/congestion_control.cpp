@@ -0,0 +1,389 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <cmath>
+
+typedef sim::chrono::high_resolution_clock::time_point time_point;
+typedef sim::chrono::high_resolution_clock::duration duration;
+
+namespace sim
+{
+	namespace
+	{
+		int const initial_window = 10;
+
+		double seconds(duration const d)
+		{
+			return double(chrono::duration_cast<chrono::nanoseconds>(d).count()) / 1e9;
+		}
+
+		struct reno_cc : congestion_control
+		{
+			explicit reno_cc(int const mss)
+				: m_mss(mss)
+				, m_cwnd(std::int64_t(mss) * initial_window)
+				, m_ssthresh((std::numeric_limits<std::int64_t>::max)())
+				, m_bytes_acked(0)
+			{}
+
+			virtual void on_ack(ack_sample const& s) override
+			{
+				// slow start, the window grows by the bytes ACKed, doubling it
+				// every round-trip
+				if (m_cwnd < m_ssthresh)
+				{
+					m_cwnd += s.acked;
+					return;
+				}
+
+				// congestion avoidance. Every round-trip, increase the window
+				// size by one packet (MSS). The ACKed bytes are accumulated until
+				// they make up a whole window. Growing the window by a fraction
+				// of the MSS per ACK would round down to nothing once it's
+				// larger than MSS^2
+				m_bytes_acked += s.acked;
+				if (m_bytes_acked >= m_cwnd)
+				{
+					m_bytes_acked -= m_cwnd;
+					m_cwnd += m_mss;
+				}
+			}
+
+			virtual void on_congestion() override
+			{
+				m_ssthresh = (std::max)(m_cwnd / 2, std::int64_t(m_mss) * 2);
+				m_cwnd = m_ssthresh;
+				m_bytes_acked = 0;
+			}
+
+			// the window starts over from a single segment, in slow start up to
+			// half of what it was
+			virtual void on_timeout() override
+			{
+				on_congestion();
+				m_cwnd = m_mss;
+			}
+
+			virtual std::int64_t cwnd() const override { return m_cwnd; }
+
+		private:
+			int const m_mss;
+			std::int64_t m_cwnd;
+			std::int64_t m_ssthresh;
+
+			// the number of bytes ACKed since the congestion window last grew
+			std::int64_t m_bytes_acked;
+		};
+
+		struct cubic_cc : congestion_control
+		{
+			explicit cubic_cc(int const mss)
+				: m_mss(mss)
+				, m_cwnd(double(mss) * initial_window)
+				, m_ssthresh((std::numeric_limits<double>::max)())
+				, m_w_max(0)
+				, m_k(0)
+				, m_origin(0)
+				, m_w_est(0)
+				, m_epoch_started(false)
+				, m_min_rtt((duration::max)())
+			{}
+
+			virtual void on_ack(ack_sample const& s) override
+			{
+				if (s.rtt > duration(0)) m_min_rtt = (std::min)(m_min_rtt, s.rtt);
+				if (s.acked == 0) return;
+
+				if (m_cwnd < m_ssthresh)
+				{
+					m_cwnd += double(s.acked);
+					return;
+				}
+
+				time_point const now = chrono::high_resolution_clock::now();
+				if (!m_epoch_started)
+				{
+					m_epoch_started = true;
+					m_epoch_start = now;
+					if (m_cwnd < m_w_max)
+					{
+						m_k = std::cbrt((m_w_max - m_cwnd) / m_mss / c);
+						m_origin = m_w_max;
+					}
+					else
+					{
+						m_k = 0;
+						m_origin = m_cwnd;
+					}
+					m_w_est = m_cwnd;
+				}
+
+				// the window the cubic function says we should have one
+				// round-trip from now. It's never more than 1.5 times the
+				// current one
+				double const min_rtt = m_min_rtt == (duration::max)()
+					? 0 : seconds(m_min_rtt);
+				double const t = seconds(now - m_epoch_start) + min_rtt;
+				double target = m_origin + c * std::pow(t - m_k, 3) * m_mss;
+				target = (std::max)(m_cwnd, (std::min)(target, m_cwnd * 1.5));
+
+				// the window standard TCP would have. CUBIC is never slower
+				// than that
+				m_w_est += alpha * m_mss * double(s.acked) / m_cwnd;
+				target = (std::max)(target, m_w_est);
+
+				m_cwnd += (target - m_cwnd) * double(s.acked) / m_cwnd;
+			}
+
+			virtual void on_congestion() override
+			{
+				m_epoch_started = false;
+
+				// fast convergence. If the window didn't make it back to where
+				// it was the last time, another flow is probably taking its
+				// share. Leave some of it to that one
+				if (m_cwnd < m_w_max) m_w_max = m_cwnd * (1 + beta) / 2;
+				else m_w_max = m_cwnd;
+
+				m_cwnd = (std::max)(m_cwnd * beta, double(m_mss) * 2);
+				m_ssthresh = m_cwnd;
+			}
+
+			virtual void on_timeout() override
+			{
+				on_congestion();
+				m_cwnd = m_mss;
+			}
+
+			virtual std::int64_t cwnd() const override
+			{ return std::int64_t(m_cwnd); }
+
+		private:
+
+			// the constants from RFC 8312. alpha makes the standard TCP
+			// estimate grow as fast as reno does, on average, with a
+			// multiplicative decrease of beta
+			static double constexpr c = 0.4;
+			static double constexpr beta = 0.7;
+			static double constexpr alpha = 3 * (1 - beta) / (1 + beta);
+
+			int const m_mss;
+
+			// the windows are in bytes. They grow by fractions of a byte per ACK
+			double m_cwnd;
+			double m_ssthresh;
+
+			// the window before the last congestion event
+			double m_w_max;
+
+			// the time (in seconds) it takes the cubic function to grow back to
+			// m_origin, since m_epoch_start
+			double m_k;
+			double m_origin;
+
+			// the window standard TCP would have
+			double m_w_est;
+
+			// the epoch starts with the first ACK after a congestion event
+			bool m_epoch_started;
+			time_point m_epoch_start;
+
+			duration m_min_rtt;
+		};
+
+		constexpr double cubic_cc::c;
+		constexpr double cubic_cc::beta;
+		constexpr double cubic_cc::alpha;
+
+		struct bbr_cc : congestion_control
+		{
+			explicit bbr_cc(int const mss)
+				: m_mss(mss)
+				, m_cwnd(std::int64_t(mss) * initial_window)
+				, m_mode(startup)
+				, m_min_rtt((duration::max)())
+				, m_round(0)
+				, m_next_round_delivered(0)
+				, m_full_bw(0)
+				, m_full_bw_rounds(0)
+				, m_cycle_index(0)
+			{}
+
+			virtual void on_ack(ack_sample const& s) override
+			{
+				// a round-trip ends when the first segment sent after it started
+				// is ACKed
+				bool round_start = false;
+				if (s.rtt > duration(0) && s.prior_delivered >= m_next_round_delivered)
+				{
+					m_next_round_delivered = s.delivered;
+					++m_round;
+					round_start = true;
+				}
+
+				if (s.rtt > duration(0)) m_min_rtt = (std::min)(m_min_rtt, s.rtt);
+				if (s.delivery_rate > 0) update_bandwidth(s.delivery_rate);
+
+				time_point const now = chrono::high_resolution_clock::now();
+				switch (m_mode)
+				{
+					case startup:
+					{
+						// the bottleneck is full once the bandwidth stops growing
+						// by 25% per round-trip, for 3 round-trips
+						if (round_start)
+						{
+							double const bw = bandwidth();
+							if (bw >= m_full_bw * 1.25)
+							{
+								m_full_bw = bw;
+								m_full_bw_rounds = 0;
+							}
+							else if (++m_full_bw_rounds >= 3)
+							{
+								m_mode = drain;
+							}
+						}
+						if (m_mode == startup)
+						{
+							m_cwnd += s.acked;
+							return;
+						}
+						// the queue startup built up drains while the window is
+						// one bandwidth-delay product
+						m_cwnd = target_cwnd(1);
+						return;
+					}
+					case drain:
+					{
+						if (!round_start) return;
+						m_mode = probe_bw;
+						m_cycle_index = 2;
+						m_cycle_start = now;
+						break;
+					}
+					case probe_bw:
+					{
+						if (now - m_cycle_start > m_min_rtt)
+						{
+							m_cycle_index = (m_cycle_index + 1) % num_gains;
+							m_cycle_start = now;
+						}
+						break;
+					}
+				}
+
+				// no pacing is modeled, the gain of the cycle is applied to the
+				// window
+				std::int64_t const target = target_cwnd(2 * gain_cycle[m_cycle_index]);
+				m_cwnd = (std::min)(m_cwnd + s.acked, target);
+				if (m_cwnd < target_cwnd(0)) m_cwnd = target_cwnd(0);
+			}
+
+			// BBR doesn't treat loss as a signal of congestion
+			virtual void on_congestion() override {}
+
+			// but a timeout means the model is off. The window starts over from
+			// the minimum, and grows back to the target as ACKs arrive
+			virtual void on_timeout() override
+			{
+				m_cwnd = target_cwnd(0);
+			}
+
+			virtual std::int64_t cwnd() const override { return m_cwnd; }
+
+		private:
+
+			// the bandwidth-delay product times gain, but at least 4 segments
+			std::int64_t target_cwnd(double const gain) const
+			{
+				std::int64_t const min_cwnd = std::int64_t(m_mss) * 4;
+				if (m_min_rtt == (duration::max)()) return min_cwnd;
+				double const bdp = bandwidth() * seconds(m_min_rtt);
+				return (std::max)(std::int64_t(bdp * gain), min_cwnd);
+			}
+
+			// the bottleneck bandwidth is the highest delivery rate of the last
+			// 10 round-trips. m_bw_samples is kept in decreasing order of rate
+			void update_bandwidth(double const rate)
+			{
+				while (!m_bw_samples.empty() && m_bw_samples.back().second <= rate)
+					m_bw_samples.pop_back();
+				m_bw_samples.push_back(std::make_pair(m_round, rate));
+				while (m_bw_samples.front().first + bw_window_rounds <= m_round)
+					m_bw_samples.pop_front();
+			}
+
+			double bandwidth() const
+			{ return m_bw_samples.empty() ? 0 : m_bw_samples.front().second; }
+
+			static int const bw_window_rounds = 10;
+
+			// the pacing gains of ProbeBW. One round-trip probing for more
+			// bandwidth, one draining the queue that built up, and six cruising
+			static int const num_gains = 8;
+			static double const gain_cycle[num_gains];
+
+			int const m_mss;
+			std::int64_t m_cwnd;
+
+			enum mode_t { startup, drain, probe_bw };
+			mode_t m_mode;
+
+			// (round, delivery rate)
+			std::deque<std::pair<std::int64_t, double>> m_bw_samples;
+			duration m_min_rtt;
+
+			// the number of round-trips so far, and the number of bytes
+			// delivered when the current one ends
+			std::int64_t m_round;
+			std::int64_t m_next_round_delivered;
+
+			// the highest bandwidth seen in startup, and the number of
+			// round-trips since it last grew by 25%
+			double m_full_bw;
+			int m_full_bw_rounds;
+
+			int m_cycle_index;
+			time_point m_cycle_start;
+		};
+
+		double const bbr_cc::gain_cycle[bbr_cc::num_gains] = {
+			1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+	}
+
+	std::unique_ptr<congestion_control> congestion_control::create(
+		algorithm_t const a, int const mss)
+	{
+		switch (a)
+		{
+			case congestion_control::cubic:
+				return std::unique_ptr<congestion_control>(new cubic_cc(mss));
+			case congestion_control::bbr:
+				return std::unique_ptr<congestion_control>(new bbr_cc(mss));
+			case congestion_control::reno:
+			default:
+				return std::unique_ptr<congestion_control>(new reno_cc(mss));
+		}
+	}
+}
+
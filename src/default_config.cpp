@@ -57,6 +57,11 @@ namespace sim {
 		return route().append(it->second);
 	}
 
+	duration default_config::min_channel_latency()
+	{
+		return (std::max)(duration(0), m_network->fixed_delay());
+	}
+
 	int default_config::path_mtu(asio::ip::address ip1, asio::ip::address ip2)
 	{
 		return 1475;
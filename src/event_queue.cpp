@@ -0,0 +1,415 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/event_queue.hpp"
+
+#include <algorithm>
+#include <tuple>
+#include <cassert>
+
+namespace sim { namespace aux
+{
+	namespace {
+
+		// the index of the most significant bit set in v. v must not be 0
+		int log2(std::uint64_t v)
+		{
+			assert(v != 0);
+#if defined __GNUC__
+			return 63 - __builtin_clzll(v);
+#else
+			int ret = 0;
+			while (v >>= 1) ++ret;
+			return ret;
+#endif
+		}
+
+		// the index of the least significant bit set in v. v must not be 0
+		int lowest_bit(std::uint64_t v)
+		{
+			assert(v != 0);
+#if defined __GNUC__
+			return __builtin_ctzll(v);
+#else
+			int ret = 0;
+			while ((v & 1) == 0) { v >>= 1; ++ret; }
+			return ret;
+#endif
+		}
+	}
+
+	// ==== event_queue ====
+
+	event_queue::event_queue()
+		: m_fifo_head(nullptr)
+		, m_fifo_tail(nullptr)
+		, m_fifo_size(0)
+	{}
+
+	void event_queue::append(event* e)
+	{
+		// events from different nodes are not necessarily appended in order
+		if (m_fifo_tail != nullptr && compare(e, m_fifo_tail))
+		{
+			insert(e);
+			return;
+		}
+
+		event_queue_hook& h = e->queue_hook();
+		h.bucket = -1;
+		h.prev = nullptr;
+		h.next = nullptr;
+		if (m_fifo_tail) m_fifo_tail->queue_hook().next = e;
+		else m_fifo_head = e;
+		m_fifo_tail = e;
+		++m_fifo_size;
+	}
+
+	event* event_queue::front()
+	{
+		event* e = ordered_front();
+		if (m_fifo_head == nullptr) return e;
+		if (e == nullptr || compare(m_fifo_head, e)) return m_fifo_head;
+		return e;
+	}
+
+	void event_queue::pop_front()
+	{
+		event* e = ordered_front();
+		if (m_fifo_head == nullptr || (e != nullptr && !compare(m_fifo_head, e)))
+		{
+			ordered_pop_front();
+			return;
+		}
+
+		e = m_fifo_head;
+		m_fifo_head = e->queue_hook().next;
+		if (m_fifo_head == nullptr) m_fifo_tail = nullptr;
+		e->queue_hook().next = nullptr;
+		--m_fifo_size;
+	}
+
+	// ==== multiset_event_queue ====
+
+	void multiset_event_queue::insert(event* t)
+	{
+		m_queue.insert(t);
+	}
+
+	void multiset_event_queue::update(event* t
+		, chrono::high_resolution_clock::time_point time
+		, std::uint32_t origin
+		, std::uint64_t sequence)
+	{
+		remove(t);
+		t->queue_hook().time = time;
+		t->queue_hook().origin = origin;
+		t->queue_hook().sequence = sequence;
+		insert(t);
+	}
+
+	void multiset_event_queue::remove(event* t)
+	{
+		queue_t::iterator begin;
+		queue_t::iterator end;
+		std::tie(begin, end) = m_queue.equal_range(t);
+		begin = std::find(begin, end, t);
+		assert(begin != end);
+		if (begin == end) return;
+		m_queue.erase(begin);
+	}
+
+	event* multiset_event_queue::ordered_front()
+	{
+		if (m_queue.empty()) return nullptr;
+		return *m_queue.begin();
+	}
+
+	void multiset_event_queue::ordered_pop_front()
+	{
+		assert(!m_queue.empty());
+		m_queue.erase(m_queue.begin());
+	}
+
+	// ==== heap_event_queue ====
+
+	void heap_event_queue::insert(event* t)
+	{
+		m_heap.push_back(t);
+		t->queue_hook().index = m_heap.size() - 1;
+		sift_up(m_heap.size() - 1);
+	}
+
+	void heap_event_queue::update(event* t
+		, chrono::high_resolution_clock::time_point time
+		, std::uint32_t origin
+		, std::uint64_t sequence)
+	{
+		t->queue_hook().time = time;
+		t->queue_hook().origin = origin;
+		t->queue_hook().sequence = sequence;
+		fix(t);
+	}
+
+	void heap_event_queue::fix(event* t)
+	{
+		const std::size_t i = t->queue_hook().index;
+		assert(i < m_heap.size() && m_heap[i] == t);
+		if (i > 0 && compare(t, m_heap[(i - 1) / 4]))
+			sift_up(i);
+		else
+			sift_down(i);
+	}
+
+	void heap_event_queue::remove(event* t)
+	{
+		const std::size_t i = t->queue_hook().index;
+		assert(i < m_heap.size() && m_heap[i] == t);
+		event* last = m_heap.back();
+		m_heap.pop_back();
+		if (i == m_heap.size()) return;
+
+		place(i, last);
+		fix(last);
+	}
+
+	event* heap_event_queue::ordered_front()
+	{
+		if (m_heap.empty()) return nullptr;
+		return m_heap.front();
+	}
+
+	void heap_event_queue::ordered_pop_front()
+	{
+		assert(!m_heap.empty());
+		remove(m_heap.front());
+	}
+
+	void heap_event_queue::sift_up(std::size_t i)
+	{
+		event* t = m_heap[i];
+		while (i > 0)
+		{
+			const std::size_t parent = (i - 1) / 4;
+			if (!compare(t, m_heap[parent])) break;
+			place(i, m_heap[parent]);
+			i = parent;
+		}
+		place(i, t);
+	}
+
+	void heap_event_queue::sift_down(std::size_t i)
+	{
+		event* t = m_heap[i];
+		const std::size_t size = m_heap.size();
+		for (;;)
+		{
+			const std::size_t first_child = i * 4 + 1;
+			if (first_child >= size) break;
+			const std::size_t end_child = (std::min)(first_child + 4, size);
+
+			std::size_t best = first_child;
+			for (std::size_t c = first_child + 1; c < end_child; ++c)
+			{
+				if (compare(m_heap[c], m_heap[best])) best = c;
+			}
+
+			if (!compare(m_heap[best], t)) break;
+			place(i, m_heap[best]);
+			i = best;
+		}
+		place(i, t);
+	}
+
+	// ==== timing_wheel ====
+
+	timing_wheel::timing_wheel(chrono::high_resolution_clock::duration resolution)
+		: m_resolution((std::max)(std::int64_t(1), std::int64_t(
+			chrono::duration_cast<chrono::nanoseconds>(resolution).count())))
+		, m_current(0)
+		, m_size(0)
+		, m_buckets(num_levels * num_slots, nullptr)
+	{
+		m_occupied.fill(0);
+	}
+
+	std::uint64_t timing_wheel::tick(
+		chrono::high_resolution_clock::time_point t) const
+	{
+		const std::int64_t ns = chrono::duration_cast<chrono::nanoseconds>(
+			t.time_since_epoch()).count();
+		if (ns <= 0) return 0;
+		return std::uint64_t(ns / m_resolution);
+	}
+
+	void timing_wheel::insert(event* t)
+	{
+		++m_size;
+		link(t);
+	}
+
+	void timing_wheel::update(event* t
+		, chrono::high_resolution_clock::time_point time
+		, std::uint32_t origin
+		, std::uint64_t sequence)
+	{
+		event_queue_hook& h = t->queue_hook();
+		if (h.bucket == -1 && tick(time) <= m_current)
+		{
+			// it's staying in the due heap
+			m_due.update(t, time, origin, sequence);
+			return;
+		}
+		unlink(t);
+		h.time = time;
+		h.origin = origin;
+		h.sequence = sequence;
+		link(t);
+	}
+
+	void timing_wheel::remove(event* t)
+	{
+		assert(m_size > 0);
+		--m_size;
+		unlink(t);
+	}
+
+	event* timing_wheel::ordered_front()
+	{
+		if (m_due.empty() && !advance()) return nullptr;
+		return m_due.front();
+	}
+
+	void timing_wheel::ordered_pop_front()
+	{
+		if (m_due.empty()) advance();
+		assert(!m_due.empty());
+		assert(m_size > 0);
+		--m_size;
+		m_due.pop_front();
+	}
+
+	void timing_wheel::link(event* t)
+	{
+		event_queue_hook& h = t->queue_hook();
+		const std::uint64_t when = tick(h.time);
+		if (when <= m_current)
+		{
+			h.bucket = -1;
+			m_due.insert(t);
+			return;
+		}
+
+		// the level is determined by the most significant bit that differs
+		// between the current tick and the event's tick. This means all
+		// buckets at a level are in the future relative to the current slot
+		// of that level
+		const int level = log2(when ^ m_current) / slot_bits;
+		const int slot = int((when >> (level * slot_bits)) & (num_slots - 1));
+		const int bucket = level * num_slots + slot;
+
+		h.bucket = bucket;
+		h.prev = nullptr;
+		h.next = m_buckets[bucket];
+		if (h.next) h.next->queue_hook().prev = t;
+		m_buckets[bucket] = t;
+		m_occupied[bucket / 64] |= std::uint64_t(1) << (bucket % 64);
+	}
+
+	void timing_wheel::unlink(event* t)
+	{
+		event_queue_hook& h = t->queue_hook();
+		if (h.bucket == -1)
+		{
+			m_due.remove(t);
+			return;
+		}
+
+		if (h.prev) h.prev->queue_hook().next = h.next;
+		else m_buckets[h.bucket] = h.next;
+		if (h.next) h.next->queue_hook().prev = h.prev;
+
+		if (m_buckets[h.bucket] == nullptr)
+			m_occupied[h.bucket / 64] &= ~(std::uint64_t(1) << (h.bucket % 64));
+
+		h.bucket = -1;
+		h.prev = nullptr;
+		h.next = nullptr;
+	}
+
+	bool timing_wheel::advance()
+	{
+		while (m_due.empty())
+		{
+			// find the first non-empty bucket. Lower levels always expire before
+			// higher levels, and within a level, the buckets are in order
+			int bucket = -1;
+			for (int i = 0; i < int(m_occupied.size()); ++i)
+			{
+				if (m_occupied[i] == 0) continue;
+				bucket = i * 64 + lowest_bit(m_occupied[i]);
+				break;
+			}
+			if (bucket == -1) return false;
+
+			const int level = bucket / num_slots;
+			const int slot = bucket % num_slots;
+
+			// move the wheel to the start of this bucket's time span. Everything
+			// below this level is empty, so no event is skipped
+			const int shift = level * slot_bits;
+			const int high_shift = shift + slot_bits;
+			const std::uint64_t high_bits = high_shift >= 64 ? 0
+				: (m_current >> high_shift) << high_shift;
+			m_current = high_bits | (std::uint64_t(slot) << shift);
+
+			// detach the bucket and redistribute its events. At level 0 they all
+			// land in m_due, at higher levels they cascade down to lower levels
+			event* t = m_buckets[bucket];
+			m_buckets[bucket] = nullptr;
+			m_occupied[bucket / 64] &= ~(std::uint64_t(1) << (bucket % 64));
+			while (t)
+			{
+				event* next = t->queue_hook().next;
+				t->queue_hook().bucket = -1;
+				t->queue_hook().prev = nullptr;
+				t->queue_hook().next = nullptr;
+				link(t);
+				t = next;
+			}
+		}
+		return true;
+	}
+
+	std::unique_ptr<event_queue> make_event_queue(simulation::scheduler_t s)
+	{
+		switch (s)
+		{
+			case simulation::multiset_scheduler:
+				return std::unique_ptr<event_queue>(new multiset_event_queue);
+			case simulation::timing_wheel_scheduler:
+				return std::unique_ptr<event_queue>(new timing_wheel);
+			case simulation::heap_scheduler:
+				break;
+		}
+		return std::unique_ptr<event_queue>(new heap_event_queue);
+	}
+
+} // aux
+} // sim
+
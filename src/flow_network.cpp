@@ -0,0 +1,221 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/flow_network.hpp"
+
+#include <functional>
+#include <unordered_map>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+typedef sim::chrono::high_resolution_clock::time_point time_point;
+typedef sim::chrono::high_resolution_clock::duration duration;
+
+using namespace std::placeholders;
+
+namespace sim { namespace aux
+{
+	namespace
+	{
+		double const unlimited = std::numeric_limits<double>::infinity();
+
+		// a flow is done once it has less than a nanosecond's worth of bytes
+		// left. The time it's due is rounded up to whole nanoseconds, so its
+		// remaining bytes never quite reach zero
+		bool is_done(double const remaining, double const rate)
+		{
+			return remaining * 1e9 <= rate;
+		}
+	}
+
+	flow_network::flow_network(simulation& sim)
+		: m_sim(sim)
+		, m_timer(sim.get_io_service())
+		, m_last_update(chrono::high_resolution_clock::now())
+		, m_update_posted(false)
+	{}
+
+	std::uint32_t const flow_network::no_node;
+
+	flow_network::~flow_network() = default;
+
+	void flow_network::add(std::uint32_t const dst, flow_handler* h, packet p)
+	{
+		std::unique_ptr<flow> f(new flow);
+		f->handler = h;
+		f->dst = dst;
+		f->latency = duration(0);
+		f->remaining = double(p.buffer.size()) + p.overhead;
+		f->rate = 0;
+
+		// the last hop is the one the packet is delivered to
+		route const& hops = *p.hops;
+		for (std::size_t i = p.next_hop; i + 1 < hops.size(); ++i)
+		{
+			sink* s = hops.hop(i);
+			if (s->flow_capacity() > 0
+				&& std::find(f->links.begin(), f->links.end(), s) == f->links.end())
+				f->links.push_back(s);
+			f->latency += s->flow_latency();
+		}
+		p.next_hop = std::uint32_t(hops.size() - 1);
+		f->pkt = std::move(p);
+		m_flows.push_back(std::move(f));
+
+		if (m_update_posted) return;
+		m_update_posted = true;
+		m_sim.get_io_service().post(std::bind(&flow_network::update, this));
+	}
+
+	void flow_network::detach(flow_handler* h)
+	{
+		for (auto& f : m_flows)
+			if (f->handler == h) f->handler = nullptr;
+	}
+
+	void flow_network::on_timer(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		update();
+	}
+
+	void flow_network::update()
+	{
+		m_update_posted = false;
+		time_point const now = chrono::high_resolution_clock::now();
+		double const elapsed = double(chrono::duration_cast<chrono::nanoseconds>(
+			now - m_last_update).count()) / 1e9;
+		m_last_update = now;
+
+		// flows that were just added have a rate of 0, they start now
+		std::vector<std::unique_ptr<flow>> done;
+		auto const advance = [&]()
+		{
+			std::size_t keep = 0;
+			for (std::size_t i = 0; i < m_flows.size(); ++i)
+			{
+				flow& f = *m_flows[i];
+				if (is_done(f.remaining, f.rate)) done.push_back(std::move(m_flows[i]));
+				else m_flows[keep++] = std::move(m_flows[i]);
+			}
+			m_flows.resize(keep);
+		};
+
+		for (auto& f : m_flows)
+			if (f->rate != unlimited) f->remaining -= f->rate * elapsed;
+		advance();
+
+		// flows not limited by any link are done right away, and don't affect
+		// the rates of the others
+		compute_rates();
+		advance();
+
+		time_point next = (time_point::max)();
+		for (auto const& f : m_flows)
+		{
+			// a flow starved by rounding errors waits for the next update
+			if (f->rate <= 0) continue;
+			duration const left(std::int64_t(std::ceil(f->remaining / f->rate * 1e9)));
+			if (now + left < next) next = now + left;
+		}
+		if (next != (time_point::max)())
+		{
+			m_timer.expires_at(next);
+			m_timer.async_wait(std::bind(&flow_network::on_timer, this, _1));
+		}
+		else
+		{
+			m_timer.cancel();
+		}
+
+		// delivering a flow may start another one, which posts another update
+		for (auto& f : done)
+		{
+			flow_handler* h = f->handler;
+			if (f->dst != no_node)
+				m_sim.deliver_packet(f->dst, f->latency, std::move(f->pkt));
+			if (h) h->flow_sent();
+		}
+	}
+
+	void flow_network::compute_rates()
+	{
+		// progressive filling. The link with the smallest fair share is the
+		// bottleneck of every flow through it that doesn't have a rate yet.
+		// Those flows get that share, and it's taken out of the capacity of
+		// the other links they go through. Links are kept in the order flows
+		// first use them, to break ties the same way every time
+		struct link
+		{
+			double capacity;
+			int num_flows;
+		};
+		std::vector<link> links;
+		std::unordered_map<sink*, std::size_t> link_index;
+		double const unassigned = -1;
+		for (auto& f : m_flows)
+		{
+			f->rate = unassigned;
+			for (sink* s : f->links)
+			{
+				auto const i = link_index.insert(std::make_pair(s, links.size()));
+				if (i.second) links.push_back({double(s->flow_capacity()), 0});
+				++links[i.first->second].num_flows;
+			}
+		}
+
+		for (;;)
+		{
+			std::size_t bottleneck = links.size();
+			double share = unlimited;
+			for (std::size_t i = 0; i < links.size(); ++i)
+			{
+				if (links[i].num_flows == 0) continue;
+				double const s = links[i].capacity / links[i].num_flows;
+				if (s < share)
+				{
+					share = s;
+					bottleneck = i;
+				}
+			}
+			if (bottleneck == links.size()) break;
+
+			for (auto& f : m_flows)
+			{
+				if (f->rate != unassigned) continue;
+				bool limited = false;
+				for (sink* s : f->links)
+					if (link_index[s] == bottleneck) limited = true;
+				if (!limited) continue;
+
+				f->rate = share;
+				for (sink* s : f->links)
+				{
+					link& l = links[link_index[s]];
+					l.capacity = (std::max)(0.0, l.capacity - share);
+					--l.num_flows;
+				}
+			}
+		}
+
+		for (auto& f : m_flows)
+			if (f->rate == unassigned) f->rate = unlimited;
+	}
+}}
+
@@ -24,18 +24,33 @@ All rights reserved.
 namespace sim { namespace chrono {
 	namespace {
 
-		// this is the global simulation timer
-		high_resolution_clock::time_point g_simulation_time;
+		// this is the simulation timer. Every simulation has its own clock,
+		// and the thread running it points this at it (see bind()). When nodes
+		// run in parallel, every thread has its own, since they are at
+		// different points in time
+		thread_local high_resolution_clock::time_point* g_simulation_time = nullptr;
+
+		// the time used by threads that aren't bound to a simulation
+		thread_local high_resolution_clock::time_point g_unbound_time;
 	}
 
 	high_resolution_clock::time_point high_resolution_clock::now()
 	{
-		return g_simulation_time;
+		return g_simulation_time ? *g_simulation_time : g_unbound_time;
 	}
 
 	void high_resolution_clock::fast_forward(high_resolution_clock::duration d)
 	{
-		g_simulation_time += d;
+		if (g_simulation_time) *g_simulation_time += d;
+		else g_unbound_time += d;
+	}
+
+	high_resolution_clock::time_point* high_resolution_clock::bind(
+		high_resolution_clock::time_point* t)
+	{
+		time_point* const ret = g_simulation_time;
+		g_simulation_time = t;
+		return ret;
 	}
 
 } // chrono
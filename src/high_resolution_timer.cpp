@@ -27,16 +27,14 @@ namespace sim
 	namespace asio {
 
 	high_resolution_timer::high_resolution_timer(io_service& io_service)
-		: m_expiration_time(time_type())
-		, m_io_service(io_service)
+		: m_io_service(io_service)
 		, m_expired(true)
 	{
 	}
 
 	high_resolution_timer::high_resolution_timer(io_service& io_service,
 		const time_type& expiry_time)
-		: m_expiration_time(time_type())
-		, m_io_service(io_service)
+		: m_io_service(io_service)
 		, m_expired(true)
 	{
 		expires_at(expiry_time);
@@ -44,13 +42,22 @@ namespace sim
 
 	high_resolution_timer::high_resolution_timer(io_service& io_service,
 		const duration_type& expiry_time)
-		: m_expiration_time(time_type())
-		, m_io_service(io_service)
+		: m_io_service(io_service)
 		, m_expired(true)
 	{
 		expires_from_now(expiry_time);
 	}
 
+	high_resolution_timer::~high_resolution_timer()
+	{
+		// the timer queue must not be left with a pointer to this timer. Any
+		// outstanding handler is dropped, it may refer to the object owning
+		// this timer, which is being destructed
+		if (m_expired) return;
+		m_expired = true;
+		m_io_service.remove_timer(this);
+	}
+
 	std::size_t high_resolution_timer::cancel(boost::system::error_code& ec)
 	{
 		ec.clear();
@@ -81,7 +88,7 @@ namespace sim
 	}
 
 	high_resolution_timer::time_type high_resolution_timer::expires_at() const
-	{ return m_expiration_time; }
+	{ return m_queue_hook.time; }
 
 	std::size_t high_resolution_timer::expires_at(const high_resolution_timer::time_type& expiry_time)
 	{
@@ -92,16 +99,32 @@ namespace sim
 	std::size_t high_resolution_timer::expires_at(const high_resolution_timer::time_type& expiry_time, boost::system::error_code& ec)
 	{
 		ec.clear();
-		std::size_t ret = cancel(ec);
-		m_expiration_time = expiry_time;
-		m_expired = false;
-		m_io_service.add_timer(this);
+		if (m_expired)
+		{
+			m_queue_hook.time = expiry_time;
+			m_expired = false;
+			m_io_service.add_timer(this);
+			return 0;
+		}
+
+		// the timer is already scheduled. Abort the outstanding handler (if
+		// any) and move the timer to its new position in the queue, rather
+		// than removing and inserting it again
+		std::size_t ret = 0;
+		if (m_handler)
+		{
+			m_io_service.post(std::bind(m_handler
+				, boost::system::error_code(boost::asio::error::operation_aborted)));
+			m_handler = 0;
+			ret = 1;
+		}
+		m_io_service.update_timer(this, expiry_time);
 		return ret;
 	}
 
 	high_resolution_timer::duration_type high_resolution_timer::expires_from_now() const
 	{
-		return m_expiration_time - chrono::high_resolution_clock::now();
+		return expires_at() - chrono::high_resolution_clock::now();
 	}
 
 	std::size_t high_resolution_timer::expires_from_now(const duration_type& expiry_time)
@@ -113,12 +136,7 @@ namespace sim
 	std::size_t high_resolution_timer::expires_from_now(const duration_type& expiry_time
 		, boost::system::error_code& ec)
 	{
-		ec.clear();
-		std::size_t ret = cancel(ec);
-		m_expiration_time = chrono::high_resolution_clock::now() + expiry_time;
-		m_expired = false;
-		m_io_service.add_timer(this);
-		return ret;
+		return expires_at(chrono::high_resolution_clock::now() + expiry_time, ec);
 	}
 
 	void high_resolution_timer::wait()
@@ -132,21 +150,38 @@ namespace sim
 	{
 		assert(false);
 		time_type now = chrono::high_resolution_clock::now();
-		if (now >= m_expiration_time) return;
-		chrono::high_resolution_clock::fast_forward(m_expiration_time - now);
+		if (now >= expires_at()) return;
+		chrono::high_resolution_clock::fast_forward(expires_at() - now);
 	}
 
-	void high_resolution_timer::async_wait(boost::function<void(boost::system::error_code)> handler)
+	void high_resolution_timer::async_wait(boost::function<void(boost::system::error_code const&)> handler)
 	{
 		// TODO: support multiple handlers
 		assert(!m_handler);
-		m_handler = handler;
+		m_handler.swap(handler);
 		if (m_expired) {
 			fire(boost::system::error_code());
 			return;
 		}
 	}
 
+	void high_resolution_timer::invoke()
+	{
+		// the timer already has its position in the event queue, there's no
+		// need to post the handler and have it queued a second time
+		m_expired = true;
+		if (!m_handler) return;
+		boost::function<void(boost::system::error_code const&)> h;
+		h.swap(m_handler);
+		h(boost::system::error_code());
+	}
+
+	void high_resolution_timer::abandon()
+	{
+		m_expired = true;
+		m_handler = 0;
+	}
+
 	void high_resolution_timer::fire(boost::system::error_code ec)
 	{
 		m_expired = true;
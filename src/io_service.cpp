@@ -20,8 +20,45 @@ All rights reserved.
 
 #include <boost/make_shared.hpp>
 #include <boost/system/error_code.hpp>
+#include <algorithm>
 
-namespace sim { namespace asio {
+namespace sim {
+namespace aux {
+
+	// the last hop of every route to a node. It looks up the socket a packet
+	// is for once the packet has arrived at the node. TCP connection attempts
+	// end here, as do all UDP packets, which are delivered to the socket bound
+	// to their destination endpoint, if there is one by the time they arrive
+	struct node_demux final : sink
+	{
+		explicit node_demux(asio::io_service* ios) : m_ios(ios) {}
+
+		virtual void incoming_packet(packet p) override
+		{
+			if (m_ios == nullptr) return;
+			if (p.type == packet::syn)
+			{
+				m_ios->incoming_syn(std::move(p));
+				return;
+			}
+			asio::ip::udp::endpoint const to = p.to;
+			m_ios->incoming_udp(to, std::move(p));
+		}
+
+		virtual std::string label() const override { return "node sockets"; }
+
+		asio::io_service* node() const { return m_ios; }
+
+		// called when the io_service is destructed
+		void clear() { m_ios = nullptr; }
+
+	private:
+		asio::io_service* m_ios;
+	};
+
+} // aux
+
+namespace asio {
 
 	io_service::io_service(sim::simulation& sim)
 		: io_service(sim, std::vector<asio::ip::address>())
@@ -34,6 +71,9 @@ namespace sim { namespace asio {
 	io_service::io_service(sim::simulation& sim, std::vector<asio::ip::address> const& ips)
 		: m_sim(sim)
 		, m_ips(ips)
+		, m_demux(std::make_shared<aux::node_demux>(this))
+		, m_node_id(0)
+		, m_sequence(0)
 		, m_stopped(false)
 	{
 		for (auto const& ip : m_ips)
@@ -46,6 +86,10 @@ namespace sim { namespace asio {
 
 	io_service::~io_service()
 	{
+		// the sockets still lingering give up, while their timers can still
+		// be removed from the simulation
+		m_lingering_sockets.clear();
+		m_demux->clear();
 		m_sim.remove_io_service(this);
 	}
 
@@ -116,10 +160,10 @@ namespace sim { namespace asio {
 	}
 
 	void io_service::dispatch(boost::function<void()> handler)
-	{ m_sim.get_internal_service().dispatch(handler); }
+	{ m_sim.dispatch(*this, std::move(handler)); }
 
 	void io_service::post(boost::function<void()> handler)
-	{ m_sim.get_internal_service().post(handler); }
+	{ m_sim.post(*this, std::move(handler)); }
 
 	// private interface
 
@@ -128,13 +172,27 @@ namespace sim { namespace asio {
 		m_sim.add_timer(t);
 	}
 
+	void io_service::update_timer(high_resolution_timer* t
+		, chrono::high_resolution_clock::time_point expiration)
+	{
+		m_sim.update_timer(t, expiration);
+	}
+
 	void io_service::remove_timer(high_resolution_timer* t)
 	{
 		m_sim.remove_timer(t);
 	}
 
-	boost::asio::io_service& io_service::get_internal_service()
-	{ return m_sim.get_internal_service(); }
+	void io_service::add_event(aux::event* e
+		, chrono::high_resolution_clock::time_point const time)
+	{
+		m_sim.add_event(e, *this, time);
+	}
+
+	void io_service::remove_event(aux::event* e)
+	{
+		m_sim.remove_event(e);
+	}
 
 	ip::tcp::endpoint io_service::bind_socket(ip::tcp::socket* socket
 		, ip::tcp::endpoint ep, boost::system::error_code& ec)
@@ -177,13 +235,49 @@ namespace sim { namespace asio {
 			return ip::tcp::endpoint();
 		}
 
-		return m_sim.bind_socket(socket, ep, ec);
+		if (ep.port() < 1024 && ep.port() > 0)
+		{
+			// emulate process not running as root
+			ec = boost::asio::error::access_denied;
+			return ip::tcp::endpoint();
+		}
+
+		if (ep.port() == 0)
+		{
+			// if the socket is being bound to port 0, it means the system picks a
+			// free port.
+			ep.port(2000);
+			auto i = m_listen_sockets.lower_bound(ep);
+			while (i != m_listen_sockets.end() && i->first == ep)
+			{
+				ep.port(ep.port() + 1);
+				if (ep.port() > 65530)
+				{
+					ec = boost::asio::error::address_in_use;
+					return ip::tcp::endpoint();
+				}
+				i = m_listen_sockets.lower_bound(ep);
+			}
+		}
+
+		auto i = m_listen_sockets.lower_bound(ep);
+		if (i != m_listen_sockets.end() && i->first == ep)
+		{
+			ec = boost::asio::error::address_in_use;
+			return ip::tcp::endpoint();
+		}
+
+		m_listen_sockets.insert(i, std::make_pair(ep, socket));
+		ec.clear();
+		return ep;
 	}
 
 	void io_service::unbind_socket(ip::tcp::socket* socket
 		, ip::tcp::endpoint ep)
 	{
-		m_sim.unbind_socket(socket, ep);
+		auto i = m_listen_sockets.find(ep);
+		if (i == m_listen_sockets.end() || i->second != socket) return;
+		m_listen_sockets.erase(i);
 	}
 
 	ip::udp::endpoint io_service::bind_udp_socket(ip::udp::socket* socket
@@ -227,25 +321,146 @@ namespace sim { namespace asio {
 			return ip::udp::endpoint();
 		}
 
-		return m_sim.bind_udp_socket(socket, ep, ec);
+		if (ep.port() < 1024 && ep.port() > 0)
+		{
+			// emulate process not running as root
+			ec = boost::asio::error::access_denied;
+			return ip::udp::endpoint();
+		}
+
+		if (ep.port() == 0)
+		{
+			// if the socket is being bound to port 0, it means the system picks a
+			// free port.
+			ep.port(2000);
+			auto i = m_udp_sockets.lower_bound(ep);
+			while (i != m_udp_sockets.end() && i->first == ep)
+			{
+				ep.port(ep.port() + 1);
+				if (ep.port() > 65530)
+				{
+					ec = boost::asio::error::address_in_use;
+					return ip::udp::endpoint();
+				}
+				i = m_udp_sockets.lower_bound(ep);
+			}
+		}
+
+		auto i = m_udp_sockets.lower_bound(ep);
+		if (i != m_udp_sockets.end() && i->first == ep)
+		{
+			ec = boost::asio::error::address_in_use;
+			return ip::udp::endpoint();
+		}
+
+		m_udp_sockets.insert(i, std::make_pair(ep, socket));
+		ec.clear();
+		return ep;
 	}
 
 	void io_service::unbind_udp_socket(ip::udp::socket* socket
 		, ip::udp::endpoint ep)
 	{
-		m_sim.unbind_udp_socket(socket, ep);
+		auto i = m_udp_sockets.find(ep);
+		if (i == m_udp_sockets.end() || i->second != socket) return;
+		m_udp_sockets.erase(i);
+	}
+
+	void io_service::add_lingering_socket(std::unique_ptr<ip::tcp::socket> s)
+	{
+		m_lingering_sockets.push_back(std::move(s));
+	}
+
+	void io_service::remove_lingering_socket(ip::tcp::socket* s)
+	{
+		auto i = std::find_if(m_lingering_sockets.begin()
+			, m_lingering_sockets.end()
+			, [s](std::unique_ptr<ip::tcp::socket> const& e) { return e.get() == s; });
+		if (i == m_lingering_sockets.end()) return;
+		m_lingering_sockets.erase(i);
 	}
 
 	std::shared_ptr<aux::channel> io_service::internal_connect(ip::tcp::socket* s
 		, ip::tcp::endpoint const& target, boost::system::error_code& ec)
 	{
-		return m_sim.internal_connect(s, target, ec);
+		io_service* remote = m_sim.find_node(target.address());
+		if (remote == nullptr)
+		{
+			ec = boost::system::error_code(error::connection_refused);
+			return std::shared_ptr<aux::channel>();
+		}
+
+		ip::tcp::endpoint const from = s->local_endpoint(ec);
+		if (ec) return std::shared_ptr<aux::channel>();
+
+		// whether there's a socket listening on the target endpoint isn't known
+		// until the SYN arrives at the remote node. The route ends at its
+		// demultiplexer, which either hands the SYN to the listening socket or
+		// responds with connection refused
+		std::shared_ptr<aux::channel> c = std::make_shared<aux::channel>();
+		c->hops[0] = std::make_shared<route const>(
+			remote->get_outgoing_route(target.address())
+			+ m_sim.network_route(target.address(), from.address())
+			+ s->get_incoming_route());
+		route hops = s->get_outgoing_route()
+			+ m_sim.network_route(from.address(), target.address())
+			+ remote->get_incoming_route(target.address());
+		hops.append(remote->m_demux);
+		c->hops[1] = std::make_shared<route const>(std::move(hops));
+
+		c->ep[0] = from;
+		c->ep[1] = target;
+
+		aux::packet p;
+		p.type = aux::packet::syn;
+		p.overhead = 28;
+		p.from = asio::ip::udp::endpoint(from.address(), from.port());
+		p.channel = c;
+		p.set_route(c->hops[1]);
+
+		forward_packet(std::move(p));
+
+		return c;
+	}
+
+	std::shared_ptr<sink> io_service::get_demux() const { return m_demux; }
+
+	std::shared_ptr<route const> io_service::find_udp_socket(
+		asio::ip::udp::socket const& socket, ip::udp::endpoint const& ep)
+	{
+		return m_sim.udp_route(*this, socket.local_endpoint().address()
+			, ep.address());
+	}
+
+	void io_service::forward_packet(aux::packet p)
+	{
+		m_sim.forward_packet(*this, std::move(p));
+	}
+
+	void io_service::incoming_syn(aux::packet p)
+	{
+		ip::tcp::endpoint const& target = p.channel->ep[1];
+		auto const i = m_listen_sockets.find(target);
+		if (i != m_listen_sockets.end() && i->second->internal_is_listening())
+		{
+			i->second->incoming_packet(std::move(p));
+			return;
+		}
+
+		aux::packet err;
+		err.type = aux::packet::error;
+		err.ec = boost::system::error_code(error::connection_refused);
+		err.overhead = 28;
+		err.from = asio::ip::udp::endpoint(target.address(), target.port());
+		err.set_route(p.channel->hops[0]);
+		forward_packet(std::move(err));
 	}
 
-	route io_service::find_udp_socket(asio::ip::udp::socket const& socket
-		, ip::udp::endpoint const& ep)
+	void io_service::incoming_udp(ip::udp::endpoint const& ep, aux::packet p)
 	{
-		return m_sim.find_udp_socket(socket, ep);
+		auto const i = m_udp_sockets.find(ep);
+		if (i == m_udp_sockets.end()) return;
+		i->second->incoming_packet(std::move(p));
 	}
 
 } // asio
@@ -18,27 +18,59 @@ All rights reserved.
 
 #include "simulator/queue.hpp"
 #include <functional>
+#include <cinttypes>
+#include <algorithm>
 
 typedef sim::chrono::high_resolution_clock::time_point time_point;
 typedef sim::chrono::high_resolution_clock::duration duration;
 
+namespace
+{
+	// a train that would take longer than this to leave a queue is split up,
+	// the way TSO sizes its super-segments to about a millisecond of data.
+	// Slow links end up forwarding single segments, and the receiver never
+	// waits long for the end of a train
+	duration const max_train_span
+		= sim::chrono::duration_cast<duration>(sim::chrono::milliseconds(1));
+}
+
 namespace sim
 {
 	using namespace aux;
 
 	queue::queue(asio::io_service& ios
-		, int bandwidth
+		, std::int64_t bandwidth
 		, chrono::high_resolution_clock::duration propagation_delay
-		, int max_queue_size
+		, std::int64_t max_queue_size
 		, std::string name)
 		: m_max_queue_size(max_queue_size)
 		, m_forwarding_latency(propagation_delay)
 		, m_bandwidth(bandwidth)
+		, m_ns_per_byte(0)
+		, m_ns_per_byte_frac(0)
+		, m_frac_carry(0)
 		, m_queue_size(0)
 		, m_node_name(name)
-		, m_forward_timer(ios)
+		, m_queue_head(0)
+		, m_releases_head(0)
+		, m_ios(ios)
+		, m_departure(*this)
 		, m_last_forward(chrono::high_resolution_clock::now())
-	{}
+	{
+		if (m_bandwidth > 0)
+		{
+			// 10^9 << 32 still fits in 64 bits
+			std::uint64_t const ns_per_byte = (std::uint64_t(1000000000) << 32)
+				/ std::uint64_t(m_bandwidth);
+			m_ns_per_byte = ns_per_byte >> 32;
+			m_ns_per_byte_frac = ns_per_byte & 0xffffffff;
+		}
+	}
+
+	queue::~queue()
+	{
+		if (m_departure.m_scheduled) m_ios.remove_event(&m_departure);
+	}
 
 	std::string queue::label() const
 	{
@@ -47,13 +79,13 @@ namespace sim
 
 		if (m_bandwidth != 0)
 		{
-			p += snprintf(ret + p, sizeof(ret) - p, "rate: %d kB/s\n"
+			p += snprintf(ret + p, sizeof(ret) - p, "rate: %" PRId64 " kB/s\n"
 				, m_bandwidth / 1000);
 		}
 
 		if (m_queue_size != 0)
 		{
-			p += snprintf(ret + p, sizeof(ret) - p, "queue: %d kB\n"
+			p += snprintf(ret + p, sizeof(ret) - p, "queue: %" PRId64 " kB\n"
 				, m_queue_size / 1000);
 		}
 
@@ -66,75 +98,206 @@ namespace sim
 		return ret;
 	}
 
+	duration queue::fixed_delay() const
+	{
+		if (m_bandwidth != 0 || m_max_queue_size != 0) return duration(-1);
+		return m_forwarding_latency;
+	}
+
 	void queue::incoming_packet(aux::packet p)
 	{
+		// the segments of a SACK are the sequence numbers it ACKs, it's a
+		// single packet
+		if (p.type == aux::packet::payload && p.segments > 1)
+		{
+			incoming_train(std::move(p));
+			return;
+		}
+
 		const int packet_size = p.buffer.size() + p.overhead;
+		time_point const now = chrono::high_resolution_clock::now();
+		release_sent(now);
 
-		// tail-drop
+		// tail-drop. The sender isn't told, it has to notice the packet
+		// missing
 		if (p.ok_to_drop()
 			&& m_max_queue_size > 0
 			&& m_queue_size + packet_size > m_max_queue_size)
-		{
-			// if any hop on the network drops a packet, it has to return it to the
-			// sender.
-			auto drop_fun = std::move(p.drop_fun);
-			if (drop_fun) (*drop_fun)(std::move(p));
 			return;
-		}
 
-		time_point now = chrono::high_resolution_clock::now();
+		// packets leave in the order they arrive. A packet starts being sent
+		// once it has been delayed by the forwarding latency, and the packet
+		// ahead of it has been sent. That makes its departure time known
+		// right away, and it only takes a single event to forward it.
+		// m_last_forward is the departure time of the last packet in the
+		// queue (or of the last one that left, if the queue is empty)
+		time_point const ready = now + m_forwarding_latency;
+		if (m_last_forward < ready) m_last_forward = ready;
+		m_last_forward += serialization_delay(packet_size);
 
-		m_queue.emplace_back(now + m_forwarding_latency, std::move(p));
+		m_queue.emplace_back(m_last_forward, std::move(p));
+		m_releases.emplace_back(m_last_forward, packet_size);
 		m_queue_size += packet_size;
-		if (m_queue.size() > 1) return;
+		if (m_queue.size() - m_queue_head > 1) return;
 
-		begin_send_next_packet();
+		send_next_packet();
 	}
 
-	void queue::begin_send_next_packet()
+	void queue::incoming_train(aux::packet p)
 	{
-		time_point now = chrono::high_resolution_clock::now();
+		int const segment_size = int(p.segment_size) + p.overhead / int(p.segments);
+		time_point const now = chrono::high_resolution_clock::now();
+		release_sent(now);
 
-		if (m_queue.front().first > now)
+		// the same as for a single packet, for every segment. Segment i
+		// arrives i / (segments - 1) of the span after the first one. It's
+		// tail-dropped if the queue is full by then, counting the segments
+		// ahead of it that haven't been sent yet. Dropped segments are marked
+		// by a departure time of min()
+		std::uint32_t const n = p.segments;
+		std::int64_t size = m_queue_size;
+		std::size_t sent = m_releases_head;
+		m_departures.clear();
+		for (std::uint32_t i = 0; i < n; ++i)
 		{
-			m_forward_timer.expires_at(m_queue.front().first);
-			m_forward_timer.async_wait(std::bind(&queue::begin_send_next_packet
-				, this));
-			return;
+			duration const offset(n > 1 ? p.span.count() * i / (n - 1) : 0);
+			time_point const arrival = now + offset;
+			for (; sent < m_releases.size() && m_releases[sent].first <= arrival; ++sent)
+				size -= m_releases[sent].second;
+
+			if (m_max_queue_size > 0 && size + segment_size > m_max_queue_size)
+			{
+				m_departures.push_back((time_point::min)());
+				continue;
+			}
+
+			time_point const ready = arrival + m_forwarding_latency;
+			if (m_last_forward < ready) m_last_forward = ready;
+			m_last_forward += serialization_delay(segment_size);
+			m_departures.push_back(m_last_forward);
+			m_releases.emplace_back(m_last_forward, segment_size);
+			m_queue_size += segment_size;
+			size += segment_size;
 		}
 
-		m_last_forward = now;
-		if (m_bandwidth == 0)
+		// the segments leave back-to-back while they're held up by the ones
+		// ahead of them, and as they arrive otherwise. Every run of evenly
+		// spaced segments (give or take the rounding to whole nanoseconds) is
+		// forwarded as a train
+		bool const was_empty = m_queue_head == m_queue.size();
+		duration const rounding = chrono::duration_cast<duration>(
+			chrono::nanoseconds(1));
+		auto const dropped = [&](std::uint32_t i)
+		{ return m_departures[i] == (time_point::min)(); };
+		std::uint32_t start = 0;
+		while (start < n)
 		{
-			m_forward_timer.get_io_service().post(std::bind(&queue::next_packet_sent
-				, this));
-			return;
+			if (dropped(start))
+			{
+				if (start + 1 < n) p.split(1);
+				++start;
+				continue;
+			}
+
+			std::uint32_t end = start + 1;
+			if (end < n && !dropped(end)
+				&& m_departures[end] - m_departures[start] <= max_train_span)
+			{
+				duration const gap = m_departures[end] - m_departures[start];
+				for (++end; end < n && !dropped(end); ++end)
+				{
+					duration const d = m_departures[end] - m_departures[end - 1];
+					if (d > gap + rounding || d + rounding < gap) break;
+					if (m_departures[end] - m_departures[start] > max_train_span) break;
+				}
+			}
+
+			aux::packet run = end == n ? std::move(p) : p.split(end - start);
+			run.span = m_departures[end - 1] - m_departures[start];
+			m_queue.emplace_back(m_departures[start], std::move(run));
+			start = end;
 		}
-		const double nanoseconds_per_byte = 1000000000.0
-			/ double(m_bandwidth);
 
-		aux::packet const& p = m_queue.front().second;
-		const int packet_size = p.buffer.size() + p.overhead;
+		if (was_empty && m_queue_head < m_queue.size()) send_next_packet();
+	}
 
-		m_last_forward += chrono::duration_cast<duration>(chrono::nanoseconds(
-			boost::int64_t(nanoseconds_per_byte * packet_size)));
+	void queue::release_sent(time_point const now)
+	{
+		for (; m_releases_head < m_releases.size()
+			&& m_releases[m_releases_head].first <= now; ++m_releases_head)
+			m_queue_size -= m_releases[m_releases_head].second;
 
-		m_forward_timer.expires_at(m_last_forward);
-		m_forward_timer.async_wait(std::bind(&queue::next_packet_sent
-			, this));
+		if (m_releases_head == m_releases.size())
+		{
+			m_releases.clear();
+			m_releases_head = 0;
+		}
+		else if (m_releases_head > m_releases.size() / 2)
+		{
+			m_releases.erase(m_releases.begin(), m_releases.begin() + m_releases_head);
+			m_releases_head = 0;
+		}
+	}
+
+	duration queue::serialization_delay(int const packet_size)
+	{
+		if (m_bandwidth <= 0) return duration(0);
+
+		// the fractional part of the product is less than 2^64 - 2^32, which
+		// leaves room for the carry
+		std::uint64_t const frac = m_ns_per_byte_frac * std::uint64_t(packet_size)
+			+ m_frac_carry;
+		m_frac_carry = frac & 0xffffffff;
+		return chrono::duration_cast<duration>(chrono::nanoseconds(boost::int64_t(
+			m_ns_per_byte * std::uint64_t(packet_size) + (frac >> 32))));
+	}
+
+	void queue::send_next_packet()
+	{
+		// a packet that's due already leaves after the events scheduled
+		// before it, like a posted handler
+		time_point const departure = (std::max)(m_queue[m_queue_head].first
+			, chrono::high_resolution_clock::now());
+		m_departure.m_scheduled = true;
+		m_ios.add_event(&m_departure, departure);
+	}
+
+	void queue::departure_event::invoke()
+	{
+		m_scheduled = false;
+		m_queue.next_packet_sent();
+	}
+
+	void queue::departure_event::abandon()
+	{
+		m_scheduled = false;
+		m_queue.m_queue.clear();
+		m_queue.m_queue_head = 0;
+		m_queue.m_releases.clear();
+		m_queue.m_releases_head = 0;
+		m_queue.m_queue_size = 0;
 	}
 
 	void queue::next_packet_sent()
 	{
-		aux::packet p = std::move(m_queue.front().second);
-		m_queue.erase(m_queue.begin());
-		const int packet_size = p.buffer.size() + p.overhead;
-		m_queue_size -= packet_size;
+		aux::packet p = std::move(m_queue[m_queue_head].second);
+		++m_queue_head;
+		if (m_queue_head == m_queue.size())
+		{
+			m_queue.clear();
+			m_queue_head = 0;
+		}
+		else if (m_queue_head > m_queue.size() / 2)
+		{
+			m_queue.erase(m_queue.begin(), m_queue.begin() + m_queue_head);
+			m_queue_head = 0;
+		}
+		release_sent(chrono::high_resolution_clock::now());
 
 		forward_packet(std::move(p));
 
-		if (m_queue.size())
-			begin_send_next_packet();
+		if (m_queue_head < m_queue.size())
+			send_next_packet();
 	}
 }
 
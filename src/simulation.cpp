@@ -17,21 +17,197 @@ All rights reserved.
 */
 
 #include "simulator/simulator.hpp"
+#include "simulator/event_queue.hpp"
+#include "simulator/flow_network.hpp"
 #include <boost/make_shared.hpp>
-#include <boost/tuple/tuple.hpp>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <boost/system/system_error.hpp>
+
+#if !defined _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 using namespace sim::asio;
 
+typedef sim::chrono::high_resolution_clock::time_point time_point;
+typedef sim::chrono::high_resolution_clock::duration duration;
+
 namespace sim
 {
-	simulation::simulation(configuration& config)
+	namespace
+	{
+		// the simulation, partition and node whose events the calling thread
+		// is invoking
+		struct thread_context
+		{
+			simulation* sim;
+			aux::partition* part;
+			asio::io_service* node;
+		};
+
+		thread_local thread_context g_context = { nullptr, nullptr, nullptr };
+
+		// the most routes a partition caches, see simulation::udp_route()
+		std::size_t const max_cached_routes = 1 << 16;
+
+		// sets the context of this thread for the duration of a scope
+		struct context_guard
+		{
+			explicit context_guard(thread_context const& c)
+				: m_saved(g_context)
+			{ g_context = c; }
+			~context_guard() { g_context = m_saved; }
+			context_guard(context_guard const&) = delete;
+			context_guard& operator=(context_guard const&) = delete;
+		private:
+			thread_context m_saved;
+		};
+
+		// all threads wait for each other. The last one to arrive runs the
+		// completion function before any thread is released
+		struct barrier
+		{
+			explicit barrier(int n) : m_count(n), m_waiting(0), m_generation(0) {}
+
+			template <class F>
+			void arrive_and_wait(F completion)
+			{
+				std::unique_lock<std::mutex> l(m_mutex);
+				int const generation = m_generation;
+				if (++m_waiting == m_count)
+				{
+					completion();
+					m_waiting = 0;
+					++m_generation;
+					m_cond.notify_all();
+					return;
+				}
+				m_cond.wait(l, [&] { return generation != m_generation; });
+			}
+
+		private:
+			std::mutex m_mutex;
+			std::condition_variable m_cond;
+			int const m_count;
+			int m_waiting;
+			int m_generation;
+		};
+
+		// the clocks of the simulations constructed on this thread, in the
+		// order they were constructed. Outside of run(), the thread's clock is
+		// bound to the last one
+		thread_local std::vector<time_point*> g_clocks;
+
+		// binds the clock of this thread for the duration of a scope
+		struct clock_guard
+		{
+			explicit clock_guard(time_point* t)
+				: m_saved(chrono::high_resolution_clock::bind(t))
+			{}
+			~clock_guard() { chrono::high_resolution_clock::bind(m_saved); }
+			clock_guard(clock_guard const&) = delete;
+			clock_guard& operator=(clock_guard const&) = delete;
+		private:
+			time_point* m_saved;
+		};
+
+		// this replaces a network route where every hop has a fixed delay. The
+		// packet is handed straight to the destination node, as an event owned
+		// by that node
+		struct node_boundary final : sink
+		{
+			node_boundary(simulation& sim, std::uint32_t dst, duration delay)
+				: m_sim(sim), m_dst(dst), m_delay(delay)
+			{}
+
+			virtual void incoming_packet(aux::packet p) override
+			{
+				m_sim.deliver_packet(m_dst, m_delay, std::move(p));
+			}
+
+			virtual std::string label() const override { return "network"; }
+
+			virtual duration fixed_delay() const override { return m_delay; }
+
+		private:
+			simulation& m_sim;
+			std::uint32_t const m_dst;
+			duration const m_delay;
+		};
+	}
+
+	simulation::simulation(configuration& config, scheduler_t s)
 		: m_config(config)
-		, m_internal_ios(*this)
+		, m_scheduler(s)
+		, m_network_model(packet_model)
+		, m_congestion_control(congestion_control::reno)
+		, m_time()
+		, m_num_threads(1)
+		, m_partitioned(false)
+		, m_warned_serial(false)
+		, m_parallel(false)
+		, m_lookahead(0)
 		, m_stopped(false)
+		, m_route_generation(0)
+		, m_internal_ios(*this)
+		, m_pending_forks(0)
+		, m_branch(-1)
 	{
+		g_clocks.push_back(&m_time);
+		chrono::high_resolution_clock::bind(&m_time);
+
+		m_partitions.emplace_back(new aux::partition(s));
 		m_config.build(*this);
 	}
 
+	simulation::~simulation()
+	{
+		// timers may outlive the simulation (the configuration owns queues,
+		// which own timers). Make sure they don't try to remove themselves from
+		// the queue once it's gone
+		for (auto& p : m_partitions)
+		{
+			while (aux::event* e = p->queue->front())
+			{
+				p->queue->pop_front();
+				e->abandon();
+			}
+			for (aux::event* e : p->inbox) e->abandon();
+			p->inbox.clear();
+		}
+
+		// if this thread's clock is bound to this simulation, hand it back to
+		// the simulation constructed before it
+		time_point* const bound = chrono::high_resolution_clock::bind(nullptr);
+		g_clocks.erase(std::remove(g_clocks.begin(), g_clocks.end(), &m_time)
+			, g_clocks.end());
+		chrono::high_resolution_clock::bind(bound != &m_time ? bound
+			: g_clocks.empty() ? nullptr : g_clocks.back());
+	}
+
+	void simulation::set_num_threads(int n)
+	{
+		assert(!m_parallel);
+		merge_partitions();
+		m_num_threads = (std::max)(1, n);
+	}
+
+	void simulation::set_network_model(network_model_t const m)
+	{
+		assert(!m_parallel);
+		merge_partitions();
+		m_network_model = m;
+		if (m == flow_model && !m_flows) m_flows.reset(new aux::flow_network(*this));
+	}
+
 	std::size_t simulation::run()
 	{
 		boost::system::error_code ec;
@@ -40,255 +216,817 @@ namespace sim
 
 	std::size_t simulation::run(boost::system::error_code& ec)
 	{
-		std::size_t ret = 0;
-		std::size_t last_executed = 0;
-		do {
-
-			m_service.reset();
-			last_executed = m_service.poll(ec);
-			ret += last_executed;
-
-			chrono::high_resolution_clock::time_point now
-				= chrono::high_resolution_clock::now();
-
-			std::lock_guard<std::mutex> l(m_timer_queue_mutex);
-			if (!m_timer_queue.empty()) {
-				asio::high_resolution_timer* next_timer = *m_timer_queue.begin();
-				chrono::high_resolution_clock::fast_forward(next_timer->expires_at() - now);
+		ec.clear();
+		return run_impl((time_point::max)()
+			, (std::numeric_limits<std::size_t>::max)());
+	}
 
-				now = chrono::high_resolution_clock::now();
+	std::size_t simulation::poll()
+	{
+		boost::system::error_code ec;
+		return poll(ec);
+	}
 
-				while (!m_timer_queue.empty()
-					&& (*m_timer_queue.begin())->expires_at() <= now) {
+	std::size_t simulation::poll(boost::system::error_code& ec)
+	{
+		ec.clear();
+		return run_impl(m_time + duration(1)
+			, (std::numeric_limits<std::size_t>::max)());
+	}
 
-					next_timer = *m_timer_queue.begin();
-					m_timer_queue.erase(m_timer_queue.begin());
-					next_timer->fire(boost::system::error_code());
-					++last_executed;
-					++ret;
-				}
-			}
+	std::size_t simulation::poll_one()
+	{
+		boost::system::error_code ec;
+		return poll_one(ec);
+	}
 
-//			fprintf(stderr, "run: last_executed: %d stopped: %d timer-queue: %d\n"
-//				, int(last_executed), m_stopped, int(m_timer_queue.size()));
-		} while (last_executed > 0 && !m_stopped);
+	std::size_t simulation::poll_one(boost::system::error_code& ec)
+	{
+		ec.clear();
+		return run_impl(m_time + duration(1), 1);
+	}
 
-//		fprintf(stderr, "exiting simulation::run(): last_executed: %d stopped: %d timer-queue: %d ret: %d\n"
-//			, int(last_executed), m_stopped, int(m_timer_queue.size()), int(ret));
+	std::size_t simulation::run_until(time_point const t)
+	{
+		std::size_t const ret = run_impl(t
+			, (std::numeric_limits<std::size_t>::max)());
+		if (!m_stopped && m_time < t) m_time = t;
 		return ret;
 	}
 
-	void simulation::stop() { m_stopped = true; }
-	bool simulation::stopped() const { return m_stopped; }
-	void simulation::reset() { m_stopped = false; }
+	std::size_t simulation::run_for(duration const d)
+	{
+		return run_until(m_time + d);
+	}
 
-	void simulation::add_timer(asio::high_resolution_timer* t)
+	std::size_t simulation::run_events(std::size_t const n)
 	{
-		if (t->expires_at() == sim::chrono::high_resolution_clock::now())
+		return run_impl((time_point::max)(), n);
+	}
+
+	std::size_t simulation::run_impl(time_point const limit
+		, std::size_t const max_events)
+	{
+		clock_guard clock(&m_time);
+
+		// only the order of events is deterministic in a parallel run, not
+		// how many each thread has invoked
+		if (max_events == (std::numeric_limits<std::size_t>::max)()
+			&& partition_nodes())
+			return run_parallel(limit);
+
+		// the events of all nodes are in partition 0 while running on a single
+		// thread
+		if (m_partitions.size() > 1) merge_partitions();
+
+		aux::partition& p = *m_partitions[0];
+		context_guard guard({this, &p, nullptr});
+		std::size_t ret = 0;
+		while (!m_stopped && ret < max_events)
 		{
-			fprintf(stderr, "WARNING: timer scheduled for current time!\n");
+			aux::event* e = p.queue->front();
+			if (e == nullptr || e->queue_hook().time >= limit) break;
+			p.queue->pop_front();
+			invoke(e);
+			++ret;
 		}
-		std::lock_guard<std::mutex> l(m_timer_queue_mutex);
-		m_timer_queue.insert(t);
+		return ret;
 	}
 
-	void simulation::remove_timer(asio::high_resolution_timer* t)
+	void simulation::invoke(aux::event* e)
 	{
-		std::lock_guard<std::mutex> l(m_timer_queue_mutex);
-		if (m_timer_queue.empty()) return;
-		timer_queue_t::iterator begin;
-		timer_queue_t::iterator end;
-		boost::tuples::tie(begin, end) = m_timer_queue.equal_range(t);
-		if (begin == end) return;
-		begin = std::find(begin, end, t);
-		if (begin == end) return;
-		m_timer_queue.erase(begin);
+		aux::event_queue_hook const& h = e->queue_hook();
+		asio::io_service* owner = h.owner < m_nodes.size() ? m_nodes[h.owner] : nullptr;
+		g_context.node = owner ? owner : &m_internal_ios;
+
+		time_point const now = chrono::high_resolution_clock::now();
+		if (h.time > now)
+			chrono::high_resolution_clock::fast_forward(h.time - now);
+
+		e->invoke();
 	}
 
-	ip::tcp::endpoint simulation::bind_socket(ip::tcp::socket* socket
-		, ip::tcp::endpoint ep, boost::system::error_code& ec)
+	bool simulation::partition_nodes()
 	{
-		assert(ep.address() != boost::asio::ip::address());
+		// the partitions are kept between runs, until merge_partitions()
+		if (m_partitioned) return m_partitions.size() > 1;
+
+		// child processes only have the thread that forked them. The flows
+		// of the flow model are shared by all nodes
+		if (m_num_threads < 2 || m_pending_forks > 0
+			|| m_network_model == flow_model) return false;
+
+		// whether or not the nodes can be split, that holds until a node is
+		// added or removed, or the settings change
+		m_partitioned = true;
+
+		m_lookahead = m_config.min_channel_latency();
+		if (m_lookahead <= duration(0)) return false;
+
+		std::vector<asio::io_service*> nodes;
+		for (asio::io_service* ios : m_nodes)
+			if (ios != nullptr && !ios->m_ips.empty()) nodes.push_back(ios);
+		if (nodes.size() < 2) return false;
+
+		// nodes that must run on the same thread are merged into clusters.
+		// That's the nodes the configuration puts in the same cluster, and
+		// nodes sharing sinks in their incoming or outgoing routes, since the
+		// sinks are used by the thread running the node
+		std::vector<std::uint32_t> cluster(m_nodes.size());
+		for (std::uint32_t i = 0; i < cluster.size(); ++i) cluster[i] = i;
+		auto const find = [&](std::uint32_t n)
+		{
+			while (cluster[n] != n) n = cluster[n] = cluster[cluster[n]];
+			return n;
+		};
+		auto const merge = [&](std::uint32_t a, std::uint32_t b)
+		{
+			a = find(a);
+			b = find(b);
+			// the cluster is represented by its lowest node id
+			if (a < b) cluster[b] = a;
+			else cluster[a] = b;
+		};
+
+		std::map<int, std::uint32_t> declared;
+		std::map<sink*, std::uint32_t> sink_node;
+		for (asio::io_service* ios : nodes)
+		{
+			std::uint32_t const id = ios->m_node_id;
+			for (auto const& ip : ios->m_ips)
+			{
+				int const c = m_config.node_cluster(ip);
+				if (c >= 0)
+				{
+					auto const i = declared.insert(std::make_pair(c, id));
+					if (!i.second) merge(id, i.first->second);
+				}
 
-		if (ep.port() < 1024 && ep.port() > 0)
+				route hops = ios->get_incoming_route(ip)
+					+ ios->get_outgoing_route(ip);
+				while (!hops.empty())
+				{
+					auto const i = sink_node.insert(
+						std::make_pair(hops.pop_front().get(), id));
+					if (!i.second) merge(id, i.first->second);
+				}
+			}
+		}
+
+		// the first node of every cluster, in node id order, and the number of
+		// nodes in each
+		std::vector<asio::io_service*> clusters;
+		std::map<std::uint32_t, int> cluster_size;
+		for (asio::io_service* ios : nodes)
 		{
-			// emulate process not running as root
-			ec = boost::asio::error::access_denied;
-			return ip::tcp::endpoint();
+			std::uint32_t const root = find(ios->m_node_id);
+			if (root == ios->m_node_id) clusters.push_back(ios);
+			++cluster_size[root];
+		}
+		if (clusters.size() < 2)
+		{
+			if (!m_warned_serial)
+				fprintf(stderr, "WARNING: all nodes are in the same cluster, "
+					"running the simulation on a single thread\n");
+			m_warned_serial = true;
+			return false;
 		}
 
-		if (ep.port() == 0)
+		// the lookahead only needs to hold between clusters. Nodes within a
+		// cluster may be connected by any route
+		for (std::size_t i = 0; i < clusters.size(); ++i)
 		{
-			// if the socket is being bound to port 0, it means the system picks a
-			// free port.
-			ep.port(2000);
-			listen_socket_iter_t i = m_listen_sockets.lower_bound(ep);
-			while (i != m_listen_sockets.end() && i->first == ep)
+			asio::io_service* next = clusters[(i + 1) % clusters.size()];
+			route network = m_config.channel_route(clusters[i]->m_ips.front()
+				, next->m_ips.front());
+			duration latency(0);
+			while (!network.empty())
 			{
-				ep.port(ep.port() + 1);
-				if (ep.port() > 65530)
+				duration const d = network.pop_front()->fixed_delay();
+				if (d < duration(0))
 				{
-					ec = boost::asio::error::address_in_use;
-					return ip::tcp::endpoint();
+					latency = d;
+					break;
 				}
-				i = m_listen_sockets.lower_bound(ep);
+				latency += d;
 			}
+			if (latency >= m_lookahead) continue;
+			if (!m_warned_serial)
+				fprintf(stderr, "WARNING: the network latency between clusters is "
+					"less than min_channel_latency(), running the simulation on a "
+					"single thread\n");
+			m_warned_serial = true;
+			return false;
 		}
 
-		listen_socket_iter_t i = m_listen_sockets.lower_bound(ep);
-		if (i != m_listen_sockets.end() && i->first == ep)
+		// split the clusters into contiguous blocks of roughly the same number
+		// of nodes
+		int const max_partitions = int((std::min)(clusters.size()
+			, std::size_t(m_num_threads)));
+		std::map<std::uint32_t, int> cluster_partition;
+		int num_partitions = 0;
+		std::size_t assigned = 0;
+		for (asio::io_service* c : clusters)
 		{
-			ec = boost::asio::error::address_in_use;
-			return ip::tcp::endpoint();
+			int const part = 1 + int(assigned * max_partitions / nodes.size());
+			// a large cluster may cover more than one block
+			num_partitions = (std::min)(num_partitions + 1, part);
+			cluster_partition[c->m_node_id] = num_partitions;
+			assigned += cluster_size[c->m_node_id];
 		}
+		if (num_partitions < 2) return false;
 
-		m_listen_sockets.insert(i, std::make_pair(ep, socket));
-		ec.clear();
-		return ep;
+		std::vector<int> partition(m_nodes.size(), 0);
+		for (asio::io_service* ios : nodes)
+			partition[ios->m_node_id] = cluster_partition[find(ios->m_node_id)];
+
+		for (int i = 0; i < num_partitions; ++i)
+			m_partitions.emplace_back(new aux::partition(m_scheduler));
+		m_node_partition.swap(partition);
+
+		// move the pending events to the partitions of their owners
+		std::vector<aux::event*> events;
+		aux::event_queue& q = *m_partitions[0]->queue;
+		while (aux::event* e = q.front())
+		{
+			q.pop_front();
+			events.push_back(e);
+		}
+		for (aux::event* e : events)
+			m_partitions[m_node_partition[e->queue_hook().owner]]->queue->insert(e);
+
+		return true;
 	}
 
-	void simulation::unbind_socket(ip::tcp::socket* socket
-		, ip::tcp::endpoint ep)
+	void simulation::merge_partitions()
 	{
-		listen_socket_iter_t i = m_listen_sockets.find(ep);
-		if (i == m_listen_sockets.end() || i->second != socket) return;
-		m_listen_sockets.erase(i);
+		m_partitioned = false;
+		// this is also called while the internal io_service is added, before
+		// the first partition exists
+		if (m_partitions.size() < 2) return;
+
+		aux::partition& main = *m_partitions[0];
+		for (std::size_t i = 1; i < m_partitions.size(); ++i)
+		{
+			aux::partition& p = *m_partitions[i];
+			assert(p.inbox.empty());
+			while (aux::event* e = p.queue->front())
+			{
+				p.queue->pop_front();
+				main.queue->insert(e);
+			}
+			main.free_handlers.insert(main.free_handlers.end()
+				, p.free_handlers.begin(), p.free_handlers.end());
+			p.free_handlers.clear();
+			main.free_packets.insert(main.free_packets.end()
+				, p.free_packets.begin(), p.free_packets.end());
+			p.free_packets.clear();
+			main.boundaries.insert(p.boundaries.begin(), p.boundaries.end());
+			p.boundaries.clear();
+			if (p.last_time > main.last_time) main.last_time = p.last_time;
+		}
+		m_partitions.resize(1);
+		std::fill(m_node_partition.begin(), m_node_partition.end(), 0);
 	}
 
-	ip::udp::endpoint simulation::bind_udp_socket(ip::udp::socket* socket
-		, ip::udp::endpoint ep, boost::system::error_code& ec)
+	std::size_t simulation::run_parallel(time_point const limit)
 	{
-		assert(ep.address() != boost::asio::ip::address());
+		int const num_partitions = int(m_partitions.size());
+		time_point const start = chrono::high_resolution_clock::now();
+		for (auto& p : m_partitions) p->last_time = start;
+
+		// the partitions invoke their events in windows of time, no longer than
+		// the lookahead, so nothing a node does in a window can affect another
+		// partition before the next window. Events of partition 0 (the nodes
+		// without IP addresses) and all events scheduled by them are invoked
+		// between windows, while all other threads are waiting
+		barrier sync(num_partitions - 1);
+		time_point window_end;
+		bool done = false;
+		std::vector<std::size_t> invoked(num_partitions, 0);
 
-		if (ep.port() < 1024 && ep.port() > 0)
+		auto const next_window = [&]()
 		{
-			// emulate process not running as root
-			ec = boost::asio::error::access_denied;
-			return ip::udp::endpoint();
-		}
+			aux::partition& serial = *m_partitions[0];
+			context_guard guard({this, &serial, nullptr});
+			for (;;)
+			{
+				if (m_stopped)
+				{
+					done = true;
+					return;
+				}
+
+				// events at or after the limit are left for the next run
+				aux::event* first = nullptr;
+				for (int i = 1; i < num_partitions; ++i)
+				{
+					aux::event* e = m_partitions[i]->queue->front();
+					if (e && e->queue_hook().time < limit && (first == nullptr
+						|| e->queue_hook().time < first->queue_hook().time))
+						first = e;
+				}
+				aux::event* s = serial.queue->front();
+				if (s != nullptr && s->queue_hook().time >= limit) s = nullptr;
+
+				if (s == nullptr && first == nullptr)
+				{
+					done = true;
+					return;
+				}
 
-		if (ep.port() == 0)
+				if (s == nullptr || (first != nullptr
+					&& first->queue_hook().time < s->queue_hook().time))
+				{
+					window_end = first->queue_hook().time + m_lookahead;
+					if (s != nullptr && s->queue_hook().time < window_end)
+						window_end = s->queue_hook().time;
+					if (limit < window_end) window_end = limit;
+					return;
+				}
+
+				// invoke the events partition 0 has at this time, and all events
+				// at this time scheduled by node 0, in the same order as a
+				// single threaded simulation would
+				time_point const t = s->queue_hook().time;
+				for (;;)
+				{
+					int best = -1;
+					aux::event* e = nullptr;
+					for (int i = 0; i < num_partitions; ++i)
+					{
+						aux::event* c = m_partitions[i]->queue->front();
+						if (c == nullptr) continue;
+						if (e == nullptr || aux::event_queue::compare(c, e))
+						{
+							e = c;
+							best = i;
+						}
+					}
+					if (e == nullptr || e->queue_hook().time != t
+						|| (best != 0 && e->queue_hook().origin != 0))
+						break;
+					m_partitions[best]->queue->pop_front();
+					invoke(e);
+					++invoked[0];
+				}
+				if (t > serial.last_time) serial.last_time = t;
+			}
+		};
+
+		auto const worker = [&](int const idx) noexcept
 		{
-			// if the socket is being bound to port 0, it means the system picks a
-			// free port.
-			ep.port(2000);
-			udp_socket_iter_t i = m_udp_sockets.lower_bound(ep);
-			while (i != m_udp_sockets.end() && i->first == ep)
+			aux::partition& p = *m_partitions[idx];
+			context_guard guard({this, &p, nullptr});
+			time_point clock = start;
+			clock_guard bound(&clock);
+
+			for (;;)
 			{
-				ep.port(ep.port() + 1);
-				if (ep.port() > 65530)
 				{
-					ec = boost::asio::error::address_in_use;
-					return ip::udp::endpoint();
+					std::lock_guard<std::mutex> l(p.inbox_mutex);
+					for (aux::event* e : p.inbox) p.queue->insert(e);
+					p.inbox.clear();
 				}
-				i = m_udp_sockets.lower_bound(ep);
+
+				sync.arrive_and_wait(next_window);
+				if (done) break;
+
+				while (aux::event* e = p.queue->front())
+				{
+					if (e->queue_hook().time >= window_end) break;
+					p.queue->pop_front();
+					invoke(e);
+					++invoked[idx];
+				}
+				if (chrono::high_resolution_clock::now() > p.last_time)
+					p.last_time = chrono::high_resolution_clock::now();
+
+				// every partition must be done handing over packets before the
+				// inboxes are emptied
+				sync.arrive_and_wait([]{});
 			}
+		};
+
+		m_parallel = true;
+		std::vector<std::thread> threads;
+		for (int i = 2; i < num_partitions; ++i)
+			threads.emplace_back(worker, i);
+		worker(1);
+		for (auto& t : threads) t.join();
+		m_parallel = false;
+
+		m_time = start;
+		for (auto& p : m_partitions)
+			if (p->last_time > m_time) m_time = p->last_time;
+
+		std::size_t ret = 0;
+		for (std::size_t n : invoked) ret += n;
+		return ret;
+	}
+
+	void simulation::stop() { m_stopped = true; }
+	bool simulation::stopped() const { return m_stopped; }
+	void simulation::reset() { m_stopped = false; }
+
+	void simulation::fork_at(time_point const t, int const num_branches
+		, fork_handler h)
+	{
+#if defined _WIN32
+		throw boost::system::system_error(asio::error::operation_not_supported);
+#else
+		assert(num_branches > 0);
+		assert(h);
+		// a simulation with pending fork points runs on a single thread
+		merge_partitions();
+		m_fork_timers.emplace_back(new asio::high_resolution_timer(m_internal_ios));
+		asio::high_resolution_timer& timer = *m_fork_timers.back();
+		++m_pending_forks;
+		timer.expires_at(t);
+		timer.async_wait([this, num_branches, h](boost::system::error_code const& ec)
+		{
+			--m_pending_forks;
+			if (ec) return;
+			fork_branches(num_branches, h);
+		});
+#endif
+	}
+
+	void simulation::fork_branches(int const num_branches, fork_handler const& h)
+	{
+#if !defined _WIN32
+		// anything buffered would otherwise be printed by every child too
+		std::fflush(nullptr);
+
+		std::vector<pid_t> children;
+		int error = 0;
+		for (int i = 0; i < num_branches; ++i)
+		{
+			pid_t const pid = ::fork();
+			if (pid < 0)
+			{
+				error = errno;
+				break;
+			}
+			if (pid == 0)
+			{
+				// this is the child. It continues the simulation, as branch i
+				m_branch = i;
+				m_branch_exit_codes.clear();
+				h(i);
+				return;
+			}
+			children.push_back(pid);
 		}
 
-		udp_socket_iter_t i = m_udp_sockets.lower_bound(ep);
-		if (i != m_udp_sockets.end() && i->first == ep)
+		m_branch_exit_codes.assign(children.size(), -1);
+		for (std::size_t i = 0; i < children.size(); ++i)
 		{
-			ec = boost::asio::error::address_in_use;
-			return ip::udp::endpoint();
+			int status = 0;
+			while (::waitpid(children[i], &status, 0) < 0 && errno == EINTR);
+			if (WIFEXITED(status)) m_branch_exit_codes[i] = WEXITSTATUS(status);
 		}
 
-		m_udp_sockets.insert(i, std::make_pair(ep, socket));
-		ec.clear();
-		return ep;
+		if (error != 0)
+		{
+			throw boost::system::system_error(boost::system::error_code(error
+				, boost::system::system_category()));
+		}
+
+		// the branches took over from here
+		m_stopped = true;
+#endif
+	}
+
+	asio::io_service& simulation::current_node()
+	{
+		if (g_context.sim == this && g_context.node != nullptr)
+			return *g_context.node;
+		return m_internal_ios;
 	}
 
-	void simulation::unbind_udp_socket(ip::udp::socket* socket
-		, ip::udp::endpoint ep)
+	aux::event_queue& simulation::queue_for(std::uint32_t const owner)
 	{
-		udp_socket_iter_t i = m_udp_sockets.find(ep);
-		if (i == m_udp_sockets.end() || i->second != socket) return;
-		m_udp_sockets.erase(i);
+		if (m_partitions.size() == 1) return *m_partitions.front()->queue;
+		aux::partition& p = *m_partitions[m_node_partition[owner]];
+		assert((!m_parallel || g_context.part == &p
+			|| g_context.part == m_partitions[0].get())
+			&& "nodes running on different threads may only interact over the network");
+		return *p.queue;
 	}
 
-	std::shared_ptr<aux::channel> simulation::internal_connect(
-		asio::ip::tcp::socket* s
-		, ip::tcp::endpoint const& target, boost::system::error_code& ec)
+	void simulation::schedule(aux::event* e, asio::io_service& ios
+		, time_point const time, bool const append)
 	{
-		// find remote socket
-		listen_sockets_t::iterator i = m_listen_sockets.find(target);
-		if (i == m_listen_sockets.end())
+		asio::io_service& origin = current_node();
+		// events of io_services without an IP address belong to the node
+		// scheduling them
+		asio::io_service& owner = ios.m_ips.empty() ? origin : ios;
+
+		aux::event_queue_hook& h = e->queue_hook();
+		h.time = time;
+		h.origin = origin.m_node_id;
+		h.sequence = origin.m_sequence++;
+		h.owner = owner.m_node_id;
+
+		aux::event_queue& q = queue_for(h.owner);
+		if (append) q.append(e);
+		else q.insert(e);
+	}
+
+	void simulation::post(asio::io_service& ios, boost::function<void()> handler)
+	{
+		aux::posted_handler* h = allocate_handler();
+		h->handler.swap(handler);
+		schedule(h, ios, chrono::high_resolution_clock::now(), true);
+	}
+
+	void simulation::dispatch(asio::io_service& ios, boost::function<void()> handler)
+	{
+		if (g_context.sim == this && g_context.part != nullptr)
 		{
-			ec = boost::system::error_code(error::connection_refused);
-			return std::shared_ptr<aux::channel>();
+			handler();
+			return;
 		}
+		post(ios, std::move(handler));
+	}
 
-		// make sure it's a listening socket
-		ip::tcp::socket* remote = i->second;
-		if (!remote->internal_is_listening())
+	aux::posted_handler* simulation::allocate_handler()
+	{
+		aux::partition& p = g_context.sim == this && g_context.part
+			? *g_context.part : *m_partitions[0];
+		if (p.free_handlers.empty()) return new aux::posted_handler(*this);
+		aux::posted_handler* ret = p.free_handlers.back();
+		p.free_handlers.pop_back();
+		return ret;
+	}
+
+	void simulation::free_handler(aux::posted_handler* h)
+	{
+		aux::partition& p = g_context.sim == this && g_context.part
+			? *g_context.part : *m_partitions[0];
+		p.free_handlers.push_back(h);
+	}
+
+	aux::packet_event* simulation::allocate_packet_event()
+	{
+		aux::partition& p = g_context.sim == this && g_context.part
+			? *g_context.part : *m_partitions[0];
+		if (p.free_packets.empty()) return new aux::packet_event(*this);
+		aux::packet_event* ret = p.free_packets.back();
+		p.free_packets.pop_back();
+		return ret;
+	}
+
+	void simulation::free_packet_event(aux::packet_event* e)
+	{
+		aux::partition& p = g_context.sim == this && g_context.part
+			? *g_context.part : *m_partitions[0];
+		p.free_packets.push_back(e);
+	}
+
+	void simulation::add_timer(asio::high_resolution_timer* t)
+	{
+		if (t->expires_at() == sim::chrono::high_resolution_clock::now())
 		{
-			ec = boost::system::error_code(error::connection_refused);
-			return std::shared_ptr<aux::channel>();
+			fprintf(stderr, "WARNING: timer scheduled for current time!\n");
 		}
+		schedule(t, t->get_io_service(), t->expires_at(), false);
+	}
 
-		// create a channel
-		std::shared_ptr<aux::channel> c = std::make_shared<aux::channel>();
+	void simulation::update_timer(asio::high_resolution_timer* t
+		, time_point const expiration)
+	{
+		if (expiration == sim::chrono::high_resolution_clock::now())
+		{
+			fprintf(stderr, "WARNING: timer scheduled for current time!\n");
+		}
 
-		asio::ip::tcp::endpoint from = s->local_endpoint(ec);
+		asio::io_service& origin = current_node();
+		asio::io_service& ios = t->get_io_service();
+		asio::io_service& owner = ios.m_ips.empty() ? origin : ios;
 
-		route network_route = m_config.channel_route(from.address()
-			, target.address());
-		c->hops[0] = remote->get_outgoing_route() + network_route + s->get_incoming_route();
-		c->hops[1] = s->get_outgoing_route() + network_route + remote->get_incoming_route();
+		aux::event_queue_hook& h = t->queue_hook();
+		if (m_node_partition[owner.m_node_id] != m_node_partition[h.owner])
+		{
+			queue_for(h.owner).remove(t);
+			schedule(t, ios, expiration, false);
+			return;
+		}
+		h.owner = owner.m_node_id;
+		queue_for(h.owner).update(t, expiration, origin.m_node_id
+			, origin.m_sequence++);
+	}
 
-		c->ep[0] = s->local_endpoint(ec);
-		c->ep[1] = remote->local_endpoint(ec);
+	void simulation::remove_timer(asio::high_resolution_timer* t)
+	{
+		queue_for(t->queue_hook().owner).remove(t);
+	}
 
-		aux::packet p;
-		p.type = aux::packet::syn;
-		p.overhead = 28;
-		*p.from = asio::ip::udp::endpoint(from.address(), from.port());
-		p.channel = c;
-		if (ec) return std::shared_ptr<aux::channel>();
+	void simulation::add_event(aux::event* e, asio::io_service& ios
+		, time_point const time)
+	{
+		schedule(e, ios, time, false);
+	}
 
-		p.hops = c->hops[1];
+	void simulation::remove_event(aux::event* e)
+	{
+		queue_for(e->queue_hook().owner).remove(e);
+	}
 
-		forward_packet(std::move(p));
+	asio::io_service* simulation::find_node(asio::ip::address const& ip) const
+	{
+		auto const i = m_node_by_ip.find(ip);
+		return i == m_node_by_ip.end() ? nullptr : i->second;
+	}
 
-		return c;
+	route simulation::network_route(asio::ip::address src, asio::ip::address dst)
+	{
+		route ret = m_config.channel_route(src, dst);
+		asio::io_service* node = find_node(dst);
+		if (node == nullptr) return ret;
+
+		duration delay(0);
+		route hops = ret;
+		while (!hops.empty())
+		{
+			duration const d = hops.pop_front()->fixed_delay();
+			if (d < duration(0))
+			{
+				assert((!m_parallel || m_node_partition[node->m_node_id]
+					== m_node_partition[current_node().m_node_id])
+					&& "channel_route() between nodes in different clusters must "
+					"only have fixed delays when running on multiple threads");
+				return ret;
+			}
+			delay += d;
+		}
+		aux::partition& p = g_context.sim == this && g_context.part
+			? *g_context.part : *m_partitions[0];
+		std::shared_ptr<sink>& b = p.boundaries[std::make_pair(node->m_node_id
+			, delay.count())];
+		if (!b) b = std::make_shared<node_boundary>(*this, node->m_node_id, delay);
+		return route().append(b);
 	}
 
-	route simulation::find_udp_socket(asio::ip::udp::socket const& socket
-		, ip::udp::endpoint const& ep)
+	std::shared_ptr<route const> simulation::udp_route(asio::io_service& from
+		, asio::ip::address const& src, asio::ip::address const& dst)
 	{
-		udp_socket_iter_t i = m_udp_sockets.find(ep);
-		if (i == m_udp_sockets.end())
-			return route();
+		aux::partition& p = g_context.sim == this && g_context.part
+			? *g_context.part : *m_partitions[0];
+		std::uint64_t const generation = m_route_generation.load();
+		if (p.route_generation != generation)
+		{
+			p.routes.clear();
+			p.route_generation = generation;
+		}
+
+		auto const key = std::make_pair(src, dst);
+		auto const i = p.routes.find(key);
+		if (i != p.routes.end()) return i->second;
 
-		ip::udp::endpoint src = socket.local_endpoint();
-		route network_route = m_config.channel_route(src.address(), ep.address());
+		asio::io_service* remote = find_node(dst);
+		if (remote == nullptr) return std::shared_ptr<route const>();
 
-		// ask the socket for its incoming route
-		network_route.append(i->second->get_incoming_route());
+		// a node talking to many others (like a DHT node) would otherwise
+		// grow the cache without bounds
+		if (p.routes.size() >= max_cached_routes) p.routes.clear();
 
-		return network_route;
+		route hops = from.get_outgoing_route(src)
+			+ network_route(src, dst)
+			+ remote->get_incoming_route(dst);
+		hops.append(remote->get_demux());
+		std::shared_ptr<route const> ret = std::make_shared<route const>(
+			std::move(hops));
+		p.routes.insert(std::make_pair(key, ret));
+		return ret;
+	}
+
+	void simulation::invalidate_routes()
+	{
+		++m_route_generation;
+	}
+
+	void simulation::forward_packet(asio::io_service& from, aux::packet p)
+	{
+		asio::io_service& node = from.m_ips.empty() ? current_node() : from;
+		context_guard guard({this, g_context.sim == this ? g_context.part : nullptr
+			, &node});
+		sim::forward_packet(std::move(p));
+	}
+
+	void simulation::send_flow(asio::ip::address const& dst
+		, aux::flow_handler* h, aux::packet p)
+	{
+		assert(m_flows && "send_flow() requires the flow_model");
+		// if there's no node at dst, the bytes are still sent, but go nowhere
+		asio::io_service* node = find_node(dst);
+		m_flows->add(node ? node->node_id() : aux::flow_network::no_node, h
+			, std::move(p));
+	}
+
+	void simulation::detach_flow(aux::flow_handler* h)
+	{
+		if (m_flows) m_flows->detach(h);
+	}
+
+	void simulation::deliver_packet(std::uint32_t const dst
+		, duration const delay, aux::packet p)
+	{
+		asio::io_service& origin = current_node();
+
+		aux::packet_event* e = allocate_packet_event();
+		e->pkt = std::move(p);
+
+		aux::event_queue_hook& h = e->queue_hook();
+		h.time = chrono::high_resolution_clock::now() + delay;
+		h.origin = origin.m_node_id;
+		h.sequence = origin.m_sequence++;
+		h.owner = dst;
+
+		aux::partition& part = *m_partitions[m_node_partition[dst]];
+		if (m_parallel && g_context.part != &part
+			&& g_context.part != m_partitions[0].get())
+		{
+			assert(delay >= m_lookahead && "the network latency between nodes "
+				"must not be less than the configuration's min_channel_latency()");
+			std::lock_guard<std::mutex> l(part.inbox_mutex);
+			part.inbox.push_back(e);
+			return;
+		}
+		part.queue->insert(e);
+	}
+
+	namespace aux
+	{
+		void posted_handler::invoke()
+		{
+			// return this object to the free list before invoking the handler,
+			// so that it can be reused by anything the handler posts
+			boost::function<void()> h;
+			h.swap(handler);
+			m_sim.free_handler(this);
+			h();
+		}
+
+		void posted_handler::abandon()
+		{
+			delete this;
+		}
+
+		void packet_event::invoke()
+		{
+			packet p = std::move(pkt);
+			m_sim.free_packet_event(this);
+			sim::forward_packet(std::move(p));
+		}
+
+		void packet_event::abandon()
+		{
+			delete this;
+		}
+
+		partition::~partition()
+		{
+			for (posted_handler* h : free_handlers)
+				delete h;
+			for (packet_event* e : free_packets)
+				delete e;
+		}
 	}
 
 	void simulation::add_io_service(asio::io_service* ios)
 	{
-		bool added = m_nodes.insert(ios).second;
-		(void)added;
-		assert(added);
+		assert(!m_parallel && "nodes can't be added while running on multiple threads");
+		merge_partitions();
+		ios->m_node_id = std::uint32_t(m_nodes.size());
+		m_nodes.push_back(ios);
+		m_node_partition.push_back(0);
+		for (auto const& ip : ios->m_ips)
+			m_node_by_ip[ip] = ios;
+		invalidate_routes();
 	}
 
 	void simulation::remove_io_service(asio::io_service* ios)
 	{
-		auto it = m_nodes.find(ios);
-		assert(it != m_nodes.end());
-		m_nodes.erase(it);
+		assert(!m_parallel && "nodes can't be removed while running on multiple threads");
+		assert(ios->m_node_id < m_nodes.size() && m_nodes[ios->m_node_id] == ios);
+		merge_partitions();
+		m_nodes[ios->m_node_id] = nullptr;
+		for (auto const& ip : ios->m_ips)
+		{
+			auto const i = m_node_by_ip.find(ip);
+			if (i != m_node_by_ip.end() && i->second == ios) m_node_by_ip.erase(i);
+		}
+		invalidate_routes();
 	}
 
 	std::vector<io_service*> simulation::get_all_io_services() const
 	{
 		std::vector<io_service*> ret;
 		ret.reserve(m_nodes.size());
-		std::remove_copy_if(
-			m_nodes.begin(), m_nodes.end(), std::back_inserter(ret)
-			, [](io_service* ios) { return ios->get_ips().empty(); });
+		for (io_service* ios : m_nodes)
+			if (ios != nullptr && !ios->get_ips().empty()) ret.push_back(ios);
 		return ret;
 	}
 
@@ -21,7 +21,11 @@ All rights reserved.
 #include <functional>
 #include <unordered_set>
 #include <set>
+#include <algorithm>
 #include <boost/system/error_code.hpp>
+#include <boost/smart_ptr/make_shared_array.hpp>
+#include <cstring>
+#include <cassert>
 
 typedef sim::chrono::high_resolution_clock::time_point time_point;
 typedef sim::chrono::high_resolution_clock::duration duration;
@@ -37,10 +41,166 @@ namespace ip {
 
 void forward_packet(aux::packet p)
 {
-	std::shared_ptr<sink> next_hop = p.hops.pop_front();
+	// the packet holds a reference to its route, which keeps every hop alive
+	sink* next_hop = p.hops->hop(p.next_hop++);
 	next_hop->incoming_packet(std::move(p));
 }
 
+namespace
+{
+	// a step of the splitmix64 generator. Every 8 bytes of a virtual stream
+	// are generated from the seed and their position, independently of the
+	// rest of the stream
+	std::uint64_t virtual_word(std::uint64_t const seed, std::uint64_t const word)
+	{
+		std::uint64_t x = seed + (word + 1) * 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+}
+
+std::uint8_t virtual_byte(std::uint64_t const seed, std::uint64_t const offset)
+{
+	if (seed == 0) return 0;
+	return std::uint8_t(virtual_word(seed, offset / 8) >> (offset % 8 * 8));
+}
+
+namespace aux
+{
+	payload payload::copy(std::vector<asio::const_buffer> const& bufs
+		, std::size_t const n)
+	{
+		std::uint8_t* data = nullptr;
+		payload ret = allocate(n, data);
+		std::size_t offset = 0;
+		for (auto const& b : bufs)
+		{
+			if (offset == n) break;
+			std::size_t const len = (std::min)(asio::buffer_size(b), n - offset);
+			std::memcpy(data + offset
+				, asio::buffer_cast<std::uint8_t const*>(b), len);
+			offset += len;
+		}
+		assert(offset == n);
+		return ret;
+	}
+
+	payload payload::allocate(std::size_t const n, std::uint8_t*& data)
+	{
+		payload ret;
+		data = nullptr;
+		if (n == 0) return ret;
+
+		// the chunk and its reference count are a single allocation
+		boost::shared_ptr<std::uint8_t[]> chunk
+			= boost::make_shared_noinit<std::uint8_t[]>(n);
+		data = chunk.get();
+		ret.m_chunk = std::move(chunk);
+		ret.m_size = std::uint32_t(n);
+		return ret;
+	}
+
+	payload payload::generate(std::uint64_t const seed
+		, std::uint64_t const offset, std::size_t const n)
+	{
+		payload ret;
+		if (n == 0) return ret;
+		ret.m_seed = seed;
+		ret.m_offset = offset;
+		ret.m_size = std::uint32_t(n);
+		ret.m_virtual = true;
+		return ret;
+	}
+
+	payload payload::slice(std::size_t const offset, std::size_t const n) const
+	{
+		assert(offset + n <= m_size);
+		payload ret;
+		if (n == 0) return ret;
+		ret.m_chunk = m_chunk;
+		ret.m_seed = m_seed;
+		ret.m_offset = m_offset + offset;
+		ret.m_size = std::uint32_t(n);
+		ret.m_virtual = m_virtual;
+		return ret;
+	}
+
+	bool payload::append(payload const& p)
+	{
+		if (p.m_chunk != m_chunk
+			|| p.m_virtual != m_virtual
+			|| p.m_seed != m_seed
+			|| p.m_offset != m_offset + m_size)
+			return false;
+		m_size += p.m_size;
+		return true;
+	}
+
+	void payload::consume(std::size_t const n)
+	{
+		assert(n <= m_size);
+		m_offset += n;
+		m_size -= std::uint32_t(n);
+		// let go of the chunk as soon as possible
+		if (m_size == 0) *this = payload();
+	}
+
+	void payload::copy_to(void* const dst, std::size_t const n) const
+	{
+		assert(n <= m_size);
+		if (n == 0) return;
+		if (!m_virtual)
+		{
+			std::memcpy(dst, m_chunk.get() + m_offset, n);
+			return;
+		}
+
+		std::uint8_t* out = static_cast<std::uint8_t*>(dst);
+		if (m_seed == 0)
+		{
+			std::memset(out, 0, n);
+			return;
+		}
+
+		std::uint64_t pos = m_offset;
+		std::uint64_t const end = m_offset + n;
+		while (pos < end)
+		{
+			std::uint64_t const word = virtual_word(m_seed, pos / 8);
+			for (int i = int(pos % 8); i < 8 && pos < end; ++i, ++pos)
+				*out++ = std::uint8_t(word >> (i * 8));
+		}
+	}
+
+	packet packet::split(std::uint32_t const n)
+	{
+		assert(n > 0 && n < segments);
+		std::size_t const bytes = std::size_t(n) * segment_size;
+		int const head_overhead = int(std::int64_t(overhead) * n / segments);
+
+		packet ret;
+		ret.type = type;
+		ret.ec = ec;
+		ret.buffer = buffer.slice(0, bytes);
+		ret.from = from;
+		ret.to = to;
+		ret.overhead = head_overhead;
+		ret.hops = hops;
+		ret.next_hop = next_hop;
+		ret.channel = channel;
+		ret.seq_nr = seq_nr;
+		ret.segments = n;
+		ret.segment_size = segment_size;
+
+		buffer.consume(bytes);
+		overhead -= head_overhead;
+		seq_nr += n;
+		segments -= n;
+		return ret;
+	}
+}
+
 namespace
 {
 	// this is a dummy sink for endpoints, wrapping an io_service
@@ -0,0 +1,212 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/sweep.hpp"
+
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <boost/system/system_error.hpp>
+
+#if !defined _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#endif
+
+namespace sim
+{
+	sweep::sweep(int max_workers)
+		: m_max_workers(max_workers > 0 ? max_workers
+			: (std::max)(1, int(std::thread::hardware_concurrency())))
+	{}
+
+#if defined _WIN32
+
+	std::vector<sweep::result> sweep::run(int, job_t const&)
+	{
+		throw boost::system::system_error(asio::error::operation_not_supported);
+	}
+
+#else
+
+	namespace
+	{
+		struct worker
+		{
+			pid_t pid;
+			int fd;
+			int point;
+			std::string record;
+		};
+
+		// if starting or reading from a child fails, run() throws while
+		// other children are still running. They're waited for, so they don't
+		// become zombies, and their pipes are closed. Once run() completes
+		// there are no workers left
+		struct reap_workers
+		{
+			explicit reap_workers(std::vector<worker>& w) : workers(w) {}
+			~reap_workers()
+			{
+				for (worker const& w : workers)
+				{
+					// closing the pipe first stops a child blocked writing to it
+					::close(w.fd);
+					int status = 0;
+					while (::waitpid(w.pid, &status, 0) < 0 && errno == EINTR);
+				}
+			}
+			std::vector<worker>& workers;
+		};
+
+		void throw_errno()
+		{
+			throw boost::system::system_error(boost::system::error_code(errno
+				, boost::system::system_category()));
+		}
+
+		// runs in the child process. It never returns
+		void run_child(int fd, int point, sweep::job_t const& job)
+		{
+			int exit_code = 0;
+			try
+			{
+				std::string const record = job(point);
+				char const* ptr = record.data();
+				std::size_t left = record.size();
+				while (left > 0)
+				{
+					ssize_t const ret = ::write(fd, ptr, left);
+					if (ret < 0 && errno == EINTR) continue;
+					if (ret <= 0)
+					{
+						exit_code = 1;
+						break;
+					}
+					ptr += ret;
+					left -= std::size_t(ret);
+				}
+			}
+			catch (std::exception const& e)
+			{
+				std::fprintf(stderr, "sweep point %d failed: %s\n", point, e.what());
+				exit_code = 1;
+			}
+			catch (...)
+			{
+				exit_code = 1;
+			}
+			::close(fd);
+
+			// don't run the destructors of global objects. They belong to the
+			// parent
+			std::fflush(nullptr);
+			::_exit(exit_code);
+		}
+	}
+
+	std::vector<sweep::result> sweep::run(int const num_points, job_t const& job)
+	{
+		std::vector<result> ret(num_points);
+		std::vector<worker> workers;
+		reap_workers reap(workers);
+		int next = 0;
+
+		// anything buffered would otherwise be printed by every child too
+		std::fflush(nullptr);
+
+		while (next < num_points || !workers.empty())
+		{
+			while (next < num_points && int(workers.size()) < m_max_workers)
+			{
+				int fds[2];
+				if (::pipe(fds) != 0) throw_errno();
+				pid_t const pid = ::fork();
+				if (pid < 0)
+				{
+					int const err = errno;
+					::close(fds[0]);
+					::close(fds[1]);
+					errno = err;
+					throw_errno();
+				}
+				if (pid == 0)
+				{
+					::close(fds[0]);
+					for (worker const& w : workers) ::close(w.fd);
+					run_child(fds[1], next, job);
+				}
+				::close(fds[1]);
+				workers.push_back(worker{pid, fds[0], next, std::string()});
+				++next;
+			}
+
+			// read the records as they come in. A child can't exit until its
+			// whole record fits in the pipe
+			std::vector<pollfd> pfds;
+			for (worker const& w : workers)
+				pfds.push_back(pollfd{w.fd, POLLIN, 0});
+			if (::poll(pfds.data(), pfds.size(), -1) < 0)
+			{
+				if (errno == EINTR) continue;
+				throw_errno();
+			}
+
+			for (std::size_t i = pfds.size(); i > 0; --i)
+			{
+				if (pfds[i - 1].revents == 0) continue;
+				worker& w = workers[i - 1];
+				char buf[4096];
+				ssize_t const len = ::read(w.fd, buf, sizeof(buf));
+				if (len < 0 && errno == EINTR) continue;
+				if (len > 0)
+				{
+					w.record.append(buf, std::size_t(len));
+					continue;
+				}
+
+				// the child closed its end of the pipe, it's done
+				::close(w.fd);
+				int status = 0;
+				while (::waitpid(w.pid, &status, 0) < 0 && errno == EINTR);
+
+				result& r = ret[w.point];
+				r.point = w.point;
+				if (WIFEXITED(status))
+				{
+					r.exit_code = WEXITSTATUS(status);
+				}
+				else if (WIFSIGNALED(status))
+				{
+					r.exit_code = -1;
+					r.signal = WTERMSIG(status);
+				}
+				r.record = std::move(w.record);
+				workers.erase(workers.begin() + (i - 1));
+			}
+		}
+
+		return ret;
+	}
+
+#endif
+
+}
+
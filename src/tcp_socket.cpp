@@ -18,7 +18,6 @@ All rights reserved.
 
 #include "simulator/simulator.hpp"
 #include <functional>
-#include <cinttypes>
 #include <boost/system/error_code.hpp>
 #include <boost/function.hpp>
 
@@ -31,31 +30,116 @@ namespace sim {
 namespace asio {
 namespace ip {
 
+	namespace
+	{
+		// in the flow model, a write sends at most this many bytes, as a
+		// single flow. Its payload has to fit in 32 bits
+		std::size_t const max_flow_size = 1 << 30;
+
+		// full segments written together are sent as trains of up to this
+		// many bytes, like the 64 kB super-segments of TSO/GSO
+		int const max_train_size = 64 * 1024;
+
+		// the longest a received packet waits to be ACKed together with the
+		// next one (the minimum on linux)
+		chrono::milliseconds const delayed_ack_timeout(40);
+
+		// the retransmission timeout before the first round-trip has been
+		// measured (RFC 6298), and the range it's kept in. The minimum is the
+		// one on linux
+		chrono::milliseconds const initial_rto(1000);
+		chrono::milliseconds const min_rto(200);
+		chrono::seconds const max_rto(60);
+
+		// the number of timeouts in a row before the connection is given up
+		int const max_rto_backoff = 15;
+
+		// a segment is deemed lost once one sent this many segments after it
+		// has been ACKed (the duplicate ACK threshold)
+		std::uint64_t const dupthresh = 3;
+	}
+
 	tcp::socket::socket(io_service& ios)
 		: socket_base(ios)
+		, m_unsent_size(0)
+		, m_fin_pending(false)
+		, m_no_delay(false)
+		, m_corked(false)
+		, m_short_end_seq(0)
 		, m_connect_timer(ios)
 		, m_mss(1475)
-		, m_queue_size(0)
+		, m_send_virtual(0)
+		, m_send_seed(0)
+		, m_bytes_written(0)
+		, m_send_window_end(0)
+		, m_incoming_head(0)
+		, m_incoming_size(0)
+		, m_bytes_read(0)
+		, m_receive_window_end(0)
 		, m_recv_timer(ios)
 		, m_is_v4(true)
 		, m_recv_null_buffers(false)
 		, m_send_null_buffers(false)
 		, m_next_outgoing_seq(0)
 		, m_next_incoming_seq(0)
-		, m_last_drop_seq(0)
-		, m_cwnd(m_mss * 2)
+		, m_recovery_seq(0)
+		, m_cc_algorithm(ios.sim().congestion_control_algorithm())
+		, m_cc(congestion_control::create(m_cc_algorithm, m_mss))
+		, m_cwnd(m_cc->cwnd())
 		, m_bytes_in_flight(0)
+		, m_bytes_lost(0)
+		, m_delivered(0)
+		, m_sending_flow(false)
+		, m_first_unacked(0)
+		, m_xmit(0)
+		, m_rack_xmit(0)
+		, m_loss_scan(0)
+		, m_srtt(0)
+		, m_rttvar(0)
+		, m_rto(initial_rto)
+		, m_rto_backoff(0)
+		, m_rto_timer(ios)
+		, m_rto_timer_armed(false)
+		, m_packets_to_ack(0)
+		, m_ack_timer(ios)
+		, m_ack_timer_armed(false)
+		, m_lingering(false)
+		, m_orphan(false)
 	{}
 
 	tcp::socket::~socket()
 	{
+		// an orphan is only destructed by the io_service, which gives up on
+		// its bytes
+		if (m_orphan)
+		{
+			m_orphan = false;
+			if (m_lingering) finish_close();
+			return;
+		}
+
+		// unlike closing it again, destructing a closed socket doesn't give
+		// up on the bytes it's still sending
 		boost::system::error_code ec;
-		close(ec);
+		if (!m_lingering) close(ec);
+		if (m_lingering) hand_over_lingering();
+	}
+
+	void tcp::socket::hand_over_lingering()
+	{
+		// like on a real system, the bytes written are still delivered after
+		// the socket is gone. Another one takes over the connection for that
+		std::unique_ptr<socket> s(new socket(m_io_service));
+		s->take_over_lingering(*this);
+		m_io_service.add_lingering_socket(std::move(s));
 	}
 
 	boost::system::error_code tcp::socket::open(tcp protocol
 		, boost::system::error_code& ec)
 	{
+		// neither does opening it again (or connecting or accepting into it).
+		// This socket starts over, with the state the orphan didn't take
+		if (m_lingering) hand_over_lingering();
 		close(ec);
 		m_open = true;
 		m_is_v4 = (protocol == ip::tcp::v4());
@@ -85,8 +169,13 @@ namespace ip {
 		}
 		m_bound_to = bind_ip;
 		m_channel = c;
+		m_send_window_end = c->initial_window[0];
+		m_receive_window_end = std::uint64_t(receive_buffer_limit());
+		c->initial_window[1] = m_receive_window_end;
 		assert(m_forwarder);
-		c->hops[1].replace_last(m_forwarder);
+		route hops = *c->hops[1];
+		hops.replace_last(m_forwarder);
+		c->hops[1] = std::make_shared<route const>(std::move(hops));
 	}
 
 	boost::system::error_code tcp::socket::bind(ip::tcp::endpoint const& ep
@@ -125,36 +214,83 @@ namespace ip {
 
 	boost::system::error_code tcp::socket::close(boost::system::error_code& ec)
 	{
+		// closing it again gives up on the bytes still in flight
+		if (m_lingering)
+		{
+			finish_close();
+			ec.clear();
+			return ec;
+		}
+
+		// the other end has closed already, it's not reading anymore
+		bool const peer_closed = bool(m_incoming_error);
+
 		if (m_channel)
 		{
+			// the FIN carries the ACK of what was received
+			if (m_packets_to_ack > 0) send_ack(m_next_incoming_seq, false);
+
 			int remote = m_channel->remote_idx(m_bound_to);
-			route hops = m_channel->hops[remote];
+			std::shared_ptr<route const> const& hops = m_channel->hops[remote];
 
 			// if m_connect_handler is still set, it means the connection hasn't
 			// been established yet, and this channel points to the acceptor
 			// socket, not another open TCP connection.
-			if (!hops.empty() && !m_connect_handler)
+			if (hops && !m_connect_handler)
 			{
-				aux::packet p;
-				p.type = aux::packet::error;
-				p.ec = asio::error::eof;
-				*p.from = asio::ip::udp::endpoint(
-					m_bound_to.address(), m_bound_to.port());
-				p.overhead = 40;
-				p.hops = hops;
-				p.seq_nr = m_next_outgoing_seq++;
-				send_packet(std::move(p));
+				// the FIN goes out after the bytes still in the send buffer
+				m_fin_pending = true;
+				send_unsent();
 			}
-			m_channel.reset();
 		}
 
+		// the address is free to be bound again, but m_bound_to is still
+		// the local end of the channel, while lingering
 		if (m_bound_to != ip::tcp::endpoint())
-		{
 			m_io_service.unbind_socket(this, m_bound_to);
-			m_bound_to = ip::tcp::endpoint();
-		}
 		m_open = false;
 
+		m_next_incoming_seq = 0;
+		m_packets_to_ack = 0;
+		m_incoming.clear();
+		m_incoming_head = 0;
+		m_incoming_size = 0;
+		m_bytes_read = 0;
+		m_receive_window_end = 0;
+		m_incoming_error.clear();
+		m_reorder_buffer.clear();
+
+		// the bytes being sent are still delivered, like packets that are
+		// already on their way
+		if (m_sending_flow)
+		{
+			m_io_service.sim().detach_flow(this);
+			m_sending_flow = false;
+		}
+
+		cancel(ec);
+
+		// like the bytes of a flow, the ones written to the socket (and the
+		// FIN) are still delivered, including the ones in the send buffer.
+		// The connection lingers until they've all been ACKed
+		if (m_channel && (m_bytes_in_flight > 0 || m_fin_pending) && !peer_closed)
+		{
+			m_lingering = true;
+			ec.clear();
+			return ec;
+		}
+		finish_close();
+
+		ec.clear();
+		return ec;
+	}
+
+	void tcp::socket::finish_close()
+	{
+		m_lingering = false;
+		m_channel.reset();
+		m_bound_to = ip::tcp::endpoint();
+
 		// prevent any more packets from being delivered to this socket
 		if (m_forwarder)
 		{
@@ -162,14 +298,96 @@ namespace ip {
 			m_forwarder.reset();
 		}
 
-		m_next_incoming_seq = 0;
 		m_next_outgoing_seq = 0;
-		m_last_drop_seq = 0;
+		m_bytes_written = 0;
+		m_unsent.clear();
+		m_unsent_size = 0;
+		m_fin_pending = false;
+		m_send_window_end = 0;
+		m_short_end_seq = 0;
+		m_recovery_seq = 0;
+		m_unacked.clear();
+		m_first_unacked = 0;
+		m_bytes_in_flight = 0;
+		m_bytes_lost = 0;
+		m_delivered = 0;
+		m_xmit = 0;
+		m_rack_xmit = 0;
+		m_loss_scan = 0;
+		m_resent.clear();
+		m_lost.clear();
+		m_srtt = duration(0);
+		m_rttvar = duration(0);
+		m_rto = initial_rto;
+		m_rto_backoff = 0;
+		m_rto_due = time_point();
+		reset_congestion_control();
+
+		// an orphan has nothing left to do. It's not released right away, it
+		// may be in the middle of handling a packet or a timeout
+		if (m_orphan)
+		{
+			m_orphan = false;
+			m_io_service.post(std::bind(&io_service::remove_lingering_socket
+				, &m_io_service, this));
+		}
+	}
 
-		cancel(ec);
+	void tcp::socket::take_over_lingering(socket& s)
+	{
+		assert(s.m_lingering);
+		assert(!m_channel);
+
+		// the packets on their way to s, ACKs included, come here instead
+		m_forwarder = std::move(s.m_forwarder);
+		m_forwarder->reset(this);
+		m_channel = std::move(s.m_channel);
+		m_bound_to = s.m_bound_to;
+		m_is_v4 = s.m_is_v4;
+		m_max_send_queue_size = s.m_max_send_queue_size;
+		m_mss = s.m_mss;
+
+		std::swap(m_unsent, s.m_unsent);
+		m_unsent_size = s.m_unsent_size;
+		m_fin_pending = s.m_fin_pending;
+		m_no_delay = s.m_no_delay;
+		m_corked = s.m_corked;
+		m_short_end_seq = s.m_short_end_seq;
+		m_bytes_written = s.m_bytes_written;
+		m_send_window_end = s.m_send_window_end;
+		m_next_outgoing_seq = s.m_next_outgoing_seq;
+		m_recovery_seq = s.m_recovery_seq;
+
+		m_cc_algorithm = s.m_cc_algorithm;
+		std::swap(m_cc, s.m_cc);
+		m_cwnd = s.m_cwnd;
+		m_bytes_in_flight = s.m_bytes_in_flight;
+		m_bytes_lost = s.m_bytes_lost;
+		m_delivered = s.m_delivered;
+		std::swap(m_unacked, s.m_unacked);
+		m_first_unacked = s.m_first_unacked;
+		m_xmit = s.m_xmit;
+		m_rack_xmit = s.m_rack_xmit;
+		m_loss_scan = s.m_loss_scan;
+		std::swap(m_resent, s.m_resent);
+		std::swap(m_lost, s.m_lost);
+
+		m_srtt = s.m_srtt;
+		m_rttvar = s.m_rttvar;
+		m_rto = s.m_rto;
+		m_rto_backoff = s.m_rto_backoff;
+		m_rto_due = s.m_rto_due;
+		if (s.m_rto_timer_armed)
+		{
+			m_rto_timer_armed = true;
+			m_rto_timer.expires_at(s.m_rto_timer.expires_at());
+			m_rto_timer.async_wait(std::bind(&tcp::socket::on_rto_timer, this, _1));
+		}
 
-		ec.clear();
-		return ec;
+		m_lingering = true;
+		m_orphan = true;
+		s.m_lingering = false;
+		s.m_bound_to = ip::tcp::endpoint();
 	}
 
 	std::size_t tcp::socket::available(boost::system::error_code& ec) const
@@ -184,30 +402,10 @@ namespace ip {
 			ec = boost::system::error_code(error::not_connected);
 			return 0;
 		}
-		if (m_incoming_queue.empty())
-		{
-			return 0;
-		}
-
-		std::size_t ret = 0;
-		for (std::vector<aux::packet>::const_iterator i = m_incoming_queue.begin()
-			, end(m_incoming_queue.end()); i != end; ++i)
-		{
-			if (i->type == aux::packet::error)
-			{
-				if (ret > 0)
-				{
-					return ret;
-				}
-
-				// if the read buffer is drained and there is an error, report that
-				// error.
-				ec = i->ec;
-				return 0;
-			}
-			ret += i->buffer.size();
-		}
-		return ret;
+		// if the read buffer is drained and there is an error, report that
+		// error.
+		if (m_incoming_size == 0 && m_incoming_error) ec = m_incoming_error;
+		return m_incoming_size;
 	}
 
 	std::size_t tcp::socket::available() const
@@ -319,7 +517,7 @@ namespace ip {
 		}
 		m_channel = m_io_service.internal_connect(this, target, ec);
 		m_mss = m_io_service.get_path_mtu(m_bound_to.address(), target.address());
-		m_cwnd = m_mss * 2;
+		reset_congestion_control();
 		if (ec)
 		{
 			m_channel.reset();
@@ -331,6 +529,10 @@ namespace ip {
 
 		m_connect_handler = h;
 
+		// the SYN announces the receive window
+		m_receive_window_end = std::uint64_t(receive_buffer_limit());
+		m_channel->initial_window[0] = m_receive_window_end;
+
 		// the acceptor socket will call internal_connect_complete once the
 		// connection is established
 	}
@@ -351,6 +553,7 @@ namespace ip {
 			, boost::system::error_code(error::operation_aborted), 0));
 		m_send_handler = 0;
 		m_send_buffer.clear();
+		m_send_virtual = 0;
 		m_send_null_buffers = false;
 	}
 
@@ -367,6 +570,7 @@ namespace ip {
 		{
 			m_send_handler = handler;
 			m_send_buffer = bufs;
+			m_send_virtual = 0;
 			return;
 		}
 
@@ -384,81 +588,288 @@ namespace ip {
 		m_send_buffer.clear();
 	}
 
-	std::size_t tcp::socket::write_some_impl(
-		std::vector<boost::asio::const_buffer> const& bufs
-		, boost::system::error_code& ec)
+	std::shared_ptr<route const> tcp::socket::check_writable(
+		boost::system::error_code& ec)
 	{
 		if (!m_open)
 		{
 			ec = boost::system::error_code(error::bad_descriptor);
-			return 0;
+			return std::shared_ptr<route const>();
 		}
 		if (!m_channel)
 		{
 			ec = boost::system::error_code(error::not_connected);
-			return 0;
+			return std::shared_ptr<route const>();
 		}
 
 		int remote = m_channel->remote_idx(m_bound_to);
-		route hops = m_channel->hops[remote];
-		if (hops.empty())
+		std::shared_ptr<route const> hops = m_channel->hops[remote];
+		if (!hops)
 		{
 			ec = boost::system::error_code(error::not_connected);
-			return 0;
+			return hops;
 		}
 
-		if (m_bytes_in_flight + m_mss > m_cwnd)
+		if (m_io_service.sim().network_model() == simulation::flow_model)
 		{
-			// this indicates that the send buffer is very large, we should
-			// probably not be able to stuff more bytes down it
-			// wait for the receiving end to pop some bytes off
+			// the flow model doesn't have a congestion window. The next write
+			// is sent once the previous one has been
+			if (!m_sending_flow) return hops;
 			ec = boost::system::error_code(error::would_block);
-			return 0;
+			return std::shared_ptr<route const>();
 		}
 
-		typedef std::vector<boost::asio::const_buffer> buffers_t;
-		std::size_t ret = 0;
+		if (m_unsent_size >= send_buffer_limit())
+		{
+			// the send buffer is full. Wait for the bytes in it to be sent
+			ec = boost::system::error_code(error::would_block);
+			return std::shared_ptr<route const>();
+		}
+		return hops;
+	}
 
-		for (buffers_t::const_iterator i = bufs.begin(), end(bufs.end()); i != end; ++i)
+	std::size_t tcp::socket::send_buffer_limit() const
+	{
+		return std::size_t((std::max)(m_max_send_queue_size, m_mss));
+	}
+
+	std::size_t tcp::socket::receive_buffer_limit() const
+	{
+		return std::size_t((std::max)(m_max_receive_queue_size, m_mss));
+	}
+
+	bool tcp::socket::is_writable() const
+	{
+		return m_unsent_size * 3 <= send_buffer_limit() * 2;
+	}
+
+	aux::payload tcp::socket::take_unsent(std::size_t const n)
+	{
+		assert(n <= m_unsent_size);
+		m_unsent_size -= n;
+
+		// the bytes of consecutive writes are merged if they're contiguous,
+		// such as virtual writes coalesced by Nagle's algorithm or cork. They
+		// stay virtual
+		aux::payload ret = m_unsent.front().slice(0
+			, (std::min)(m_unsent.front().size(), n));
+		for (auto i = m_unsent.begin() + 1; ret.size() < n
+			&& i != m_unsent.end(); ++i)
 		{
-			// split up in packets
-			int buf_size = buffer_size(*i);
-			uint8_t const* buf = boost::asio::buffer_cast<uint8_t const*>(*i);
-			while (buf_size > 0)
-			{
-				int packet_size = (std::min)(buf_size, m_mss);
-				aux::packet p;
-				p.type = aux::packet::payload;
-				p.buffer.assign(buf, buf + packet_size);
-				*p.from = asio::ip::udp::endpoint(
-					m_bound_to.address(), m_bound_to.port());
-				p.overhead = 40;
-				p.hops = hops;
-				p.seq_nr = m_next_outgoing_seq++;
-				p.drop_fun.reset(new std::function<void(sim::aux::packet)>(std::bind(&tcp::socket::packet_dropped, this, _1)));
-
-				send_packet(std::move(p));
-				buf += packet_size;
-				buf_size -= packet_size;
-				ret += packet_size;
-
-				if (m_bytes_in_flight + m_mss > m_cwnd)
-				{
-					// the congestion window is full
-					if (ret == 0)
-					{
-						ec = boost::system::error_code(error::would_block);
-						return 0;
-					}
+			if (!ret.append(i->slice(0, (std::min)(i->size(), n - ret.size()))))
+				break;
+		}
 
-					return ret;
-				}
+		if (ret.size() < n)
+		{
+			std::uint8_t* buf = nullptr;
+			ret = aux::payload::allocate(n, buf);
+			std::size_t offset = 0;
+			for (auto i = m_unsent.begin(); offset < n; ++i)
+			{
+				std::size_t const len = (std::min)(i->size(), n - offset);
+				i->copy_to(buf + offset, len);
+				offset += len;
 			}
 		}
 
+		std::size_t left = n;
+		while (left > 0)
+		{
+			aux::payload& b = m_unsent.front();
+			std::size_t const len = (std::min)(b.size(), left);
+			b.consume(len);
+			left -= len;
+			if (b.empty()) m_unsent.pop_front();
+		}
 		return ret;
 	}
 
+	void tcp::socket::send_unsent()
+	{
+		if (!m_channel) return;
+		std::shared_ptr<route const> const& hops
+			= m_channel->hops[m_channel->remote_idx(m_bound_to)];
+		if (!hops) return;
+
+		// full segments go out together, as trains. The ones of a large
+		// write are slices of it, the bytes of smaller writes (and of the end
+		// of a large one) are copied together into full segments
+		while (m_unsent_size > 0 && m_bytes_in_flight + m_mss <= m_cwnd)
+		{
+			std::uint64_t const sent = m_bytes_written - m_unsent_size;
+			if (sent >= m_send_window_end)
+			{
+				// the receive window of the other end is full. With nothing in
+				// flight, there won't be an ACK to say when it opens again,
+				// it's probed for
+				if (m_bytes_in_flight == 0 && m_rto_due == time_point())
+					start_rto_timer();
+				return;
+			}
+
+			std::size_t limit = std::size_t((std::min)((std::min)(
+				std::uint64_t(m_unsent_size), std::uint64_t(max_train_size))
+				, (std::min)(std::uint64_t(m_cwnd - m_bytes_in_flight)
+					, m_send_window_end - sent)));
+			if (m_unsent.front().size() >= std::size_t(m_mss))
+				limit = (std::min)(limit, m_unsent.front().size());
+			int const segments = int(limit / m_mss);
+			std::size_t const size = segments > 1 ? std::size_t(segments) * m_mss
+				: (std::min)(limit, std::size_t(m_mss));
+
+			// Nagle's algorithm. A short segment waits for the one in flight to
+			// be ACKed, in case more bytes are written meanwhile. Closing the
+			// socket sends it
+			if (size < std::size_t(m_mss) && !m_fin_pending)
+			{
+				if (m_corked || (!m_no_delay && m_short_end_seq > m_first_unacked))
+					return;
+				m_short_end_seq = m_next_outgoing_seq + 1;
+			}
+
+			send_segment(take_unsent(size), hops
+				, std::uint32_t((std::max)(segments, 1)));
+		}
+
+		if (m_unsent_size > 0 || !m_fin_pending) return;
+		m_fin_pending = false;
+
+		aux::packet p;
+		p.type = aux::packet::error;
+		p.ec = asio::error::eof;
+		p.from = asio::ip::udp::endpoint(
+			m_bound_to.address(), m_bound_to.port());
+		p.overhead = 40;
+		p.set_route(hops);
+		p.seq_nr = m_next_outgoing_seq++;
+		send_packet(std::move(p));
+	}
+
+	void tcp::socket::send_segment(aux::payload b
+		, std::shared_ptr<route const> const& hops
+		, std::uint32_t const segments)
+	{
+		aux::packet p;
+		p.type = aux::packet::payload;
+		p.segments = segments;
+		p.segment_size = std::uint32_t(b.size() / segments);
+		assert(p.segment_size * segments == b.size());
+		p.buffer = std::move(b);
+		p.from = asio::ip::udp::endpoint(
+			m_bound_to.address(), m_bound_to.port());
+		p.overhead = 40 * int(segments);
+		p.set_route(hops);
+		p.seq_nr = m_next_outgoing_seq;
+		m_next_outgoing_seq += segments;
+
+		send_packet(std::move(p));
+	}
+
+	void tcp::socket::send_flow(aux::payload b
+		, std::shared_ptr<route const> const& hops)
+	{
+		aux::packet p;
+		p.type = aux::packet::payload;
+		// the bytes go over the wire as segments, with the same overhead as
+		// the packets send_segment() makes
+		p.overhead = int(40 * ((b.size() + m_mss - 1) / m_mss));
+		p.buffer = std::move(b);
+		p.from = asio::ip::udp::endpoint(
+			m_bound_to.address(), m_bound_to.port());
+		p.set_route(hops);
+		p.seq_nr = m_next_outgoing_seq++;
+
+		m_sending_flow = true;
+		int const remote = m_channel->remote_idx(m_bound_to);
+		m_io_service.sim().send_flow(m_channel->ep[remote].address(), this
+			, std::move(p));
+	}
+
+	void tcp::socket::flow_sent()
+	{
+		m_sending_flow = false;
+		maybe_wakeup_writer();
+	}
+
+	std::size_t tcp::socket::write_some_impl(
+		std::vector<boost::asio::const_buffer> const& bufs
+		, boost::system::error_code& ec)
+	{
+		std::shared_ptr<route const> const hops = check_writable(ec);
+		if (!hops) return 0;
+
+		if (m_io_service.sim().network_model() == simulation::flow_model)
+		{
+			std::size_t const n = (std::min)(buffer_size(bufs), max_flow_size);
+			send_flow(aux::payload::copy(bufs, n), hops);
+			m_bytes_written += n;
+			return n;
+		}
+
+		// the bytes that fit in the send buffer are copied into a single
+		// payload chunk, which the packets refer to slices of
+		std::size_t const n = (std::min)(buffer_size(bufs)
+			, send_buffer_limit() - m_unsent_size);
+		if (n > 0)
+		{
+			m_unsent.push_back(aux::payload::copy(bufs, n));
+			m_unsent_size += n;
+			m_bytes_written += n;
+		}
+		send_unsent();
+		return n;
+	}
+
+	void tcp::socket::async_write_virtual_impl(std::size_t const n
+		, std::uint64_t const seed
+		, boost::function<void(boost::system::error_code const&, std::size_t)> const& handler)
+	{
+		boost::system::error_code ec;
+		std::size_t bytes_transferred = write_virtual_impl(n, seed, ec);
+		if (ec == boost::system::error_code(error::would_block))
+		{
+			m_send_handler = handler;
+			m_send_buffer.clear();
+			m_send_virtual = n;
+			m_send_seed = seed;
+			return;
+		}
+
+		m_io_service.post(std::bind(handler, ec, bytes_transferred));
+		m_send_handler = 0;
+		m_send_virtual = 0;
+	}
+
+	std::size_t tcp::socket::write_virtual_impl(std::size_t const n
+		, std::uint64_t const seed, boost::system::error_code& ec)
+	{
+		std::shared_ptr<route const> const hops = check_writable(ec);
+		if (!hops) return 0;
+
+		if (m_io_service.sim().network_model() == simulation::flow_model)
+		{
+			std::size_t const to_send = (std::min)(n, max_flow_size);
+			send_flow(aux::payload::generate(seed, m_bytes_written, to_send), hops);
+			m_bytes_written += to_send;
+			return to_send;
+		}
+
+		std::size_t const to_send = (std::min)(n
+			, send_buffer_limit() - m_unsent_size);
+		if (to_send > 0)
+		{
+			aux::payload data = aux::payload::generate(seed, m_bytes_written
+				, to_send);
+			if (m_unsent.empty() || !m_unsent.back().append(data))
+				m_unsent.push_back(std::move(data));
+			m_unsent_size += to_send;
+			m_bytes_written += to_send;
+		}
+		send_unsent();
+		return to_send;
+	}
+
 	std::size_t tcp::socket::read_some_impl(
 		std::vector<boost::asio::mutable_buffer> const& bufs
 		, boost::system::error_code& ec)
@@ -475,83 +886,87 @@ namespace ip {
 			return 0;
 		}
 
-		if (m_incoming_queue.empty())
+		if (m_incoming_size == 0)
 		{
+			// the bytes received before an error are delivered first. Once
+			// they've been read, deliver the error
+			if (m_incoming_error)
+			{
+				ec = m_incoming_error;
+				m_incoming_error.clear();
+				m_channel.reset();
+				return 0;
+			}
 			ec = boost::system::error_code(error::would_block);
 			return 0;
 		}
 
-		typedef std::vector<boost::asio::mutable_buffer> buffers_t;
-		m_recv_buffer = bufs;
-		buffers_t::iterator recv_iter = m_recv_buffer.begin();
-		int total_received = 0;
-		// the offset in the current receive buffer we're writing to. i.e. the
-		// buffer recv_iter points to
-		int buf_offset = 0;
-
-		while (!m_incoming_queue.empty())
+		// copy bytes from the incoming stream into the receive buffers, one
+		// payload and one buffer at a time
+		std::size_t total_received = 0;
+		for (std::vector<boost::asio::mutable_buffer>::const_iterator i = bufs.begin()
+			, end(bufs.end()); i != end && m_incoming_size > 0; ++i)
 		{
-			aux::packet& p = m_incoming_queue.front();
-
-			if (p.type == aux::packet::error)
+			char* dst = asio::buffer_cast<char*>(*i);
+			std::size_t left = asio::buffer_size(*i);
+			while (left > 0 && m_incoming_size > 0)
 			{
-				// if we have received bytes also, first deliver those. In the next
-				// read, deliver the error
-				if (total_received > 0) break;
-
-				assert(p.ec);
-				ec = p.ec;
-				m_incoming_queue.erase(m_incoming_queue.begin());
-				m_channel.reset();
-				return 0;
-			}
-			else if (p.type == aux::packet::payload)
-			{
-				// copy bytes from the incoming queue into the receive buffer.
-				// both are vectors of buffers, so it can get a bit hairy
-				while (recv_iter != m_recv_buffer.end())
+				aux::payload& b = m_incoming[m_incoming_head];
+				std::size_t const copy_size = (std::min)(left, b.size());
+				b.copy_to(dst, copy_size);
+				b.consume(copy_size);
+				dst += copy_size;
+				left -= copy_size;
+				total_received += copy_size;
+				m_incoming_size -= copy_size;
+				if (!b.empty()) continue;
+
+				++m_incoming_head;
+				if (m_incoming_head == m_incoming.size())
 				{
-					int buf_size = asio::buffer_size(*recv_iter);
-					int copy_size = (std::min)(int(p.buffer.size())
-						, buf_size - buf_offset);
-
-					memcpy(asio::buffer_cast<char*>(*recv_iter) + buf_offset
-						, p.buffer.data(), copy_size);
-
-					p.buffer.erase(p.buffer.begin(), p.buffer.begin() + copy_size);
-					m_queue_size -= copy_size;
-
-					buf_offset += copy_size;
-					assert(buf_offset <= buf_size);
-					total_received += copy_size;
-					if (buf_offset == buf_size)
-					{
-						++recv_iter;
-						buf_offset = 0;
-					}
-
-					if (p.buffer.empty())
-					{
-						m_incoming_queue.erase(m_incoming_queue.begin());
-						break;
-					}
+					m_incoming.clear();
+					m_incoming_head = 0;
+				}
+				else if (m_incoming_head > m_incoming.size() / 2)
+				{
+					m_incoming.erase(m_incoming.begin()
+						, m_incoming.begin() + m_incoming_head);
+					m_incoming_head = 0;
 				}
 			}
-			else
-			{
-				assert(false);
-			}
-
-			if (recv_iter == m_recv_buffer.end())
-				break;
 		}
 
 		assert(total_received > 0);
+		m_bytes_read += total_received;
+		maybe_send_window_update();
 
 		ec.clear();
 		return total_received;
 	}
 
+	std::uint64_t tcp::socket::receive_window_end() const
+	{
+		return (std::max)(m_receive_window_end, m_bytes_read
+			+ std::uint64_t(receive_buffer_limit()));
+	}
+
+	void tcp::socket::maybe_send_window_update()
+	{
+		if (m_io_service.sim().network_model() == simulation::flow_model) return;
+
+		// the window the other end was told about, and the one there is. An
+		// update is sent once it's at least twice as large, and larger by at
+		// least a segment (or half the buffer, if that's smaller)
+		std::uint64_t const received = m_bytes_read + m_incoming_size;
+		std::uint64_t const advertised = m_receive_window_end > received
+			? m_receive_window_end - received : 0;
+		std::uint64_t const window = receive_window_end() - received;
+		std::uint64_t const min_update = (std::min)(std::uint64_t(m_mss)
+			, std::uint64_t(receive_buffer_limit()) / 2);
+		if (window < advertised * 2 || window - advertised < min_update) return;
+		send_ack(m_next_incoming_seq, false);
+	}
+
 	void tcp::socket::async_read_some_impl(std::vector<boost::asio::mutable_buffer> const& bufs
 		, boost::function<void(boost::system::error_code const&, std::size_t)> const& handler)
 	{
@@ -562,7 +977,7 @@ namespace ip {
 		std::size_t bytes_transferred = read_some_impl(bufs, ec);
 		if (ec == boost::system::error_code(error::would_block))
 		{
-			assert(m_incoming_queue.empty());
+			assert(m_incoming_size == 0);
 
 			m_recv_buffer = bufs;
 			m_recv_handler = handler;
@@ -611,10 +1026,12 @@ namespace ip {
 	}
 
 	// if there is an outstanding read operation, and this was the first incoming
-	// operation since we last drained, wake up the reader
+	// operation since we last drained, wake up the reader. The read was only
+	// left outstanding if the queue was empty. Packets pulled out of the
+	// reorder buffer may have added more than one
 	void tcp::socket::maybe_wakeup_reader()
 	{
-		if (m_incoming_queue.size() != 1 || !m_recv_handler) return;
+		if ((m_incoming_size == 0 && !m_incoming_error) || !m_recv_handler) return;
 
 		if (m_recv_null_buffers)
 		{
@@ -630,6 +1047,68 @@ namespace ip {
 		}
 	}
 
+	void tcp::socket::reorder_insert(aux::packet p)
+	{
+		std::uint64_t const idx = p.seq_nr - m_next_incoming_seq;
+		if (idx >= m_reorder_buffer.size())
+		{
+			std::size_t size = (std::max)(std::size_t(16), m_reorder_buffer.size());
+			while (size <= idx) size *= 2;
+			std::vector<aux::packet> grown(size);
+			for (auto& slot : m_reorder_buffer)
+			{
+				if (slot.type == aux::packet::uninitialized
+					|| slot.seq_nr < m_next_incoming_seq) continue;
+				grown[slot.seq_nr & (size - 1)] = std::move(slot);
+			}
+			m_reorder_buffer.swap(grown);
+		}
+
+		// the slot may still hold a packet that was passed by the stream,
+		// otherwise this is a duplicate, unless it's a longer train
+		aux::packet& slot = m_reorder_buffer[p.seq_nr & (m_reorder_buffer.size() - 1)];
+		if (slot.type != aux::packet::uninitialized
+			&& slot.seq_nr >= m_next_incoming_seq
+			&& slot.segments >= p.segments) return;
+		slot = std::move(p);
+	}
+
+	void tcp::socket::take_in_order(aux::packet p)
+	{
+		std::uint64_t const first = p.seq_nr;
+		m_next_incoming_seq = first + p.segments;
+		incoming_stream(std::move(p));
+		if (m_reorder_buffer.empty()) return;
+
+		// a packet in the reorder buffer starting within this one continues
+		// past it. The rest of it is next in the stream
+		std::uint64_t const mask = m_reorder_buffer.size() - 1;
+		for (std::uint64_t seq = first + 1; seq < m_next_incoming_seq
+			&& seq <= first + mask; ++seq)
+		{
+			aux::packet& slot = m_reorder_buffer[seq & mask];
+			if (slot.type == aux::packet::uninitialized || slot.seq_nr != seq
+				|| seq + slot.segments <= m_next_incoming_seq) continue;
+			aux::packet rest = std::move(slot);
+			slot = aux::packet();
+			rest.split(std::uint32_t(m_next_incoming_seq - seq));
+			reorder_insert(std::move(rest));
+		}
+	}
+
+	void tcp::socket::incoming_stream(aux::packet p)
+	{
+		if (p.type == aux::packet::error)
+		{
+			assert(p.ec);
+			if (!m_incoming_error) m_incoming_error = p.ec;
+			return;
+		}
+		if (p.buffer.empty()) return;
+		m_incoming_size += p.buffer.size();
+		m_incoming.push_back(std::move(p.buffer));
+	}
+
 	void tcp::socket::maybe_wakeup_writer()
 	{
 		if (!m_send_handler) return;
@@ -639,6 +1118,10 @@ namespace ip {
 			assert(false && "not supported yet");
 //			async_write_some_null_buffers_impl(m_recv_handler);
 		}
+		else if (m_send_virtual > 0)
+		{
+			async_write_virtual_impl(m_send_virtual, m_send_seed, m_send_handler);
+		}
 		else
 		{
 			// we have an async. write operation outstanding
@@ -648,35 +1131,466 @@ namespace ip {
 
 	bool tcp::socket::internal_is_listening() { return false; }
 
+	boost::system::error_code tcp::socket::set_option(no_delay const& op
+		, boost::system::error_code& ec)
+	{
+		m_no_delay = op.value();
+		if (m_no_delay)
+		{
+			send_unsent();
+			if (m_send_handler && is_writable()) maybe_wakeup_writer();
+		}
+		return ec;
+	}
+
+	boost::system::error_code tcp::socket::set_option(cork const& op
+		, boost::system::error_code& ec)
+	{
+		m_corked = op.value();
+		if (!m_corked)
+		{
+			send_unsent();
+			if (m_send_handler && is_writable()) maybe_wakeup_writer();
+		}
+		return ec;
+	}
+
+	boost::system::error_code tcp::socket::get_option(no_delay& op
+		, boost::system::error_code& ec)
+	{
+		op = m_no_delay;
+		return ec;
+	}
+
+	boost::system::error_code tcp::socket::get_option(cork& op
+		, boost::system::error_code& ec)
+	{
+		op = m_corked;
+		return ec;
+	}
+
+	tcp::socket::stats tcp::socket::get_stats() const
+	{
+		stats ret;
+		ret.cwnd = m_cwnd;
+		ret.bytes_in_flight = m_bytes_in_flight;
+		std::uint64_t const sent = m_bytes_written - m_unsent_size;
+		ret.send_window = m_send_window_end > sent
+			? std::int64_t(m_send_window_end - sent) : 0;
+		ret.receive_window = std::int64_t(receive_window_end() - m_bytes_read
+			- m_incoming_size);
+		ret.bytes_unsent = std::int64_t(m_unsent_size);
+		return ret;
+	}
+
+	void tcp::socket::set_congestion_control(congestion_control::algorithm_t a)
+	{
+		m_cc_algorithm = a;
+		if (!m_channel) reset_congestion_control();
+	}
+
+	void tcp::socket::reset_congestion_control()
+	{
+		m_cc = congestion_control::create(m_cc_algorithm, m_mss);
+		m_cwnd = m_cc->cwnd();
+	}
+
 	void tcp::socket::send_packet(aux::packet p)
 	{
-		m_bytes_in_flight += p.buffer.size();
-		m_outstanding_packet_sizes[p.seq_nr] = p.buffer.size();
+		// in the flow model nothing is ACKed, so nothing is kept in flight
+		if (m_io_service.sim().network_model() == simulation::flow_model)
+		{
+			m_io_service.forward_packet(std::move(p));
+			return;
+		}
+
+		// packets are sent in the order of their sequence numbers, except
+		// for the ones re-sent after being deemed lost. Every segment of a
+		// train is ACKed on its own, and keeps its bytes until then
+		time_point const now = chrono::high_resolution_clock::now();
+		int const size = p.type == aux::packet::error ? 1
+			: p.segments > 1 ? int(p.segment_size) : int(p.buffer.size());
+		std::uint64_t const idx = p.seq_nr - m_first_unacked;
+		for (std::uint32_t i = 0; i < p.segments; ++i)
+		{
+			if (idx + i < m_unacked.size())
+			{
+				unacked_segment& seg = m_unacked[idx + i];
+				assert(seg.size < 0);
+				m_bytes_lost += seg.size;
+				seg.size = size;
+				seg.sent = now;
+				seg.delivered = m_delivered;
+				seg.xmit = m_xmit++;
+				seg.retransmitted = true;
+				m_resent.push_back(std::make_pair(p.seq_nr + i, seg.xmit));
+			}
+			else
+			{
+				assert(idx + i == m_unacked.size());
+				m_bytes_in_flight += size;
+				unacked_segment seg = { size, now, m_delivered, m_xmit++, false
+					, p.segments > 1 ? p.buffer.slice(i * size, size) : p.buffer };
+				m_unacked.push_back(std::move(seg));
+			}
+		}
+
+		if (m_rto_due == time_point()) start_rto_timer();
+		m_io_service.forward_packet(std::move(p));
+	}
+
+	congestion_control::ack_sample tcp::socket::packets_acked(
+		aux::packet const& ack)
+	{
+		congestion_control::ack_sample ret = {};
+
+		// the sample is taken from the segment ACKed that was sent most
+		// recently. If that was a re-sent one, the ACK may be for either copy
+		// of it, and no round-trip is measured (Karn's algorithm)
+		time_point last_sent;
+		std::int64_t last_delivered = 0;
+		bool last_retransmitted = false;
+		bool any = false;
+		auto delivered = [&](unacked_segment& seg)
+		{
+			// a segment deemed lost may still have made it
+			if (seg.size < 0)
+			{
+				seg.size = -seg.size;
+				m_bytes_lost -= seg.size;
+			}
+			ret.acked += seg.size;
+			if (!any || seg.sent >= last_sent)
+			{
+				any = true;
+				last_sent = seg.sent;
+				last_delivered = seg.delivered;
+				last_retransmitted = seg.retransmitted;
+			}
+			m_rack_xmit = (std::max)(m_rack_xmit, seg.xmit);
+		};
+
+		if (ack.type == aux::packet::sack)
+		{
+			for (std::uint32_t i = 0; i < ack.segments; ++i)
+			{
+				std::uint64_t const idx = ack.seq_nr + i - m_first_unacked;
+				if (idx >= m_unacked.size() || m_unacked[idx].size == 0) continue;
+				unacked_segment& seg = m_unacked[idx];
+				delivered(seg);
+				seg.size = 0;
+				seg.data = aux::payload();
+			}
+		}
+		else
+		{
+			while (m_first_unacked < ack.seq_nr && !m_unacked.empty())
+			{
+				unacked_segment& seg = m_unacked.front();
+				if (seg.size != 0) delivered(seg);
+				m_unacked.pop_front();
+				++m_first_unacked;
+			}
+		}
+		assert(m_bytes_in_flight >= ret.acked);
+		m_bytes_in_flight -= ret.acked;
+		m_delivered += ret.acked;
 
-		forward_packet(std::move(p));
+		ret.delivered = m_delivered;
+		if (any && !last_retransmitted)
+		{
+			ret.rtt = chrono::high_resolution_clock::now() - last_sent;
+			ret.prior_delivered = last_delivered;
+			update_rto(ret.rtt);
+			if (ret.rtt > chrono::high_resolution_clock::duration(0))
+			{
+				ret.delivery_rate = double(m_delivered - last_delivered) * 1e9
+					/ double(chrono::duration_cast<chrono::nanoseconds>(ret.rtt).count());
+			}
+		}
+		return ret;
 	}
 
-	void tcp::socket::packet_dropped(aux::packet p)
+	void tcp::socket::send_ack(std::uint64_t const seq_nr, bool const selective
+		, std::uint32_t const segments)
 	{
+		if (!m_channel) return;
+		if (!selective) m_packets_to_ack = 0;
+
+		aux::packet ack;
+		ack.type = selective ? aux::packet::sack : aux::packet::ack;
+		ack.seq_nr = seq_nr;
+		ack.segments = segments;
+		m_receive_window_end = receive_window_end();
+		ack.window = m_receive_window_end;
+
 		int remote = m_channel->remote_idx(m_bound_to);
-		p.hops = m_channel->hops[remote];
-		m_outgoing_packets.push_back(std::move(p));
+		ack.set_route(m_channel->hops[remote]);
+		m_io_service.forward_packet(std::move(ack));
+	}
+
+	void tcp::socket::on_ack_timer(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		m_ack_timer_armed = false;
+		if (m_packets_to_ack == 0) return;
+
+		if (chrono::high_resolution_clock::now() < m_ack_due)
+		{
+			m_ack_timer_armed = true;
+			m_ack_timer.expires_at(m_ack_due);
+			m_ack_timer.async_wait(std::bind(&tcp::socket::on_ack_timer, this, _1));
+			return;
+		}
+		send_ack(m_next_incoming_seq, false);
+	}
+
+	void tcp::socket::update_rto(duration const rtt)
+	{
+		// RFC 6298
+		if (m_srtt == duration(0))
+		{
+			m_srtt = rtt;
+			m_rttvar = rtt / 2;
+		}
+		else
+		{
+			duration const err = m_srtt > rtt ? m_srtt - rtt : rtt - m_srtt;
+			m_rttvar = (m_rttvar * 3 + err) / 4;
+			m_srtt = (m_srtt * 7 + rtt) / 8;
+		}
+		m_rto = (std::min)(duration(max_rto)
+			, (std::max)(duration(min_rto), m_srtt + m_rttvar * 4));
+	}
+
+	void tcp::socket::start_rto_timer()
+	{
+		duration const rto = (std::min)(duration(max_rto)
+			, m_rto * (std::int64_t(1) << m_rto_backoff));
+		m_rto_due = chrono::high_resolution_clock::now() + rto;
+
+		// a timer set to fire earlier re-arms itself for m_rto_due
+		if (m_rto_timer_armed && m_rto_timer.expires_at() <= m_rto_due) return;
+		m_rto_timer_armed = true;
+		m_rto_timer.expires_at(m_rto_due);
+		m_rto_timer.async_wait(std::bind(&tcp::socket::on_rto_timer, this, _1));
+	}
+
+	void tcp::socket::on_rto_timer(boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		m_rto_timer_armed = false;
+		if (m_rto_due == time_point() || !m_channel) return;
+
+		if (chrono::high_resolution_clock::now() < m_rto_due)
+		{
+			m_rto_timer_armed = true;
+			m_rto_timer.expires_at(m_rto_due);
+			m_rto_timer.async_wait(std::bind(&tcp::socket::on_rto_timer, this, _1));
+			return;
+		}
+		m_rto_due = time_point();
+
+		// with nothing in flight, the timer is probing the other end's closed
+		// receive window. Once it opens, the other end sends a window update
+		// anyway. The probing stops after as many probes as timeouts it takes
+		// to give up, for the simulation to end if nobody ever reads
+		if (m_bytes_in_flight == 0)
+		{
+			if (m_unsent_size == 0
+				|| m_bytes_written - m_unsent_size < m_send_window_end) return;
+			if (++m_rto_backoff > max_rto_backoff)
+			{
+				if (m_lingering) finish_close();
+				return;
+			}
+			send_window_probe();
+			start_rto_timer();
+			return;
+		}
+
+		if (++m_rto_backoff > max_rto_backoff)
+		{
+			// the other end is gone
+			if (m_lingering)
+			{
+				finish_close();
+				return;
+			}
+			if (!m_incoming_error) m_incoming_error = error::timed_out;
+			maybe_wakeup_reader();
+			if (m_send_handler)
+			{
+				m_io_service.post(std::bind(m_send_handler
+					, boost::system::error_code(error::timed_out), 0));
+				m_send_handler = 0;
+				m_send_buffer.clear();
+				m_send_virtual = 0;
+			}
+			return;
+		}
+
+		// nothing was ACKed for a whole RTO. Every segment in flight is
+		// deemed lost, and they're all re-sent in order
+		m_lost.clear();
+		for (std::size_t i = 0; i < m_unacked.size(); ++i)
+		{
+			unacked_segment& seg = m_unacked[i];
+			if (seg.size == 0) continue;
+			if (seg.size > 0)
+			{
+				m_bytes_lost += seg.size;
+				seg.size = -seg.size;
+			}
+			m_lost.push_back(m_first_unacked + i);
+		}
+		m_loss_scan = m_first_unacked + m_unacked.size();
+		m_resent.clear();
+		m_recovery_seq = m_next_outgoing_seq;
+		m_cc->on_timeout();
+		m_cwnd = m_cc->cwnd();
+
+		resend_lost();
+		start_rto_timer();
+	}
+
+	void tcp::socket::send_window_probe()
+	{
+		// like on linux, the probe is a segment the other end has received
+		// already. It's ACKed right away, with the current window. The window
+		// is at least a segment from the start (see receive_buffer_limit()),
+		// so something has been sent before it can close
+		assert(m_next_outgoing_seq > 0);
+		if (m_next_outgoing_seq == 0) return;
+
+		aux::packet p;
+		p.type = aux::packet::payload;
+		p.from = asio::ip::udp::endpoint(
+			m_bound_to.address(), m_bound_to.port());
+		p.overhead = 40;
+		p.set_route(m_channel->hops[m_channel->remote_idx(m_bound_to)]);
+		p.seq_nr = m_next_outgoing_seq - 1;
+		m_io_service.forward_packet(std::move(p));
+	}
+
+	void tcp::socket::detect_losses()
+	{
+		bool congestion = false;
+		auto const lost = [&](std::uint64_t const seq, unacked_segment& seg)
+		{
+			m_bytes_lost += seg.size;
+			seg.size = -seg.size;
+			m_lost.push_back(seq);
+
+			// the losses of the segments sent before the first one was
+			// noticed are part of the same congestion event
+			if (seq >= m_recovery_seq)
+			{
+				m_recovery_seq = m_next_outgoing_seq;
+				congestion = true;
+			}
+		};
+
+		// the re-sent segments, in the order they were re-sent. The ones that
+		// have been ACKed, deemed lost or re-sent again since are dropped
+		while (!m_resent.empty())
+		{
+			std::uint64_t const seq = m_resent.front().first;
+			if (seq >= m_first_unacked)
+			{
+				unacked_segment& seg = m_unacked[seq - m_first_unacked];
+				if (seg.size > 0 && seg.xmit == m_resent.front().second)
+				{
+					if (seg.xmit + dupthresh > m_rack_xmit) break;
+					lost(seq, seg);
+				}
+			}
+			m_resent.pop_front();
+		}
+
+		// the segments sent once are in the order of their sequence numbers.
+		// The ones before m_loss_scan have all been ACKed, deemed lost or
+		// re-sent
+		if (m_loss_scan < m_first_unacked) m_loss_scan = m_first_unacked;
+		for (; m_loss_scan < m_first_unacked + m_unacked.size(); ++m_loss_scan)
+		{
+			unacked_segment& seg = m_unacked[m_loss_scan - m_first_unacked];
+			if (seg.size <= 0 || seg.retransmitted) continue;
+			if (seg.xmit + dupthresh > m_rack_xmit) break;
+			lost(m_loss_scan, seg);
+		}
+
+		if (!congestion) return;
+		m_cc->on_congestion();
+		m_cwnd = m_cc->cwnd();
+	}
 
-		const int packets_in_cwnd = m_cwnd / m_mss;
+	void tcp::socket::resend_lost()
+	{
+		while (!m_lost.empty())
+		{
+			std::uint64_t const seq = m_lost.front();
+			std::uint64_t const idx = seq - m_first_unacked;
 
-		// we just recently dropped a packet and cut the cwnd in half,
-		// don't do it again already
-		if (m_last_drop_seq > 0 && p.seq_nr < m_last_drop_seq + packets_in_cwnd) return;
+			// it was ACKed since
+			if (seq < m_first_unacked || m_unacked[idx].size >= 0)
+			{
+				m_lost.pop_front();
+				continue;
+			}
 
-		m_cwnd /= 2;
-		m_last_drop_seq = p.seq_nr;
+			std::int64_t const room = m_cwnd - (m_bytes_in_flight - m_bytes_lost);
+			int const size = -m_unacked[idx].size;
+			if (size > room) break;
+			m_lost.pop_front();
+
+			// consecutive full segments are re-sent together, as a train
+			aux::payload data = m_unacked[idx].data;
+			std::uint32_t segments = 1;
+			std::int64_t const max_size = (std::min)(room, std::int64_t(max_train_size));
+			while (size == m_mss && !m_lost.empty()
+				&& m_lost.front() == seq + segments
+				&& std::int64_t(segments + 1) * m_mss <= max_size)
+			{
+				unacked_segment const& next = m_unacked[idx + segments];
+				if (next.size != -m_mss || !data.append(next.data)) break;
+				m_lost.pop_front();
+				++segments;
+			}
 
-		// TODO: this should really happen one second later to be accurate
-		if (m_cwnd < m_mss) m_cwnd = m_mss;
+			aux::packet p;
+			if (data.empty())
+			{
+				p.type = aux::packet::error;
+				p.ec = asio::error::eof;
+			}
+			else
+			{
+				p.type = aux::packet::payload;
+				p.segments = segments;
+				p.segment_size = std::uint32_t(size);
+				p.buffer = std::move(data);
+			}
+			p.from = asio::ip::udp::endpoint(
+				m_bound_to.address(), m_bound_to.port());
+			p.overhead = 40 * int(segments);
+			p.set_route(m_channel->hops[m_channel->remote_idx(m_bound_to)]);
+			p.seq_nr = seq;
+			send_packet(std::move(p));
+		}
 	}
 
 	void tcp::socket::incoming_packet(aux::packet p)
 	{
+		// a lingering socket is only waiting for its bytes to be ACKed. If
+		// the other end closes too, they won't be read
+		if (m_lingering && p.type != aux::packet::ack
+			&& p.type != aux::packet::sack)
+		{
+			if (p.type == aux::packet::error) finish_close();
+			return;
+		}
+
 		switch (p.type)
 		{
 			case aux::packet::uninitialized:
@@ -685,40 +1599,51 @@ namespace ip {
 				return;
 			}
 			case aux::packet::ack:
+			case aux::packet::sack:
 			{
-				// if the socket just became writeable, we need to notify the
-				// client. First we want to know whether it was not writeable.
-				const bool was_writeable = m_bytes_in_flight + m_mss > m_cwnd;
-
-				auto it = m_outstanding_packet_sizes.find(p.seq_nr);
-				assert(it != m_outstanding_packet_sizes.end());
-				const int acked_bytes = it->second;
-				m_outstanding_packet_sizes.erase(it);
-				assert(m_bytes_in_flight >= acked_bytes);
-				m_bytes_in_flight -= acked_bytes;
-
-				// potentially resend packets
-				while (!m_outgoing_packets.empty()
-					&& m_bytes_in_flight
-						+ int(m_outgoing_packets.front().buffer.size()) <= m_cwnd)
+				congestion_control::ack_sample const sample = packets_acked(p);
+
+				// the window is updated before re-sending, the ACK may have
+				// made room for more than it took out of flight
+				m_cc->on_ack(sample);
+				m_cwnd = m_cc->cwnd();
+
+				// new data was ACKed, the connection is making progress. The
+				// RTO starts over from the last one sent
+				if (sample.acked > 0)
 				{
-					aux::packet pkt = std::move(m_outgoing_packets.front());
-					m_outgoing_packets.erase(m_outgoing_packets.begin());
-					send_packet(std::move(pkt));
+					m_rto_backoff = 0;
+					if (m_bytes_in_flight > 0) start_rto_timer();
+					else m_rto_due = time_point();
 				}
 
-				// update cwnd based on the number of bytes ACKed.
-				// every round-trip, increase the window size by one packet
-				// (MSS)
-				m_cwnd += m_mss * acked_bytes / m_cwnd;
+				detect_losses();
+				resend_lost();
 
-				// TODO: implement slow-start
+				if (p.window > m_send_window_end)
+				{
+					m_send_window_end = p.window;
 
-				const bool is_writeable = m_bytes_in_flight + m_mss <= m_cwnd;
+					// with nothing in flight, the timer was probing for the
+					// window to open
+					if (m_bytes_in_flight == 0)
+					{
+						m_rto_backoff = 0;
+						m_rto_due = time_point();
+					}
+				}
+
+				// the room left in the windows goes to the send buffer
+				send_unsent();
 
-				if (!was_writeable && is_writeable)
-					maybe_wakeup_writer();
+				if (m_lingering)
+				{
+					if (m_bytes_in_flight == 0 && !m_fin_pending) finish_close();
+					return;
+				}
 
+				// the writer is woken up by the room made in the send buffer
+				if (m_send_handler && is_writable()) maybe_wakeup_writer();
 				return;
 			}
 			case aux::packet::syn:
@@ -729,6 +1654,7 @@ namespace ip {
 			case aux::packet::syn_ack:
 			{
 				assert(m_connect_handler);
+				m_send_window_end = m_channel->initial_window[1];
 				boost::system::error_code ec;
 				m_io_service.post(std::bind(m_connect_handler, ec));
 				m_connect_handler = 0;
@@ -736,45 +1662,102 @@ namespace ip {
 				return;
 			}
 			case aux::packet::error:
+				if (m_connect_handler)
+				{
+					// the connection attempt was refused
+					m_io_service.post(std::bind(m_connect_handler, p.ec));
+					m_connect_handler = 0;
+					m_channel.reset();
+					return;
+				}
+				// an error on an established connection is delivered in
+				// order, like payload
+				// fall through
 			case aux::packet::payload:
 			{
-				aux::packet ack;
-				ack.type = aux::packet::ack;
-				ack.seq_nr = p.seq_nr;
+				// a train is taken in once its last segment has arrived. It's
+				// handed back to this socket then, at the same hop
+				if (p.span > chrono::high_resolution_clock::duration(0))
+				{
+					chrono::high_resolution_clock::duration const span = p.span;
+					p.span = chrono::high_resolution_clock::duration(0);
+					--p.next_hop;
+					m_io_service.sim().deliver_packet(m_io_service.node_id(), span
+						, std::move(p));
+					return;
+				}
 
-				int remote = m_channel->remote_idx(m_bound_to);
-				ack.hops = m_channel->hops[remote];
-				forward_packet(std::move(ack));
+				// in the flow model, the sender isn't waiting for ACKs
+				bool const send_acks
+					= m_io_service.sim().network_model() == simulation::packet_model;
 
-				// if the sequence number is out-of-order, put it in the
-				// m_incoming_packets queue
-				if (p.seq_nr != m_next_incoming_seq)
+				if (p.seq_nr > m_next_incoming_seq)
 				{
-					if (p.seq_nr < m_next_incoming_seq)
+					// out-of-order. It's ACKed selectively, after the packets
+					// received in order (the sender can't tell from the SACK)
+					if (send_acks)
 					{
-						printf("TCP: incoming sequence number lower (%" PRId64 ") "
-							"than expected: %" PRId64 "\n", p.seq_nr, m_next_incoming_seq);
+						if (m_packets_to_ack > 0) send_ack(m_next_incoming_seq, false);
+						send_ack(p.seq_nr, true, p.segments);
 					}
-
-					m_reorder_buffer.insert(std::make_pair(p.seq_nr, std::move(p)));
+					reorder_insert(std::move(p));
 					return;
 				}
 
-				// this packet was in-order. increment the expected next sequence
-				// number.
-				++m_next_incoming_seq;
-				m_incoming_queue.push_back(std::move(p));
+				if (p.seq_nr < m_next_incoming_seq)
+				{
+					// a re-sent packet that had arrived already. The ACK for it
+					// may have been lost, it's sent again right away
+					if (p.seq_nr + p.segments <= m_next_incoming_seq)
+					{
+						if (send_acks) send_ack(m_next_incoming_seq, false);
+						return;
+					}
+					// a re-sent train, only the end of which is new
+					p.split(std::uint32_t(m_next_incoming_seq - p.seq_nr));
+				}
+
+				// this packet was in-order
+				std::uint32_t const segments = p.segments;
+				bool const fin = p.type == aux::packet::error;
+				take_in_order(std::move(p));
 
 				// also, perhaps there are some packets that arrived out-of-order,
 				// check to see
-				auto it = m_reorder_buffer.find(m_next_incoming_seq);
-				while (it != m_reorder_buffer.end())
+				bool filled_gap = false;
+				while (!m_reorder_buffer.empty())
+				{
+					aux::packet& slot = m_reorder_buffer[m_next_incoming_seq
+						& (m_reorder_buffer.size() - 1)];
+					if (slot.type == aux::packet::uninitialized
+						|| slot.seq_nr != m_next_incoming_seq) break;
+					aux::packet pkt = std::move(slot);
+					slot = aux::packet();
+					take_in_order(std::move(pkt));
+					filled_gap = true;
+				}
+
+				// every other packet is ACKed. A packet filling a gap is ACKed
+				// right away, along with the ones after it, and so is the FIN
+				if (send_acks)
 				{
-					aux::packet pkt = std::move(it->second);
-					m_reorder_buffer.erase(it);
-					m_incoming_queue.push_back(std::move(pkt));
-					++m_next_incoming_seq;
-					it = m_reorder_buffer.find(m_next_incoming_seq);
+					m_packets_to_ack += int(segments);
+					if (filled_gap || fin || m_packets_to_ack >= 2)
+					{
+						send_ack(m_next_incoming_seq, false);
+					}
+					else
+					{
+						m_ack_due = chrono::high_resolution_clock::now()
+							+ delayed_ack_timeout;
+						if (!m_ack_timer_armed)
+						{
+							m_ack_timer_armed = true;
+							m_ack_timer.expires_at(m_ack_due);
+							m_ack_timer.async_wait(std::bind(&tcp::socket::on_ack_timer
+								, this, _1));
+						}
+					}
 				}
 
 				maybe_wakeup_reader();
@@ -222,7 +222,7 @@ namespace ip {
 		}
 
 		aux::packet& p = m_incoming_queue.front();
-		if (sender) *sender = *p.from;
+		if (sender) *sender = p.from;
 
 		int read = 0;
 		typedef std::vector<boost::asio::mutable_buffer> buffers_t;
@@ -232,9 +232,9 @@ namespace ip {
 			char* ptr = asio::buffer_cast<char*>(*i);
 			int len = asio::buffer_size(*i);
 			int to_copy = (std::min)(int(p.buffer.size()), len);
-			memcpy(ptr, &p.buffer[0], to_copy);
+			p.buffer.copy_to(ptr, to_copy);
 			read += to_copy;
-			p.buffer.erase(p.buffer.begin(), p.buffer.begin() + to_copy);
+			p.buffer.consume(to_copy);
 			m_queue_size -= to_copy;
 			if (p.buffer.empty()) break;
 		}
@@ -362,8 +362,8 @@ namespace ip {
 			return 0;
 		}
 
-		route hops = m_io_service.find_udp_socket(*this, dst);
-		if (hops.empty())
+		std::shared_ptr<route const> hops = m_io_service.find_udp_socket(*this, dst);
+		if (!hops)
 		{
 			// the packet is silently dropped
 			// TODO: it would be nice if this would result in a round-trip time
@@ -371,24 +371,18 @@ namespace ip {
 			return ret;
 		}
 
-		hops.prepend(m_io_service.get_outgoing_route(m_bound_to.address()));
-
 		m_next_send = (std::max)(now, m_next_send);
 
 		aux::packet p;
 		p.overhead = 28;
 		p.type = aux::packet::payload;
-		*p.from = m_bound_to;
-		p.hops = hops;
-		for (std::vector<asio::const_buffer>::const_iterator i = b.begin()
-			, end(b.end()); i != end; ++i)
-		{
-			p.buffer.insert(p.buffer.end(), asio::buffer_cast<uint8_t const*>(*i)
-				, asio::buffer_cast<uint8_t const*>(*i) + asio::buffer_size(*i));
-		}
+		p.from = m_bound_to;
+		p.to = dst;
+		p.set_route(std::move(hops));
+		p.buffer = aux::payload::copy(b, ret);
 
 		const int packet_size = p.buffer.size() + p.overhead;
-		forward_packet(std::move(p));
+		m_io_service.forward_packet(std::move(p));
 
 		m_next_send += chrono::duration_cast<duration>(chrono::nanoseconds(
 			boost::int64_t(nanoseconds_per_byte * packet_size)));
@@ -0,0 +1,204 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+
+using namespace sim;
+using namespace sim::asio::ip;
+using namespace sim::chrono;
+using sim::simulation;
+using sim::default_config;
+using namespace std::placeholders;
+
+namespace {
+
+	const int num_seeds = 16;
+	const int num_pings = 40;
+
+	// the latency of the network depends on the seed
+	struct seeded_config : default_config
+	{
+		explicit seeded_config(int seed) : m_seed(seed) {}
+
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			m_link = std::make_shared<queue>(std::ref(sim.get_io_service())
+				, 0, milliseconds(1 + m_seed * 3), 0, "link");
+		}
+
+		virtual route channel_route(address, address) override
+		{ return route().append(m_link); }
+
+	private:
+		int m_seed;
+		std::shared_ptr<queue> m_link;
+	};
+
+	// the times (in microseconds) node A received its pongs at, followed by
+	// the time the simulation ended at
+	std::vector<std::int64_t> run_scenario(int seed)
+	{
+		seeded_config cfg(seed);
+		simulation sim(cfg);
+
+		asio::io_service ios_a(sim, address_v4::from_string("10.0.0.1"));
+		asio::io_service ios_b(sim, address_v4::from_string("10.0.0.2"));
+
+		udp::socket sock_a(ios_a);
+		udp::socket sock_b(ios_b);
+		boost::system::error_code ec;
+		sock_a.open(udp::v4(), ec);
+		sock_a.bind(udp::endpoint(address(), 6881), ec);
+		sock_a.io_control(udp::socket::non_blocking_io(true), ec);
+		sock_b.open(udp::v4(), ec);
+		sock_b.bind(udp::endpoint(address(), 6882), ec);
+		sock_b.io_control(udp::socket::non_blocking_io(true), ec);
+
+		std::vector<std::int64_t> ret;
+		high_resolution_clock::time_point const start = high_resolution_clock::now();
+		char buf_a[100];
+		char buf_b[100];
+		udp::endpoint from_a;
+		udp::endpoint from_b;
+
+		// B echoes everything back
+		std::function<void(boost::system::error_code const&, std::size_t)> on_b
+			= [&](boost::system::error_code const& e, std::size_t bytes)
+		{
+			if (e) return;
+			boost::system::error_code err;
+			sock_b.send_to(asio::buffer(buf_b, bytes), from_b, 0, err);
+			sock_b.async_receive_from(asio::mutable_buffers_1(buf_b, sizeof(buf_b))
+				, from_b, on_b);
+		};
+		sock_b.async_receive_from(asio::mutable_buffers_1(buf_b, sizeof(buf_b))
+			, from_b, on_b);
+
+		std::function<void(boost::system::error_code const&, std::size_t)> on_a
+			= [&](boost::system::error_code const& e, std::size_t)
+		{
+			if (e) return;
+			ret.push_back(duration_cast<microseconds>(
+				high_resolution_clock::now() - start).count());
+			if (int(ret.size()) == num_pings)
+			{
+				sock_a.close();
+				sock_b.close();
+				return;
+			}
+			sock_a.async_receive_from(asio::mutable_buffers_1(buf_a, sizeof(buf_a))
+				, from_a, on_a);
+		};
+		sock_a.async_receive_from(asio::mutable_buffers_1(buf_a, sizeof(buf_a))
+			, from_a, on_a);
+
+		// A sends a ping every few milliseconds
+		asio::high_resolution_timer timer(ios_a);
+		int sent = 0;
+		std::function<void(boost::system::error_code const&)> on_timer
+			= [&](boost::system::error_code const& e)
+		{
+			if (e || sent == num_pings) return;
+			boost::system::error_code err;
+			sock_a.send_to(asio::buffer(buf_a, 10 + sent)
+				, udp::endpoint(address_v4::from_string("10.0.0.2"), 6882), 0, err);
+			++sent;
+			timer.expires_from_now(milliseconds(1 + (seed + sent) % 5));
+			timer.async_wait(on_timer);
+		};
+		timer.expires_from_now(milliseconds(seed));
+		timer.async_wait(on_timer);
+
+		sim.run();
+		ret.push_back(duration_cast<microseconds>(
+			high_resolution_clock::now() - high_resolution_clock::time_point()).count());
+		return ret;
+	}
+}
+
+TEST_CASE("simulations start at time zero", "concurrent")
+{
+	std::vector<std::int64_t> const first = run_scenario(3);
+	std::vector<std::int64_t> const second = run_scenario(3);
+	REQUIRE(int(first.size()) == num_pings + 1);
+	CHECK(first == second);
+}
+
+TEST_CASE("nested simulations have separate clocks", "concurrent")
+{
+	default_config cfg;
+	simulation outer(cfg);
+	asio::io_service ios(outer, address_v4::from_string("10.0.0.1"));
+	asio::high_resolution_timer t(ios);
+	t.expires_from_now(seconds(10));
+	t.async_wait([](boost::system::error_code const&) {});
+	outer.run();
+	high_resolution_clock::time_point const outer_end = high_resolution_clock::now();
+	CHECK(outer_end - high_resolution_clock::time_point() == seconds(10));
+
+	std::vector<std::int64_t> const inner = run_scenario(1);
+	REQUIRE(int(inner.size()) == num_pings + 1);
+	CHECK(inner.back() < 10000000);
+
+	// once the inner simulation is gone, the clock of the outer one is back
+	CHECK(high_resolution_clock::now() == outer_end);
+}
+
+TEST_CASE("simulations running concurrently don't interfere", "concurrent")
+{
+	std::vector<std::vector<std::int64_t>> expected;
+	for (int i = 0; i < num_seeds; ++i)
+		expected.push_back(run_scenario(i));
+
+	high_resolution_clock::time_point const before = high_resolution_clock::now();
+
+	// every thread runs all scenarios, starting at a different one, so
+	// different seeds run at the same time
+	int const num_threads = 8;
+	std::vector<std::vector<std::vector<std::int64_t>>> results(num_threads);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < num_threads; ++t)
+	{
+		threads.emplace_back([t, &results]
+		{
+			results[t].resize(num_seeds);
+			for (int i = 0; i < num_seeds; ++i)
+			{
+				int const seed = (t * 5 + i) % num_seeds;
+				results[t][seed] = run_scenario(seed);
+			}
+		});
+	}
+	for (auto& t : threads) t.join();
+
+	CHECK(high_resolution_clock::now() == before);
+	for (int i = 0; i < num_seeds; ++i)
+	{
+		REQUIRE(int(expected[i].size()) == num_pings + 1);
+		for (int t = 0; t < num_threads; ++t)
+			CHECK(results[t][i] == expected[i]);
+	}
+}
+
@@ -0,0 +1,196 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+#include "catch.hpp"
+
+using namespace sim::chrono;
+using namespace sim::asio;
+using sim::simulation;
+using sim::default_config;
+using namespace std::placeholders;
+
+namespace {
+
+	struct scheduled_t
+	{
+		int id;
+		high_resolution_clock::time_point expires;
+		// the order the timer was last (re)scheduled in
+		int order;
+	};
+
+	struct fired_t
+	{
+		int id;
+		high_resolution_clock::time_point at;
+	};
+
+	void on_timer(std::vector<fired_t>& fired, int id
+		, boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		fired.push_back({id, high_resolution_clock::now()});
+	}
+
+	// schedules timers at pseudo random times, with plenty of ties and a few
+	// very far into the future, reschedules some of them and returns the order
+	// they fired in
+	std::vector<fired_t> run_timers(simulation::scheduler_t s
+		, std::vector<scheduled_t>& expected)
+	{
+		default_config cfg;
+		simulation sim(cfg, s);
+		io_service ios(sim, ip::address_v4::from_string("1.2.3.4"));
+
+		const high_resolution_clock::time_point start = high_resolution_clock::now();
+
+		std::vector<fired_t> fired;
+		std::vector<std::unique_ptr<high_resolution_timer>> timers;
+		std::uint32_t rnd = 0x1337;
+		int order = 0;
+		const int num_timers = 500;
+
+		auto random_delay = [&]() -> high_resolution_clock::duration
+		{
+			rnd = rnd * 1103515245 + 12345;
+			const int r = (rnd >> 8) % 1000;
+			// these end up in higher levels of the timing wheel
+			if (r < 10) return hours(r + 1);
+			if (r < 50) return seconds(r);
+			// lots of timers expiring at the same millisecond
+			return milliseconds(r % 40 + 1);
+		};
+
+		for (int i = 0; i < num_timers; ++i)
+		{
+			timers.emplace_back(new high_resolution_timer(ios));
+			high_resolution_clock::duration d = random_delay();
+			timers.back()->expires_from_now(d);
+			timers.back()->async_wait(std::bind(&on_timer, std::ref(fired), i, _1));
+			expected.push_back({i, start + d, order++});
+		}
+
+		// reschedule every third timer, both earlier and later
+		for (int i = 0; i < num_timers; i += 3)
+		{
+			high_resolution_clock::duration d = random_delay();
+			timers[i]->expires_from_now(d);
+			timers[i]->async_wait(std::bind(&on_timer, std::ref(fired), i, _1));
+			expected[i].expires = start + d;
+			expected[i].order = order++;
+		}
+
+		// and cancel a few
+		for (int i = 1; i < num_timers; i += 50)
+		{
+			timers[i]->cancel();
+			expected[i].id = -1;
+		}
+
+		sim.run();
+
+		expected.erase(std::remove_if(expected.begin(), expected.end()
+			, [](scheduled_t const& e) { return e.id == -1; }), expected.end());
+		std::sort(expected.begin(), expected.end()
+			, [](scheduled_t const& lhs, scheduled_t const& rhs)
+			{
+				if (lhs.expires != rhs.expires) return lhs.expires < rhs.expires;
+				return lhs.order < rhs.order;
+			});
+		return fired;
+	}
+
+	void check_scheduler(simulation::scheduler_t s)
+	{
+		std::vector<scheduled_t> expected;
+		std::vector<fired_t> fired = run_timers(s, expected);
+
+		REQUIRE(fired.size() == expected.size());
+		for (int i = 0; i < int(fired.size()); ++i)
+		{
+			CHECK(fired[i].id == expected[i].id);
+			CHECK(fired[i].at == expected[i].expires);
+		}
+	}
+}
+
+TEST_CASE("multiset scheduler fires timers in order", "timer_queue")
+{
+	check_scheduler(simulation::multiset_scheduler);
+}
+
+TEST_CASE("heap scheduler fires timers in order", "timer_queue")
+{
+	check_scheduler(simulation::heap_scheduler);
+}
+
+TEST_CASE("timing wheel scheduler fires timers in order", "timer_queue")
+{
+	check_scheduler(simulation::timing_wheel_scheduler);
+}
+
+TEST_CASE("posted handlers and timers run in the order they were scheduled", "event_queue")
+{
+	for (simulation::scheduler_t s : { simulation::multiset_scheduler
+		, simulation::heap_scheduler, simulation::timing_wheel_scheduler })
+	{
+		default_config cfg;
+		simulation sim(cfg, s);
+		io_service ios(sim, ip::address_v4::from_string("1.2.3.4"));
+
+		const high_resolution_clock::time_point start = high_resolution_clock::now();
+		std::vector<int> order;
+		high_resolution_clock::time_point posted_at;
+
+		high_resolution_timer t1(ios);
+		high_resolution_timer t2(ios);
+
+		t1.expires_from_now(milliseconds(10));
+		t1.async_wait([&](boost::system::error_code const&)
+		{
+			order.push_back(1);
+			// this is due at the same time as t2, but t2 was scheduled first
+			ios.post([&]
+			{
+				order.push_back(4);
+				posted_at = high_resolution_clock::now();
+			});
+			// the simulation is running, this is invoked immediately
+			ios.dispatch([&] { order.push_back(2); });
+		});
+
+		t2.expires_from_now(milliseconds(10));
+		t2.async_wait([&](boost::system::error_code const&)
+		{ order.push_back(3); });
+
+		// the simulation isn't running yet, this is posted
+		ios.dispatch([&] { order.push_back(0); });
+		CHECK(order.empty());
+
+		sim.run();
+
+		CHECK(order == std::vector<int>({0, 1, 2, 3, 4}));
+		CHECK(posted_at - start == milliseconds(10));
+	}
+}
+
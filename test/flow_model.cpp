@@ -0,0 +1,252 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+#include <functional>
+#include "catch.hpp"
+
+using namespace sim;
+using namespace sim::asio;
+using namespace sim::asio::ip;
+using namespace sim::chrono;
+using sim::simulation;
+using sim::default_config;
+
+namespace {
+
+	char pattern(int i) { return char(i * 7 % 251); }
+
+	std::int64_t now_us()
+	{
+		return duration_cast<microseconds>(high_resolution_clock::now()
+			- high_resolution_clock::time_point()).count();
+	}
+
+	// the uplinks of the nodes are fast, the downlink of 10.0.0.3 is the
+	// bottleneck, at 1 MB/s with 1 ms latency
+	struct bottleneck_config : default_config
+	{
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			m_uplink = std::make_shared<queue>(std::ref(sim.get_io_service())
+				, 10 * 1000 * 1000, high_resolution_clock::duration(0), 0, "uplink");
+			m_downlink = std::make_shared<queue>(std::ref(sim.get_io_service())
+				, 1000 * 1000, duration_cast<high_resolution_clock::duration>(
+					milliseconds(1)), 0, "downlink");
+		}
+
+		virtual route incoming_route(address ip) override
+		{
+			if (ip == address_v4::from_string("10.0.0.3"))
+				return route().append(m_downlink);
+			return route();
+		}
+
+		virtual route outgoing_route(address) override
+		{ return route().append(m_uplink); }
+
+	private:
+		std::shared_ptr<queue> m_uplink;
+		std::shared_ptr<queue> m_downlink;
+	};
+
+	// the size of n bytes on the wire, sent as segments of the MSS
+	std::int64_t wire_size(std::int64_t n)
+	{
+		return n + (n + 1474) / 1475 * 40;
+	}
+
+	// connects to 10.0.0.3 at time zero, and writes ``total`` virtual bytes
+	// one second later. Records the time the last byte is received
+	struct transfer
+	{
+		transfer(io_service& ios, io_service& receiver, int port, int total)
+			: listener(receiver)
+			, incoming(receiver)
+			, outgoing(ios)
+			, timer(ios)
+			, total(total)
+			, received(0)
+			, done_us(0)
+		{
+			boost::system::error_code ec;
+			listener.open(tcp::v4(), ec);
+			listener.bind(tcp::endpoint(address(), port), ec);
+			listener.listen(10, ec);
+			listener.async_accept(incoming, [this](boost::system::error_code const& e)
+			{
+				REQUIRE(!e);
+				read();
+			});
+			outgoing.async_connect(tcp::endpoint(address_v4::from_string("10.0.0.3")
+				, port), [this](boost::system::error_code const& e)
+			{
+				REQUIRE(!e);
+			});
+			timer.expires_at(high_resolution_clock::time_point(seconds(1)));
+			timer.async_wait([this](boost::system::error_code const&)
+			{
+				outgoing.async_write_virtual(this->total
+					, [](boost::system::error_code const&, std::size_t) {});
+			});
+		}
+
+		void read()
+		{
+			incoming.async_read_some(buffer(buf, sizeof(buf))
+				, [this](boost::system::error_code const& e, std::size_t bytes)
+			{
+				if (e) return;
+				received += int(bytes);
+				if (received == total)
+				{
+					done_us = now_us();
+					return;
+				}
+				read();
+			});
+		}
+
+		tcp::acceptor listener;
+		tcp::socket incoming;
+		tcp::socket outgoing;
+		high_resolution_timer timer;
+		int const total;
+		int received;
+		std::int64_t done_us;
+		char buf[64 * 1024];
+	};
+}
+
+TEST_CASE("flows share a bottleneck max-min fairly", "flow_model")
+{
+	bottleneck_config cfg;
+	simulation sim(cfg);
+	sim.set_network_model(simulation::flow_model);
+	io_service ios_a(sim, address_v4::from_string("10.0.0.1"));
+	io_service ios_b(sim, address_v4::from_string("10.0.0.2"));
+	io_service ios_c(sim, address_v4::from_string("10.0.0.3"));
+
+	transfer a(ios_a, ios_c, 8080, 1000000);
+	transfer b(ios_b, ios_c, 8081, 2000000);
+
+	std::size_t const events = sim.run();
+
+	REQUIRE(a.received == a.total);
+	REQUIRE(b.received == b.total);
+
+	// both flows get half of the downlink until the first one is done, then
+	// the second one gets all of it. The bytes arrive after the 30 ms of the
+	// network and the 1 ms of the downlink
+	std::int64_t const latency = 31000;
+	std::int64_t const wa = wire_size(a.total);
+	std::int64_t const wb = wire_size(b.total);
+	CHECK(std::abs(a.done_us - (1000000 + wa * 2 + latency)) <= 1);
+	CHECK(std::abs(b.done_us - (1000000 + wa + wb + latency)) <= 1);
+
+	// connecting takes a few packets, transferring the bytes only a few events
+	CHECK(events < 100);
+}
+
+TEST_CASE("the same application runs in both network models", "flow_model")
+{
+	int const total = 300000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	std::size_t events[2];
+	std::int64_t end_us[2];
+	for (int model = 0; model < 2; ++model)
+	{
+		default_config cfg;
+		simulation sim(cfg);
+		if (model == 1) sim.set_network_model(simulation::flow_model);
+		io_service ios_a(sim, address_v4::from_string("10.0.0.1"));
+		io_service ios_b(sim, address_v4::from_string("10.0.0.2"));
+
+		tcp::acceptor listener(ios_b);
+		tcp::socket incoming(ios_b);
+		tcp::socket outgoing(ios_a);
+		boost::system::error_code ec;
+		listener.open(tcp::v4(), ec);
+		listener.bind(tcp::endpoint(address(), 8080), ec);
+		listener.listen(10, ec);
+
+		// the sender writes in chunks and closes the socket right after the
+		// last write. The receiver still gets every byte before the EOF
+		int written = 0;
+		std::function<void(boost::system::error_code const&, std::size_t)> on_write
+			= [&](boost::system::error_code const& e, std::size_t bytes)
+		{
+			if (e) return;
+			written += int(bytes);
+			if (written == total)
+			{
+				outgoing.close();
+				return;
+			}
+			outgoing.async_write_some(buffer(&send_buf[written]
+				, (std::min)(total - written, 100000)), on_write);
+		};
+
+		std::vector<char> received;
+		boost::system::error_code read_error;
+		char recv_buf[5000];
+		std::function<void(boost::system::error_code const&, std::size_t)> on_read
+			= [&](boost::system::error_code const& e, std::size_t bytes)
+		{
+			received.insert(received.end(), recv_buf, recv_buf + bytes);
+			if (e)
+			{
+				read_error = e;
+				end_us[model] = now_us();
+				return;
+			}
+			incoming.async_read_some(buffer(recv_buf, sizeof(recv_buf)), on_read);
+		};
+
+		listener.async_accept(incoming, [&](boost::system::error_code const& e)
+		{
+			REQUIRE(!e);
+			on_read(e, 0);
+		});
+		outgoing.async_connect(tcp::endpoint(address_v4::from_string("10.0.0.2"), 8080)
+			, [&](boost::system::error_code const& e)
+		{
+			REQUIRE(!e);
+			on_write(e, 0);
+		});
+
+		events[model] = sim.run();
+
+		CHECK(written == total);
+		CHECK(read_error == boost::system::error_code(error::eof));
+		REQUIRE(int(received.size()) == total);
+		CHECK(received == send_buf);
+	}
+
+	// the transfer is limited by the 200 kB/s of the sender's DSL modem in
+	// both models
+	CHECK(end_us[0] > 1500000);
+	CHECK(end_us[1] > 1500000);
+	// most of the events left are the reads, of 5000 bytes each
+	CHECK(events[1] * 10 < events[0]);
+}
+
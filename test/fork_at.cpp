@@ -0,0 +1,127 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include <functional>
+#include <map>
+#include "catch.hpp"
+
+using namespace sim;
+using namespace sim::asio::ip;
+using namespace sim::chrono;
+using sim::simulation;
+using sim::default_config;
+
+// forking is only supported on POSIX systems
+#if !defined _WIN32
+
+#include <unistd.h>
+
+namespace {
+
+	struct branch_record
+	{
+		int branch;
+		int ticks;
+		int warmup_ticks;
+		std::int64_t end_time;
+	};
+}
+
+TEST_CASE("fork_at continues the simulation in every branch", "fork_at")
+{
+	default_config cfg;
+	simulation sim(cfg);
+	asio::io_service ios(sim, address_v4::from_string("10.0.0.1"));
+
+	// the node ticks every 10 ms, until it has ticked 20 times
+	asio::high_resolution_timer timer(ios);
+	int ticks = 0;
+	int interval = 10;
+	std::function<void(boost::system::error_code const&)> on_tick
+		= [&](boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		if (++ticks == 20) return;
+		timer.expires_from_now(milliseconds(interval));
+		timer.async_wait(on_tick);
+	};
+	timer.expires_from_now(milliseconds(interval));
+	timer.async_wait(on_tick);
+
+	int fds[2];
+	REQUIRE(::pipe(fds) == 0);
+
+	// after 55 ms, every branch changes the interval
+	int warmup_ticks = -1;
+	sim.fork_at(high_resolution_clock::time_point(milliseconds(55)), 3
+		, [&](int branch)
+	{
+		warmup_ticks = ticks;
+		interval = 1 + branch;
+	});
+
+	sim.run();
+
+	if (sim.branch() >= 0)
+	{
+		branch_record r;
+		r.branch = sim.branch();
+		r.ticks = ticks;
+		r.warmup_ticks = warmup_ticks;
+		r.end_time = duration_cast<milliseconds>(high_resolution_clock::now()
+			- high_resolution_clock::time_point()).count();
+		int const ret = int(::write(fds[1], &r, sizeof(r)));
+		::_exit(ret == sizeof(r) ? 10 + r.branch : 1);
+	}
+	::close(fds[1]);
+
+	// the original process stops at the fork point
+	CHECK(ticks == 5);
+	CHECK(warmup_ticks == -1);
+	CHECK(sim.branch() == -1);
+	REQUIRE(sim.branch_exit_codes().size() == 3);
+	for (int i = 0; i < 3; ++i)
+		CHECK(sim.branch_exit_codes()[i] == 10 + i);
+
+	std::map<int, branch_record> records;
+	branch_record r;
+	while (::read(fds[0], &r, sizeof(r)) == sizeof(r))
+		records[r.branch] = r;
+	::close(fds[0]);
+
+	REQUIRE(records.size() == 3);
+	for (int i = 0; i < 3; ++i)
+	{
+		CHECK(records[i].ticks == 20);
+		CHECK(records[i].warmup_ticks == 5);
+		// the 6th tick was already scheduled at 60 ms before the fork. The
+		// remaining 14 are at the new interval
+		CHECK(records[i].end_time == 60 + 14 * (1 + i));
+	}
+
+	// the original timeline can be continued as well
+	sim.reset();
+	sim.run();
+	CHECK(ticks == 20);
+	CHECK(duration_cast<milliseconds>(high_resolution_clock::now()
+		- high_resolution_clock::time_point()).count() == 200);
+}
+
+#endif // _WIN32
+
@@ -0,0 +1,373 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+#include <functional>
+#include <memory>
+#include <cinttypes>
+#include "catch.hpp"
+
+using namespace sim;
+using namespace sim::asio::ip;
+using namespace sim::chrono;
+using sim::simulation;
+using sim::default_config;
+using namespace std::placeholders;
+
+namespace {
+
+	const int num_nodes = 24;
+
+	// each node keeps a log of everything that happens to it, with the time
+	// relative to the start of the simulation. Nodes only interact by sending
+	// packets to each other, so the logs must be the same regardless of how
+	// many threads the simulation runs on
+	struct node
+	{
+		node(simulation& sim, int idx, high_resolution_clock::time_point start)
+			: ios(sim, address_v4(0x0a000001 + idx))
+			, udp_sock(ios)
+			, timer(ios)
+			, listener(ios)
+			, incoming(ios)
+			, outgoing(ios)
+			, m_idx(idx)
+			, m_start(start)
+			, m_sent(0)
+			, m_written(0)
+			, m_size_offset(0)
+		{
+			boost::system::error_code ec;
+			udp_sock.open(udp::v4(), ec);
+			udp_sock.bind(udp::endpoint(address(), 6881), ec);
+			udp_sock.io_control(udp::socket::non_blocking_io(true), ec);
+			receive();
+
+			listener.open(tcp::v4(), ec);
+			listener.bind(tcp::endpoint(address(), 8080), ec);
+			listener.listen(10, ec);
+			listener.async_accept(incoming, std::bind(&node::on_accept, this, _1));
+
+			timer.expires_from_now(milliseconds(10 + idx % 7));
+			timer.async_wait(std::bind(&node::on_timer, this, _1));
+		}
+
+		void log(char const* what, int value)
+		{
+			char buf[100];
+			snprintf(buf, sizeof(buf), "%" PRId64 " %s %d"
+				, std::int64_t(duration_cast<microseconds>(
+					high_resolution_clock::now() - m_start).count())
+				, what, value);
+			events.push_back(buf);
+		}
+
+		// the simulation's own io_service is used to change every node at the
+		// same time
+		void set_size_offset(int o) { m_size_offset = o; }
+
+		void connect()
+		{
+			outgoing.async_connect(tcp::endpoint(address_v4(0x0a000001
+				+ (m_idx + 1) % num_nodes), 8080)
+				, std::bind(&node::on_connect, this, _1));
+		}
+
+		asio::io_service ios;
+		udp::socket udp_sock;
+		asio::high_resolution_timer timer;
+		tcp::acceptor listener;
+		tcp::socket incoming;
+		tcp::socket outgoing;
+		std::vector<std::string> events;
+
+	private:
+
+		void receive()
+		{
+			udp_sock.async_receive_from(asio::mutable_buffers_1(m_receive_buf
+				, sizeof(m_receive_buf)), m_from
+				, std::bind(&node::on_receive, this, _1, _2));
+		}
+
+		void on_receive(boost::system::error_code const& ec, std::size_t bytes)
+		{
+			if (ec) return;
+			log("udp-receive", int(bytes));
+			if (bytes < 1000)
+			{
+				// respond with a pong
+				boost::system::error_code err;
+				udp_sock.send_to(asio::buffer(m_send_buf, bytes + 1000), m_from, 0, err);
+				if (err) log("udp-send-error", err.value());
+			}
+			receive();
+		}
+
+		void on_timer(boost::system::error_code const& ec)
+		{
+			if (ec) return;
+			if (m_sent == 20) connect();
+			if (m_sent == 60) return;
+			int const target = (m_idx * 7 + m_sent * 5 + 1) % num_nodes;
+			boost::system::error_code err;
+			udp_sock.send_to(asio::buffer(m_send_buf, 100 + m_size_offset + m_sent)
+				, udp::endpoint(address_v4(0x0a000001 + target), 6881), 0, err);
+			if (err) log("udp-send-error", err.value());
+			++m_sent;
+			timer.expires_from_now(milliseconds(10 + (m_idx + m_sent) % 7));
+			timer.async_wait(std::bind(&node::on_timer, this, _1));
+		}
+
+		void on_connect(boost::system::error_code const& ec)
+		{
+			log("connect", ec.value());
+			if (ec) return;
+			write();
+		}
+
+		void write()
+		{
+			outgoing.async_write_some(asio::buffer(m_send_buf + m_written
+				, sizeof(m_send_buf) - m_written)
+				, std::bind(&node::on_write, this, _1, _2));
+		}
+
+		void on_write(boost::system::error_code const& ec, std::size_t bytes)
+		{
+			log("tcp-sent", int(bytes));
+			if (ec) return;
+			m_written += int(bytes);
+			if (m_written < int(sizeof(m_send_buf))) write();
+			else outgoing.close();
+		}
+
+		void on_accept(boost::system::error_code const& ec)
+		{
+			log("accept", ec.value());
+			if (ec) return;
+			incoming.async_read_some(asio::buffer(m_tcp_buf, sizeof(m_tcp_buf))
+				, std::bind(&node::on_read, this, _1, _2));
+		}
+
+		void on_read(boost::system::error_code const& ec, std::size_t bytes)
+		{
+			log("tcp-receive", int(bytes));
+			if (ec) return;
+			incoming.async_read_some(asio::buffer(m_tcp_buf, sizeof(m_tcp_buf))
+				, std::bind(&node::on_read, this, _1, _2));
+		}
+
+		int m_idx;
+		high_resolution_clock::time_point m_start;
+		int m_sent;
+		int m_written;
+		int m_size_offset;
+		udp::endpoint m_from;
+		char m_receive_buf[2000];
+		char m_send_buf[20000];
+		char m_tcp_buf[3000];
+	};
+
+	struct result
+	{
+		std::size_t num_events;
+		high_resolution_clock::duration duration;
+		std::vector<std::vector<std::string>> logs;
+	};
+
+	// groups of 4 nodes are on the same LAN. Packets between them go through
+	// a rate limited switch, without any latency
+	struct lan_config : default_config
+	{
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			for (int i = 0; i < num_nodes / 4; ++i)
+			{
+				m_lan.push_back(std::make_shared<queue>(std::ref(sim.get_io_service())
+					, 1000 * 1000, high_resolution_clock::duration(0), 0, "LAN"));
+			}
+		}
+
+		virtual route channel_route(address src, address dst) override
+		{
+			int const lan = node_cluster(src);
+			if (lan != node_cluster(dst)) return default_config::channel_route(src, dst);
+			return route().append(m_lan[lan]);
+		}
+
+		virtual int node_cluster(address ip) override
+		{ return int(ip.to_v4().to_ulong() - 0x0a000001) / 4; }
+
+	private:
+		std::vector<std::shared_ptr<queue>> m_lan;
+	};
+
+	// if step is set, the simulation is run in steps of that length, for
+	// 2 seconds
+	template <typename Config>
+	result run_swarm(int num_threads
+		, high_resolution_clock::duration step = high_resolution_clock::duration(0))
+	{
+		Config cfg;
+		simulation sim(cfg);
+		sim.set_num_threads(num_threads);
+
+		high_resolution_clock::time_point const start = high_resolution_clock::now();
+		std::vector<std::unique_ptr<node>> nodes;
+		for (int i = 0; i < num_nodes; ++i)
+			nodes.emplace_back(new node(sim, i, start));
+
+		// this timer isn't owned by any node. It runs while no node is running
+		asio::high_resolution_timer t(sim.get_io_service());
+		t.expires_from_now(milliseconds(250));
+		t.async_wait([&](boost::system::error_code const&)
+		{
+			for (auto& n : nodes) n->set_size_offset(50);
+		});
+
+		result ret;
+		if (step > high_resolution_clock::duration(0))
+		{
+			ret.num_events = 0;
+			while (high_resolution_clock::now() - start < seconds(2))
+				ret.num_events += sim.run_for(step);
+			if (sim.run() != 0) ret.num_events = 0;
+		}
+		else
+		{
+			ret.num_events = sim.run();
+		}
+		ret.duration = high_resolution_clock::now() - start;
+		for (auto& n : nodes) ret.logs.push_back(n->events);
+		return ret;
+	}
+}
+
+TEST_CASE("running nodes in parallel gives the same result", "parallel")
+{
+	result const serial = run_swarm<default_config>(1);
+	result const parallel = run_swarm<default_config>(4);
+
+	CHECK(serial.num_events == parallel.num_events);
+	CHECK(serial.duration == parallel.duration);
+	REQUIRE(serial.logs.size() == parallel.logs.size());
+	for (std::size_t i = 0; i < serial.logs.size(); ++i)
+	{
+		REQUIRE(serial.logs[i].size() > 60);
+		CHECK(serial.logs[i] == parallel.logs[i]);
+	}
+}
+
+TEST_CASE("nodes on a LAN run on the same thread", "parallel")
+{
+	result const serial = run_swarm<lan_config>(1);
+	result const parallel = run_swarm<lan_config>(3);
+
+	CHECK(serial.num_events == parallel.num_events);
+	CHECK(serial.duration == parallel.duration);
+	REQUIRE(serial.logs.size() == parallel.logs.size());
+	for (std::size_t i = 0; i < serial.logs.size(); ++i)
+		CHECK(serial.logs[i] == parallel.logs[i]);
+}
+
+TEST_CASE("stepping through a parallel simulation gives the same result", "parallel")
+{
+	result const serial = run_swarm<default_config>(1);
+	result const stepped = run_swarm<default_config>(4, milliseconds(7));
+
+	CHECK(serial.duration < seconds(2));
+	CHECK(serial.num_events == stepped.num_events);
+	REQUIRE(serial.logs.size() == stepped.logs.size());
+	for (std::size_t i = 0; i < serial.logs.size(); ++i)
+		CHECK(serial.logs[i] == stepped.logs[i]);
+}
+
+TEST_CASE("a network without lookahead runs on a single thread", "parallel")
+{
+	// configuration::min_channel_latency() defaults to 0
+	struct no_lookahead : default_config
+	{
+		virtual high_resolution_clock::duration min_channel_latency() override
+		{ return configuration::min_channel_latency(); }
+	};
+
+	no_lookahead cfg;
+	simulation sim(cfg);
+	sim.set_num_threads(4);
+
+	asio::io_service ios1(sim, address_v4::from_string("10.0.0.1"));
+	asio::io_service ios2(sim, address_v4::from_string("10.0.0.2"));
+
+	int fired = 0;
+	asio::high_resolution_timer t1(ios1);
+	asio::high_resolution_timer t2(ios2);
+	t1.expires_from_now(milliseconds(10));
+	t1.async_wait([&](boost::system::error_code const&) { ++fired; });
+	t2.expires_from_now(milliseconds(20));
+	t2.async_wait([&](boost::system::error_code const&) { ++fired; });
+
+	CHECK(sim.run() == 2);
+	CHECK(fired == 2);
+}
+
+TEST_CASE("the nodes are partitioned once, not on every step", "parallel")
+{
+	// node_cluster() is only asked while partitioning the nodes
+	struct counting_config : default_config
+	{
+		virtual int node_cluster(address) override
+		{
+			++calls;
+			return -1;
+		}
+		int calls = 0;
+	};
+
+	counting_config cfg;
+	simulation sim(cfg);
+	sim.set_num_threads(2);
+
+	asio::io_service ios1(sim, address_v4::from_string("10.0.0.1"));
+	asio::io_service ios2(sim, address_v4::from_string("10.0.0.2"));
+
+	int fired = 0;
+	asio::high_resolution_timer t1(ios1);
+	asio::high_resolution_timer t2(ios2);
+	t1.expires_from_now(milliseconds(10));
+	t1.async_wait([&](boost::system::error_code const&) { ++fired; });
+	t2.expires_from_now(milliseconds(95));
+	t2.async_wait([&](boost::system::error_code const&) { ++fired; });
+
+	std::size_t events = 0;
+	for (int i = 0; i < 20; ++i)
+	{
+		events += sim.run_for(milliseconds(5));
+		events += sim.poll();
+	}
+	CHECK(events == 2);
+	CHECK(fired == 2);
+	CHECK(cfg.calls == 2);
+
+	// adding a node has the next run partition them again
+	asio::io_service ios3(sim, address_v4::from_string("10.0.0.3"));
+	CHECK(sim.run() == 0);
+	CHECK(cfg.calls == 5);
+}
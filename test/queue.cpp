@@ -0,0 +1,116 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+#include "catch.hpp"
+
+using namespace sim;
+using namespace sim::chrono;
+using sim::simulation;
+using sim::default_config;
+
+namespace {
+
+	int const num_segments = 40;
+	int const segment_size = 1000;
+
+	// records the sequence number and arrival time of every segment
+	struct recorder : sink
+	{
+		virtual void incoming_packet(aux::packet p) override
+		{
+			time_point const now = high_resolution_clock::now();
+			std::uint32_t const n = p.segments;
+			for (std::uint32_t i = 0; i < n; ++i)
+			{
+				duration const offset(n > 1 ? p.span.count() * i / (n - 1) : 0);
+				arrivals.push_back(std::make_pair(p.seq_nr + i
+					, duration_cast<nanoseconds>((now + offset).time_since_epoch()).count()));
+			}
+		}
+
+		virtual std::string label() const override { return "recorder"; }
+
+		typedef high_resolution_clock::time_point time_point;
+		typedef high_resolution_clock::duration duration;
+
+		std::vector<std::pair<std::uint64_t, std::int64_t>> arrivals;
+	};
+
+	aux::packet make_packet(std::shared_ptr<route const> const& hops
+		, std::uint64_t seq_nr, std::uint32_t segments)
+	{
+		aux::packet p;
+		p.type = aux::packet::payload;
+		std::uint8_t* data;
+		p.buffer = aux::payload::allocate(std::size_t(segments) * segment_size, data);
+		std::fill(data, data + p.buffer.size(), std::uint8_t(0));
+		p.overhead = 20 * int(segments);
+		p.seq_nr = seq_nr;
+		p.segments = segments;
+		p.segment_size = segment_size;
+		p.set_route(hops);
+		return p;
+	}
+
+	// the segments arrive every 500 us at a 1 MB/s queue holding 8 of them,
+	// which takes 1.02 ms to send each. A third of them are dropped
+	std::vector<std::pair<std::uint64_t, std::int64_t>> send_segments(bool train)
+	{
+		default_config cfg;
+		simulation sim(cfg);
+		auto q = std::make_shared<queue>(std::ref(sim.get_io_service())
+			, 1000 * 1000, high_resolution_clock::duration(0)
+			, 8 * (segment_size + 20), "bottleneck");
+		auto rec = std::make_shared<recorder>();
+		auto const hops = std::make_shared<route const>(
+			route().append(q).append(rec));
+
+		high_resolution_clock::duration const gap = microseconds(500);
+		std::vector<std::unique_ptr<asio::high_resolution_timer>> timers;
+		for (int i = 0; i < (train ? 1 : num_segments); ++i)
+		{
+			timers.emplace_back(new asio::high_resolution_timer(sim.get_io_service()));
+			timers.back()->expires_from_now(milliseconds(1) + gap * i);
+			timers.back()->async_wait([=](boost::system::error_code const&)
+			{
+				if (!train)
+				{
+					forward_packet(make_packet(hops, std::uint64_t(i), 1));
+					return;
+				}
+				aux::packet p = make_packet(hops, 0, num_segments);
+				p.span = gap * (num_segments - 1);
+				forward_packet(std::move(p));
+			});
+		}
+		sim.run();
+		return rec->arrivals;
+	}
+}
+
+TEST_CASE("a train is tail-dropped like its segments", "queue")
+{
+	auto const single = send_segments(false);
+	auto const train = send_segments(true);
+
+	CHECK(single.size() > num_segments / 2);
+	CHECK(single.size() < num_segments * 3 / 4);
+	CHECK(train == single);
+}
@@ -0,0 +1,140 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include <functional>
+#include "catch.hpp"
+
+using namespace sim;
+using namespace sim::asio::ip;
+using namespace sim::chrono;
+using sim::simulation;
+using sim::default_config;
+
+namespace {
+
+	std::int64_t now_ms()
+	{
+		return duration_cast<milliseconds>(high_resolution_clock::now()
+			- high_resolution_clock::time_point()).count();
+	}
+
+	high_resolution_clock::time_point at_ms(int ms)
+	{
+		return high_resolution_clock::time_point(milliseconds(ms));
+	}
+}
+
+TEST_CASE("step through a simulation", "run_until")
+{
+	default_config cfg;
+	simulation sim(cfg);
+	asio::io_service ios(sim, address_v4::from_string("10.0.0.1"));
+
+	// a timer firing every 10 ms, 10 times
+	asio::high_resolution_timer timer(ios);
+	std::vector<std::int64_t> fired;
+	std::function<void(boost::system::error_code const&)> on_timer
+		= [&](boost::system::error_code const& ec)
+	{
+		if (ec) return;
+		fired.push_back(now_ms());
+		if (fired.size() == 10) return;
+		timer.expires_from_now(milliseconds(10));
+		timer.async_wait(on_timer);
+	};
+	timer.expires_from_now(milliseconds(10));
+	timer.async_wait(on_timer);
+
+	// nothing is due yet
+	CHECK(sim.poll() == 0);
+	CHECK(sim.poll_one() == 0);
+	CHECK(now_ms() == 0);
+
+	CHECK(sim.run_until(at_ms(25)) == 2);
+	CHECK(now_ms() == 25);
+	CHECK(fired.size() == 2);
+
+	// the clock doesn't go backwards
+	CHECK(sim.run_until(at_ms(20)) == 0);
+	CHECK(now_ms() == 25);
+
+	// events exactly at the limit are left for the next call
+	CHECK(sim.run_for(milliseconds(5)) == 0);
+	CHECK(now_ms() == 30);
+	CHECK(fired.size() == 2);
+
+	// and are due now
+	CHECK(sim.poll_one() == 1);
+	CHECK(fired.size() == 3);
+	CHECK(sim.poll() == 0);
+	CHECK(now_ms() == 30);
+
+	CHECK(sim.run_events(3) == 3);
+	CHECK(now_ms() == 60);
+	CHECK(fired.size() == 6);
+
+	// stop() interrupts run_until() without moving the clock to the limit
+	asio::high_resolution_timer stopper(sim.get_io_service());
+	stopper.expires_at(at_ms(75));
+	stopper.async_wait([&](boost::system::error_code const&) { sim.stop(); });
+	CHECK(sim.run_until(at_ms(200)) == 2);
+	CHECK(now_ms() == 75);
+	CHECK(fired.size() == 7);
+
+	sim.reset();
+	CHECK(sim.run() == 3);
+	CHECK(now_ms() == 100);
+	CHECK(fired == std::vector<std::int64_t>({10, 20, 30, 40, 50, 60, 70, 80, 90, 100}));
+}
+
+
+TEST_CASE("step two simulations in turn", "run_until")
+{
+	default_config cfg1;
+	default_config cfg2;
+	simulation a(cfg1);
+	simulation b(cfg2);
+	asio::io_service ios_a(a, address_v4::from_string("10.0.0.1"));
+	asio::io_service ios_b(b, address_v4::from_string("10.0.0.2"));
+
+	int fired_a = 0;
+	int fired_b = 0;
+	asio::high_resolution_timer timer_a(ios_a);
+	timer_a.expires_at(at_ms(5000));
+	timer_a.async_wait([&](boost::system::error_code const&) { ++fired_a; });
+	asio::high_resolution_timer timer_b(ios_b);
+	timer_b.expires_at(at_ms(1000));
+	timer_b.async_wait([&](boost::system::error_code const&) { ++fired_b; });
+
+	// b was constructed last, so outside of run() the thread's clock is b's.
+	// Each simulation is stepped by its own clock
+	CHECK(b.run_for(seconds(10)) == 1);
+	CHECK(fired_b == 1);
+	CHECK(a.poll() == 0);
+	CHECK(a.run_for(seconds(1)) == 0);
+	CHECK(fired_a == 0);
+	CHECK(b.run_for(seconds(1)) == 0);
+	CHECK(a.run_for(seconds(4)) == 0);
+	CHECK(fired_a == 0);
+
+	// a's timer is due now
+	CHECK(a.poll() == 1);
+	CHECK(fired_a == 1);
+	CHECK(b.poll() == 0);
+}
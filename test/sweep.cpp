@@ -0,0 +1,168 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include "simulator/sweep.hpp"
+#include <functional>
+#include <stdexcept>
+#include <csignal>
+#include <cerrno>
+#include <boost/system/system_error.hpp>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "catch.hpp"
+
+using namespace sim;
+using namespace sim::asio::ip;
+using namespace sim::chrono;
+using sim::simulation;
+using sim::default_config;
+
+// sweeps fork child processes, which is only supported on POSIX systems
+#if !defined _WIN32
+
+namespace {
+
+	struct record
+	{
+		int point;
+		int fired;
+		std::int64_t end_time;
+	};
+}
+
+TEST_CASE("sweep runs every point in a child process", "sweep")
+{
+	// the topology is built once, in the parent
+	default_config cfg;
+	simulation sim(cfg);
+	asio::io_service ios(sim, address_v4::from_string("10.0.0.1"));
+	asio::high_resolution_timer timer(ios);
+	int fired = 0;
+
+	sweep s(3);
+	CHECK(s.max_workers() == 3);
+	std::vector<sweep::result> const results = s.run(10, [&](int point)
+	{
+		// every point waits for its own amount of time
+		std::function<void(boost::system::error_code const&)> on_timer
+			= [&](boost::system::error_code const& ec)
+		{
+			if (ec) return;
+			if (++fired == point + 1) return;
+			timer.expires_from_now(milliseconds(point + 1));
+			timer.async_wait(on_timer);
+		};
+		timer.expires_from_now(milliseconds(point + 1));
+		timer.async_wait(on_timer);
+		sim.run();
+
+		record r;
+		r.point = point;
+		r.fired = fired;
+		r.end_time = duration_cast<milliseconds>(high_resolution_clock::now()
+			- high_resolution_clock::time_point()).count();
+		return sweep::make_record(r);
+	});
+
+	// the children don't affect the parent
+	CHECK(fired == 0);
+	CHECK(high_resolution_clock::now() == high_resolution_clock::time_point());
+
+	REQUIRE(results.size() == 10);
+	for (int i = 0; i < 10; ++i)
+	{
+		CHECK(results[i].point == i);
+		record r;
+		REQUIRE(results[i].get(r));
+		CHECK(r.point == i);
+		CHECK(r.fired == i + 1);
+		CHECK(r.end_time == (i + 1) * (i + 1));
+	}
+}
+
+TEST_CASE("sweep reports failing points", "sweep")
+{
+	sweep s(2);
+	std::vector<sweep::result> const results = s.run(4, [](int point) -> std::string
+	{
+		if (point == 1) throw std::runtime_error("test failure");
+		if (point == 2) std::raise(SIGKILL);
+		// records don't have to be fixed size
+		return std::string(std::size_t(point) * 100000, 'a');
+	});
+
+	REQUIRE(results.size() == 4);
+	CHECK(results[0].ok());
+	CHECK(results[0].record.empty());
+
+	CHECK(!results[1].ok());
+	CHECK(results[1].exit_code == 1);
+
+	CHECK(!results[2].ok());
+	CHECK(results[2].signal == SIGKILL);
+
+	CHECK(results[3].ok());
+	CHECK(results[3].record == std::string(300000, 'a'));
+
+	// a record of the wrong size can't be interpreted
+	record r;
+	CHECK(!results[3].get(r));
+}
+
+TEST_CASE("sweep waits for its children when it fails", "sweep")
+{
+	// only leave room for a few pipes, starting a child fails partway
+	int const lowest_free = ::dup(0);
+	REQUIRE(lowest_free >= 0);
+	::close(lowest_free);
+	rlimit old_limit;
+	REQUIRE(::getrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+	rlimit limit = old_limit;
+	limit.rlim_cur = rlim_t(lowest_free + 5);
+	REQUIRE(::setrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+	bool threw = false;
+	sweep s(8);
+	try
+	{
+		s.run(8, [](int) -> std::string
+		{
+			// still running when the parent gives up
+			::usleep(100000);
+			return std::string();
+		});
+	}
+	catch (boost::system::system_error const& e)
+	{
+		threw = true;
+		CHECK(e.code() == boost::system::error_code(EMFILE
+			, boost::system::system_category()));
+	}
+	::setrlimit(RLIMIT_NOFILE, &old_limit);
+	CHECK(threw);
+
+	// every child that was started has been waited for
+	int status = 0;
+	CHECK(::waitpid(-1, &status, WNOHANG) < 0);
+	CHECK(errno == ECHILD);
+}
+
+#endif // _WIN32
+
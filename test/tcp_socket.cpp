@@ -0,0 +1,976 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
+#include <functional>
+#include "catch.hpp"
+
+using namespace sim::asio;
+using namespace sim::asio::ip;
+using sim::simulation;
+using sim::default_config;
+using sim::queue;
+using sim::route;
+using sim::congestion_control;
+using sim::chrono::high_resolution_clock;
+using sim::chrono::duration_cast;
+using sim::chrono::microseconds;
+using sim::chrono::milliseconds;
+using sim::chrono::nanoseconds;
+
+namespace {
+
+	char pattern(int i) { return char(i * 7 % 251); }
+
+	// two nodes connected by a 100 Gbit link in each direction, with 5 us
+	// latency and unlimited queues. Nothing else is in the way
+	struct datacenter_config : default_config
+	{
+		static std::int64_t const rate = 100000000000LL / 8;
+
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			for (int i = 0; i < 2; ++i)
+			{
+				m_link[i] = std::make_shared<queue>(std::ref(sim.get_io_service())
+					, rate, duration_cast<high_resolution_clock::duration>(microseconds(5))
+					, 0, "100 Gbit link");
+			}
+		}
+
+		virtual route channel_route(address src, address dst) override
+		{
+			return route().append(m_link[src < dst ? 0 : 1]);
+		}
+
+		virtual route incoming_route(address) override { return route(); }
+		virtual route outgoing_route(address) override { return route(); }
+
+		virtual high_resolution_clock::duration min_channel_latency() override
+		{
+			return duration_cast<high_resolution_clock::duration>(microseconds(5));
+		}
+
+	private:
+		std::shared_ptr<queue> m_link[2];
+	};
+
+	// make_shared() binds rate to a reference, so it needs a definition
+	std::int64_t const datacenter_config::rate;
+
+	// the link from 10.0.0.1 to 10.0.0.2 is 1 MB/s with a queue of only
+	// 10 kB, the window outgrows it and segments are dropped
+	struct lossy_config : default_config
+	{
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			m_link = std::make_shared<queue>(std::ref(sim.get_io_service())
+				, 1000 * 1000, duration_cast<high_resolution_clock::duration>(
+					microseconds(500)), 10000, "lossy link");
+		}
+
+		virtual route channel_route(address src, address dst) override
+		{
+			if (src < dst) return route().append(m_link);
+			return route();
+		}
+
+		virtual route incoming_route(address) override { return route(); }
+		virtual route outgoing_route(address) override { return route(); }
+
+	private:
+		std::shared_ptr<queue> m_link;
+	};
+
+	// drops the first payload packet passing through it, like a queue that
+	// happens to be full just then
+	struct drop_first : sim::sink
+	{
+		drop_first() : dropped(false) {}
+
+		virtual void incoming_packet(sim::aux::packet p) override
+		{
+			if (!dropped && p.type == sim::aux::packet::payload)
+			{
+				dropped = true;
+				return;
+			}
+			sim::forward_packet(std::move(p));
+		}
+
+		virtual std::string label() const override { return "drop first"; }
+
+		bool dropped;
+	};
+
+	// counts the payload packets passing through it, and the ones that only
+	// carry virtual bytes
+	struct count_payload : sim::sink
+	{
+		count_payload() : packets(0), virtual_packets(0) {}
+
+		virtual void incoming_packet(sim::aux::packet p) override
+		{
+			if (p.type == sim::aux::packet::payload)
+			{
+				++packets;
+				if (p.buffer.is_virtual()) ++virtual_packets;
+			}
+			sim::forward_packet(std::move(p));
+		}
+
+		virtual std::string label() const override { return "count payload"; }
+
+		int packets;
+		int virtual_packets;
+	};
+
+	// 10 ms latency in each direction. The packets sent from 10.0.0.1 to
+	// 10.0.0.2 pass through a Sink (like drop_first or count_payload) first
+	template <class Sink>
+	struct sink_config : default_config
+	{
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			m_sink = std::make_shared<Sink>();
+			for (int i = 0; i < 2; ++i)
+			{
+				m_link[i] = std::make_shared<queue>(std::ref(sim.get_io_service())
+					, 1000 * 1000, duration_cast<high_resolution_clock::duration>(
+						milliseconds(10)), 0, "link");
+			}
+		}
+
+		virtual route channel_route(address src, address dst) override
+		{
+			if (src < dst) return route().append(m_sink).append(m_link[0]);
+			return route().append(m_link[1]);
+		}
+
+		virtual route incoming_route(address) override { return route(); }
+		virtual route outgoing_route(address) override { return route(); }
+
+		std::shared_ptr<Sink> m_sink;
+
+	private:
+		std::shared_ptr<queue> m_link[2];
+	};
+
+	// two nodes, 10.0.0.1 and 10.0.0.2, each with a TCP socket, and a
+	// listening socket on 10.0.0.2
+	struct socket_pair
+	{
+		explicit socket_pair(sim::configuration& cfg)
+			: sim(cfg)
+			, ios_a(sim, address_v4::from_string("10.0.0.1"))
+			, ios_b(sim, address_v4::from_string("10.0.0.2"))
+			, listener(ios_b)
+			, incoming(ios_b)
+			, outgoing(ios_a)
+		{
+			boost::system::error_code ec;
+			listener.open(tcp::v4(), ec);
+			listener.bind(tcp::endpoint(address(), 8080), ec);
+			listener.listen(10, ec);
+		}
+
+		// connects outgoing to the listener, which accepts it into incoming.
+		// on_connected and on_accepted are called once the respective end is
+		// connected
+		void connect(std::function<void()> on_connected
+			, std::function<void()> on_accepted = std::function<void()>())
+		{
+			connect(outgoing, incoming, on_connected, on_accepted);
+		}
+
+		void connect(tcp::socket& from, tcp::socket& to
+			, std::function<void()> on_connected
+			, std::function<void()> on_accepted)
+		{
+			listener.async_accept(to, [on_accepted](boost::system::error_code const& e)
+			{
+				REQUIRE(!e);
+				if (on_accepted) on_accepted();
+			});
+			from.async_connect(tcp::endpoint(address_v4::from_string("10.0.0.2"), 8080)
+				, [on_connected](boost::system::error_code const& e)
+			{
+				REQUIRE(!e);
+				if (on_connected) on_connected();
+			});
+		}
+
+		simulation sim;
+		io_service ios_a;
+		io_service ios_b;
+		tcp::acceptor listener;
+		tcp::socket incoming;
+		tcp::socket outgoing;
+	};
+
+	// reads from a socket until it fails, which it does with the EOF once
+	// the other end has closed
+	struct reader
+	{
+		explicit reader(tcp::socket& s) : m_socket(s) {}
+
+		void start()
+		{
+			m_socket.async_read_some(buffer(m_buf, sizeof(m_buf))
+				, [this](boost::system::error_code const& e, std::size_t bytes)
+			{
+				if (bytes > 0 && received.empty())
+					first_received = high_resolution_clock::now();
+				received.insert(received.end(), m_buf, m_buf + bytes);
+				if (e)
+				{
+					error = e;
+					return;
+				}
+				start();
+			});
+		}
+
+		std::vector<char> received;
+		boost::system::error_code error;
+		high_resolution_clock::time_point first_received;
+
+	private:
+		tcp::socket& m_socket;
+		char m_buf[5000];
+	};
+}
+
+TEST_CASE("bytes arrive intact through scattered writes and partial reads", "tcp_socket")
+{
+	default_config cfg;
+	socket_pair p(cfg);
+
+	int const total = 200000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	// every write is split across two buffers, which aren't multiples of the
+	// MSS. Every read is smaller than a segment, and spans two buffers too
+	int written = 0;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		written += int(bytes);
+		if (written == total) return;
+		int const first = (std::min)(total - written, 3001);
+		int const second = (std::min)(total - written - first, 5003);
+		std::vector<const_buffer> bufs;
+		bufs.push_back(const_buffer(&send_buf[written], first));
+		if (second > 0) bufs.push_back(const_buffer(&send_buf[written + first], second));
+		p.outgoing.async_write_some(bufs, on_write);
+	};
+
+	std::vector<char> received;
+	char recv_buf[300];
+	std::function<void(boost::system::error_code const&, std::size_t)> on_read
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		received.insert(received.end(), recv_buf, recv_buf + bytes);
+		if (int(received.size()) == total) return;
+		std::size_t const len = 1 + received.size() % 157;
+		std::vector<mutable_buffer> bufs;
+		bufs.push_back(mutable_buffer(recv_buf, len));
+		bufs.push_back(mutable_buffer(recv_buf + len, len * 2 / 3 + 1));
+		p.incoming.async_read_some(bufs, on_read);
+	};
+
+	p.connect([&] { on_write(boost::system::error_code(), 0); }
+		, [&] { on_read(boost::system::error_code(), 0); });
+
+	p.sim.run();
+
+	CHECK(written == total);
+	REQUIRE(int(received.size()) == total);
+	int mismatches = 0;
+	for (int i = 0; i < total; ++i)
+		if (received[i] != pattern(i)) ++mismatches;
+	CHECK(mismatches == 0);
+}
+
+TEST_CASE("virtual bytes are generated as they're read", "tcp_socket")
+{
+	default_config cfg;
+	socket_pair p(cfg);
+
+	// a few real bytes first, the virtual bytes are generated from their
+	// position in the stream
+	int const num_real = 1000;
+	int const total = 300000;
+	std::uint64_t const seed = 1337;
+	char send_buf[num_real];
+	for (int i = 0; i < num_real; ++i) send_buf[i] = pattern(i);
+
+	int written = 0;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		written += int(bytes);
+		if (written == total) return;
+		if (written < num_real)
+		{
+			p.outgoing.async_write_some(buffer(send_buf + written, num_real - written)
+				, on_write);
+			return;
+		}
+		p.outgoing.async_write_virtual(total - written, on_write, seed);
+	};
+
+	std::vector<char> received;
+	char recv_buf[5000];
+	std::function<void(boost::system::error_code const&, std::size_t)> on_read
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		received.insert(received.end(), recv_buf, recv_buf + bytes);
+		if (int(received.size()) == total) return;
+		p.incoming.async_read_some(buffer(recv_buf, 1 + received.size() % sizeof(recv_buf))
+			, on_read);
+	};
+
+	p.connect([&] { on_write(boost::system::error_code(), 0); }
+		, [&] { on_read(boost::system::error_code(), 0); });
+
+	p.sim.run();
+
+	CHECK(written == total);
+	REQUIRE(int(received.size()) == total);
+	int mismatches = 0;
+	for (int i = 0; i < num_real; ++i)
+		if (received[i] != pattern(i)) ++mismatches;
+	for (int i = num_real; i < total; ++i)
+		if (std::uint8_t(received[i]) != sim::virtual_byte(seed, i)) ++mismatches;
+	CHECK(mismatches == 0);
+
+	// the stream isn't trivial, and seed 0 is all zeros
+	CHECK(sim::virtual_byte(seed, 1) != sim::virtual_byte(seed, 2));
+	CHECK(sim::virtual_byte(0, 12345) == 0);
+}
+
+TEST_CASE("a transfer over a 100 Gbit link reaches line rate", "tcp_socket")
+{
+	datacenter_config cfg;
+	socket_pair p(cfg);
+
+	// a receive window large enough not to limit the transfer
+	boost::system::error_code ec;
+	p.incoming.set_option(tcp::socket::receive_buffer_size(64 * 1024 * 1024), ec);
+
+	// the bytes per second doesn't fit in an int. The time it takes to send a
+	// byte isn't a whole number of nanoseconds either
+	std::int64_t const total = 100 * 1000 * 1000;
+	std::int64_t written = 0;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		written += bytes;
+		if (written == total) return;
+		p.outgoing.async_write_virtual(std::size_t(total - written), on_write);
+	};
+
+	// the time the first and the second half of the transfer were received.
+	// The window has opened up by the time the first half has been received.
+	// The rate is measured over the bytes read after half_way, segments
+	// arriving together as a train are read at the same time
+	std::int64_t received = 0;
+	std::int64_t received_after = 0;
+	high_resolution_clock::time_point half_way;
+	high_resolution_clock::time_point done;
+	char recv_buf[64 * 1024];
+	std::function<void(boost::system::error_code const&, std::size_t)> on_read
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		if (received < total / 2 && received + std::int64_t(bytes) >= total / 2)
+			half_way = high_resolution_clock::now();
+		else if (received >= total / 2 && high_resolution_clock::now() > half_way)
+			received_after += bytes;
+		received += bytes;
+		if (received == total)
+		{
+			done = high_resolution_clock::now();
+			return;
+		}
+		p.incoming.async_read_some(buffer(recv_buf, sizeof(recv_buf)), on_read);
+	};
+
+	p.connect([&] { on_write(boost::system::error_code(), 0); }
+		, [&] { on_read(boost::system::error_code(), 0); });
+
+	std::size_t const events = p.sim.run();
+
+	REQUIRE(received == total);
+
+	// every segment carries 40 bytes of overhead on the wire
+	int const mss = cfg.path_mtu(address(), address());
+	double const line_rate = double(datacenter_config::rate) * mss / (mss + 40);
+	double const seconds = duration_cast<nanoseconds>(done - half_way).count() / 1e9;
+	double const rate = received_after / seconds;
+	CHECK(rate > line_rate * 0.99);
+	CHECK(rate <= line_rate * 1.001);
+
+	// the bytes cross the link as trains of segments, which takes fewer
+	// events than there are segments
+	CHECK(events * 5 < std::size_t(total / mss));
+}
+
+TEST_CASE("bytes arrive intact when segments are dropped", "tcp_socket")
+{
+	// the re-sent segments are ACKed selectively until the gap before them
+	// is filled, and the last segment may be ACKed on the delayed ACK timer.
+	// The EOF still arrives after every byte, whether the congestion control
+	// backs off on loss or not
+	int const total = 500000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	for (auto const algorithm : { congestion_control::reno
+		, congestion_control::cubic, congestion_control::bbr })
+	{
+		lossy_config cfg;
+		socket_pair p(cfg);
+		p.sim.set_congestion_control(algorithm);
+
+		int written = 0;
+		std::function<void(boost::system::error_code const&, std::size_t)> on_write
+			= [&](boost::system::error_code const& e, std::size_t bytes)
+		{
+			if (e) return;
+			written += int(bytes);
+			if (written == total)
+			{
+				p.outgoing.close();
+				return;
+			}
+			p.outgoing.async_write_some(buffer(&send_buf[written], total - written)
+				, on_write);
+		};
+
+		reader r(p.incoming);
+		p.connect([&] { on_write(boost::system::error_code(), 0); }
+			, [&] { r.start(); });
+
+		p.sim.run();
+
+		CHECK(written == total);
+		CHECK(r.error == boost::system::error_code(error::eof));
+		REQUIRE(int(r.received.size()) == total);
+		CHECK(r.received == send_buf);
+	}
+}
+
+TEST_CASE("a lost segment is re-sent after the retransmission timeout", "tcp_socket")
+{
+	// the socket is closed right after the write, and lingers until the
+	// segment has been ACKed. Only the FIN is sent after it, which isn't
+	// enough to tell the sender it's missing. The SACK of the FIN measures
+	// a round-trip of 20 ms, and restarts the retransmission timeout at its
+	// minimum of 200 ms. The segment arrives 10 ms after being re-sent
+	sink_config<drop_first> cfg;
+	socket_pair p(cfg);
+
+	int const total = 1000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	high_resolution_clock::time_point sent;
+	reader r(p.incoming);
+	p.connect([&]
+	{
+		sent = high_resolution_clock::now();
+		p.outgoing.async_write_some(buffer(send_buf)
+			, [&](boost::system::error_code const& e, std::size_t bytes)
+		{
+			CHECK(!e);
+			CHECK(bytes == std::size_t(total));
+			p.outgoing.close();
+		});
+	}, [&] { r.start(); });
+
+	p.sim.run();
+
+	CHECK(cfg.m_sink->dropped);
+	CHECK(r.error == boost::system::error_code(error::eof));
+	CHECK(r.received == send_buf);
+	CHECK(r.first_received - sent >= milliseconds(230));
+	CHECK(r.first_received - sent < milliseconds(240));
+}
+
+TEST_CASE("available() counts the bytes received before the EOF", "tcp_socket")
+{
+	default_config cfg;
+	socket_pair p(cfg);
+
+	int const total = 100000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	// the receive window has room for the whole stream
+	boost::system::error_code ec;
+	p.incoming.set_option(tcp::socket::receive_buffer_size(total), ec);
+
+	int written = 0;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		written += int(bytes);
+		if (written == total)
+		{
+			p.outgoing.close();
+			return;
+		}
+		p.outgoing.async_write_some(buffer(&send_buf[written], total - written)
+			, on_write);
+	};
+
+	p.connect([&] { on_write(boost::system::error_code(), 0); });
+
+	// nothing is read until the whole stream, and the EOF, has been received
+	std::vector<char> received(total + 1000);
+	std::size_t available = 0;
+	std::size_t first_read = 0;
+	boost::system::error_code second_read;
+	high_resolution_timer timer(p.ios_b);
+	timer.expires_from_now(sim::chrono::seconds(10));
+	timer.async_wait([&](boost::system::error_code const&)
+	{
+		p.incoming.io_control(tcp::socket::non_blocking_io(true));
+		available = p.incoming.available();
+		boost::system::error_code e;
+		first_read = p.incoming.read_some(buffer(received), e);
+		CHECK(!e);
+		p.incoming.read_some(buffer(received), second_read);
+	});
+
+	p.sim.run();
+
+	CHECK(written == total);
+	CHECK(available == std::size_t(total));
+	REQUIRE(first_read == std::size_t(total));
+	received.resize(total);
+	CHECK(received == send_buf);
+	CHECK(second_read == boost::system::error_code(error::eof));
+}
+
+TEST_CASE("a slow reader stalls the writer at its receive window", "tcp_socket")
+{
+	default_config cfg;
+	socket_pair p(cfg);
+
+	int const buffer_size = 10000;
+	boost::system::error_code ec;
+	p.incoming.set_option(tcp::socket::receive_buffer_size(buffer_size), ec);
+
+	int const total = 200000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	int written = 0;
+	bool stalled = false;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		written += int(bytes);
+		if (p.outgoing.get_stats().send_window == 0) stalled = true;
+		if (written == total)
+		{
+			p.outgoing.close();
+			return;
+		}
+		p.outgoing.async_write_some(buffer(&send_buf[written], total - written)
+			, on_write);
+	};
+
+	// 1000 bytes are read every 10 ms, far slower than the link
+	std::vector<char> received;
+	std::size_t max_buffered = 0;
+	boost::system::error_code read_error;
+	char recv_buf[1000];
+	high_resolution_timer timer(p.ios_b);
+	std::function<void(boost::system::error_code const&)> on_timer
+		= [&](boost::system::error_code const&)
+	{
+		boost::system::error_code e;
+		std::size_t const buffered = p.incoming.available(e);
+		max_buffered = (std::max)(max_buffered, buffered);
+		CHECK(buffered + std::size_t(p.incoming.get_stats().receive_window)
+			<= std::size_t(buffer_size));
+		std::size_t const bytes = p.incoming.read_some(buffer(recv_buf), e);
+		received.insert(received.end(), recv_buf, recv_buf + bytes);
+		if (e && e != boost::system::error_code(error::would_block))
+		{
+			read_error = e;
+			return;
+		}
+		timer.expires_from_now(milliseconds(10));
+		timer.async_wait(on_timer);
+	};
+
+	p.connect([&] { on_write(boost::system::error_code(), 0); }, [&]
+	{
+		p.incoming.io_control(tcp::socket::non_blocking_io(true));
+		on_timer(boost::system::error_code());
+	});
+
+	p.sim.run();
+
+	CHECK(stalled);
+	CHECK(max_buffered <= std::size_t(buffer_size));
+	CHECK(max_buffered > std::size_t(buffer_size / 2));
+	CHECK(read_error == boost::system::error_code(error::eof));
+	CHECK(received == send_buf);
+}
+
+TEST_CASE("a zero receive buffer still lets a segment through", "tcp_socket")
+{
+	default_config cfg;
+	socket_pair p(cfg);
+
+	boost::system::error_code ec;
+	p.incoming.set_option(tcp::socket::receive_buffer_size(0), ec);
+
+	int const total = 20000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	int written = 0;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		written += int(bytes);
+		if (written == total)
+		{
+			p.outgoing.close();
+			return;
+		}
+		p.outgoing.async_write_some(buffer(&send_buf[written], total - written)
+			, on_write);
+	};
+
+	// the reader doesn't read until the window has been closed for a while.
+	// It gives up after a minute, rather than waiting for a stalled sender
+	// forever
+	high_resolution_clock::time_point const deadline
+		= high_resolution_clock::now() + sim::chrono::seconds(60);
+	std::vector<char> received;
+	boost::system::error_code read_error;
+	char recv_buf[1000];
+	high_resolution_timer timer(p.ios_b);
+	std::function<void(boost::system::error_code const&)> on_timer
+		= [&](boost::system::error_code const&)
+	{
+		boost::system::error_code e;
+		std::size_t const bytes = p.incoming.read_some(buffer(recv_buf), e);
+		received.insert(received.end(), recv_buf, recv_buf + bytes);
+		if (e && e != boost::system::error_code(error::would_block))
+		{
+			read_error = e;
+			return;
+		}
+		if (high_resolution_clock::now() > deadline) return;
+		timer.expires_from_now(milliseconds(10));
+		timer.async_wait(on_timer);
+	};
+
+	p.connect([&] { on_write(boost::system::error_code(), 0); }, [&]
+	{
+		p.incoming.io_control(tcp::socket::non_blocking_io(true));
+		timer.expires_from_now(sim::chrono::seconds(1));
+		timer.async_wait(on_timer);
+	});
+
+	p.sim.run();
+
+	CHECK(written == total);
+	CHECK(read_error == boost::system::error_code(error::eof));
+	CHECK(received == send_buf);
+}
+
+TEST_CASE("writes complete into the send buffer", "tcp_socket")
+{
+	default_config cfg;
+	socket_pair p(cfg);
+
+	// the buffer holds more than the initial congestion window
+	int const buffer_size = 30000;
+	boost::system::error_code ec;
+	p.outgoing.set_option(tcp::socket::send_buffer_size(buffer_size), ec);
+	tcp::socket::send_buffer_size option;
+	p.outgoing.get_option(option, ec);
+	CHECK(option.value() == buffer_size);
+
+	int const total = 100000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	int written = 0;
+	std::vector<int> writes;
+	high_resolution_clock::time_point connected;
+	high_resolution_clock::time_point first_write;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		if (e) return;
+		if (writes.empty()) first_write = high_resolution_clock::now();
+		writes.push_back(int(bytes));
+		written += int(bytes);
+		tcp::socket::stats const st = p.outgoing.get_stats();
+		CHECK(st.bytes_unsent <= buffer_size);
+		if (written == total)
+		{
+			p.outgoing.close();
+			return;
+		}
+		p.outgoing.async_write_some(buffer(&send_buf[written], total - written)
+			, on_write);
+	};
+
+	reader r(p.incoming);
+	p.connect([&]
+	{
+		connected = high_resolution_clock::now();
+		p.outgoing.async_write_some(buffer(send_buf), on_write);
+
+		// the bytes the window has no room for wait in the send buffer
+		tcp::socket::stats const st = p.outgoing.get_stats();
+		CHECK(st.bytes_in_flight + st.bytes_unsent == buffer_size);
+		CHECK(st.bytes_unsent > 0);
+	}, [&] { r.start(); });
+
+	p.sim.run();
+
+	// the first write completes right away, with as many bytes as the buffer
+	// holds. The writer is woken up once a third of it is free
+	REQUIRE(writes.size() > 1);
+	CHECK(writes[0] == buffer_size);
+	CHECK(first_write == connected);
+	for (std::size_t i = 1; i < writes.size() - 1; ++i)
+		CHECK(writes[i] >= buffer_size / 3);
+	CHECK(r.error == boost::system::error_code(error::eof));
+	CHECK(r.received == send_buf);
+}
+
+TEST_CASE("a socket destructed after close() still delivers its bytes", "tcp_socket")
+{
+	// the last write fills the send buffer, and the socket is closed and
+	// destructed right away. Some of the segments in flight are dropped, and
+	// are re-sent after the socket is gone
+	lossy_config cfg;
+	socket_pair p(cfg);
+	std::unique_ptr<tcp::socket> outgoing(new tcp::socket(p.ios_a));
+
+	int const total = 200000;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	int written = 0;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_write
+		= [&](boost::system::error_code const& e, std::size_t bytes)
+	{
+		REQUIRE(!e);
+		written += int(bytes);
+		if (written == total)
+		{
+			outgoing->close();
+			outgoing.reset();
+			return;
+		}
+		outgoing->async_write_some(buffer(&send_buf[written], total - written)
+			, on_write);
+	};
+
+	reader r(p.incoming);
+	p.connect(*outgoing, p.incoming
+		, [&] { outgoing->async_write_some(buffer(send_buf), on_write); }
+		, [&] { r.start(); });
+
+	p.sim.run();
+
+	CHECK(!outgoing);
+	CHECK(r.error == boost::system::error_code(error::eof));
+	CHECK(r.received.size() == send_buf.size());
+	CHECK(r.received == send_buf);
+}
+
+TEST_CASE("a socket opened again after close() still delivers its bytes", "tcp_socket")
+{
+	// the write completes into the send buffer, and the socket is closed and
+	// opened again right away, to connect again. The socket accepting that
+	// second connection writes its bytes back and closes too, and is used to
+	// accept a third connection. Both connections deliver all their bytes,
+	// and the EOF
+	default_config cfg;
+	socket_pair p(cfg);
+	tcp::socket second(p.ios_b);
+	tcp::socket third(p.ios_a);
+
+	int const total = 65536;
+	std::vector<char> send_buf(total);
+	for (int i = 0; i < total; ++i) send_buf[i] = pattern(i);
+
+	reader first_reader(p.incoming);
+	reader second_reader(p.outgoing);
+	bool third_accepted = false;
+
+	auto const on_second_accepted = [&]
+	{
+		second.async_write_some(buffer(send_buf)
+			, [&](boost::system::error_code const& e, std::size_t bytes)
+		{
+			REQUIRE(!e);
+			REQUIRE(bytes == std::size_t(total));
+			second.close();
+			p.connect(third, second, nullptr, [&] { third_accepted = true; });
+		});
+	};
+
+	p.connect([&]
+	{
+		p.outgoing.async_write_some(buffer(send_buf)
+			, [&](boost::system::error_code const& e, std::size_t bytes)
+		{
+			REQUIRE(!e);
+			REQUIRE(bytes == std::size_t(total));
+			p.outgoing.close();
+			p.outgoing.open(tcp::v4());
+			p.connect(p.outgoing, second, [&] { second_reader.start(); }
+				, on_second_accepted);
+		});
+	}, [&] { first_reader.start(); });
+
+	p.sim.run();
+
+	CHECK(first_reader.error == boost::system::error_code(error::eof));
+	CHECK(first_reader.received == send_buf);
+	CHECK(second_reader.error == boost::system::error_code(error::eof));
+	CHECK(second_reader.received == send_buf);
+	CHECK(third_accepted);
+}
+
+namespace {
+
+	enum small_writes_mode { nagle, no_delay, cork };
+
+	// writes 100 bytes every millisecond, 200 times, then closes the socket.
+	// Returns the number of payload packets they were sent in. With
+	// virtual_bytes, the writes are virtual and so must every packet be
+	int send_small_writes(small_writes_mode const mode
+		, bool const virtual_bytes = false)
+	{
+		sink_config<count_payload> cfg;
+		socket_pair p(cfg);
+
+		boost::system::error_code ec;
+		if (mode == no_delay) p.outgoing.set_option(tcp::no_delay(true), ec);
+		if (mode == cork) p.outgoing.set_option(tcp::cork(true), ec);
+		tcp::no_delay no_delay_option;
+		p.outgoing.get_option(no_delay_option, ec);
+		CHECK(no_delay_option.value() == (mode == no_delay));
+
+		int const write_size = 100;
+		int const total = 200 * write_size;
+		std::vector<char> send_buf(total);
+		std::uint64_t const seed = 0x5eed;
+		for (int i = 0; i < total; ++i)
+		{
+			send_buf[i] = virtual_bytes
+				? char(sim::virtual_byte(seed, std::uint64_t(i))) : pattern(i);
+		}
+
+		auto const on_write = [&](boost::system::error_code const& e
+			, std::size_t bytes)
+		{
+			CHECK(!e);
+			CHECK(bytes == std::size_t(write_size));
+		};
+
+		int written = 0;
+		high_resolution_timer timer(p.ios_a);
+		std::function<void(boost::system::error_code const&)> on_timer
+			= [&](boost::system::error_code const&)
+		{
+			if (written == total)
+			{
+				p.outgoing.close();
+				return;
+			}
+			if (virtual_bytes)
+				p.outgoing.async_write_virtual(write_size, on_write, seed);
+			else
+				p.outgoing.async_write_some(buffer(&send_buf[written], write_size)
+					, on_write);
+			written += write_size;
+			timer.expires_from_now(milliseconds(1));
+			timer.async_wait(on_timer);
+		};
+
+		reader r(p.incoming);
+		p.connect([&] { on_timer(boost::system::error_code()); }
+			, [&] { r.start(); });
+
+		p.sim.run();
+
+		CHECK(r.error == boost::system::error_code(error::eof));
+		CHECK(r.received == send_buf);
+		CHECK(cfg.m_sink->virtual_packets
+			== (virtual_bytes ? cfg.m_sink->packets : 0));
+		return cfg.m_sink->packets;
+	}
+}
+
+TEST_CASE("small writes are coalesced unless no_delay is set", "tcp_socket")
+{
+	// every write is a packet of its own
+	CHECK(send_small_writes(no_delay) == 200);
+
+	// while a short segment is in flight, the writes after it are held back.
+	// They're sent as full segments, and the short one ending them
+	int const nagle_packets = send_small_writes(nagle);
+	CHECK(nagle_packets > 200 / 15);
+	CHECK(nagle_packets < 200 / 5);
+
+	// corked, only full segments are sent. The rest goes with the FIN
+	CHECK(send_small_writes(cork) == (200 * 100 + 1474) / 1475);
+}
+
+TEST_CASE("coalesced virtual writes stay virtual", "tcp_socket")
+{
+	// the segments made of several virtual writes only carry their size,
+	// like the ones of a single large write
+	int const nagle_packets = send_small_writes(nagle, true);
+	CHECK(nagle_packets > 200 / 15);
+	CHECK(nagle_packets < 200 / 5);
+
+	CHECK(send_small_writes(cork, true) == (200 * 100 + 1474) / 1475);
+}
@@ -17,6 +17,7 @@ All rights reserved.
 */
 
 #include "simulator/simulator.hpp"
+#include "simulator/queue.hpp"
 #include <functional>
 #include "catch.hpp"
 
@@ -108,3 +109,152 @@ TEST_CASE("send packet to udp socket", "udp_socket")
 		, millis, ec.message().c_str());
 }
 
+namespace {
+
+	// counts the routes it hands out. Once the detour is taken, packets go
+	// through an extra queue with 100 ms latency
+	struct detour_config : default_config
+	{
+		detour_config() : num_routes(0), detour(false) {}
+
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			m_detour = std::make_shared<queue>(std::ref(sim.get_io_service())
+				, 0, duration_cast<high_resolution_clock::duration>(milliseconds(100))
+				, 0, "detour");
+		}
+
+		virtual route channel_route(address src, address dst) override
+		{
+			++num_routes;
+			route ret = default_config::channel_route(src, dst);
+			if (detour) ret.append(m_detour);
+			return ret;
+		}
+
+		int num_routes;
+		bool detour;
+
+	private:
+		std::shared_ptr<queue> m_detour;
+	};
+}
+
+TEST_CASE("udp routes are looked up once per pair of addresses", "udp_socket")
+{
+	detour_config cfg;
+	simulation sim(cfg);
+	asio::io_service sender_ios(sim, address_v4::from_string("10.0.0.1"));
+	asio::io_service receiver_ios(sim, address_v4::from_string("10.0.0.2"));
+
+	udp::socket sender(sender_ios);
+	udp::socket receiver(receiver_ios);
+	boost::system::error_code ec;
+	sender.open(udp::v4(), ec);
+	sender.io_control(udp::socket::non_blocking_io(true), ec);
+	receiver.open(udp::v4(), ec);
+	receiver.bind(udp::endpoint(address(), 1337), ec);
+	REQUIRE(!ec);
+
+	std::vector<high_resolution_clock::time_point> arrivals;
+	udp::endpoint from;
+	std::function<void(boost::system::error_code const&, std::size_t)> on_receive
+		= [&](boost::system::error_code const& e, std::size_t)
+	{
+		if (e) return;
+		arrivals.push_back(high_resolution_clock::now());
+		receiver.async_receive_from(asio::mutable_buffers_1(receive_buf
+			, sizeof(receive_buf)), from, on_receive);
+	};
+	receiver.async_receive_from(asio::mutable_buffers_1(receive_buf
+		, sizeof(receive_buf)), from, on_receive);
+
+	// returns the number of microseconds the datagram took
+	udp::endpoint const dst(address_v4::from_string("10.0.0.2"), 1337);
+	auto send_one = [&]() -> std::int64_t
+	{
+		arrivals.clear();
+		sim.reset();
+		high_resolution_clock::time_point const start = high_resolution_clock::now();
+		sender.send_to(asio::const_buffers_1(send_buf, 10), dst, 0, ec);
+		sim.run();
+		REQUIRE(arrivals.size() == 1);
+		return duration_cast<microseconds>(arrivals.back() - start).count();
+	};
+
+	for (int i = 0; i < 10; ++i)
+		sender.send_to(asio::const_buffers_1(send_buf, 10), dst, 0, ec);
+	sim.run();
+	CHECK(arrivals.size() == 10);
+	CHECK(cfg.num_routes == 1);
+	std::int64_t const direct = send_one();
+	CHECK(cfg.num_routes == 1);
+
+	// the cached route is used until it's invalidated
+	cfg.detour = true;
+	CHECK(send_one() == direct);
+	CHECK(cfg.num_routes == 1);
+
+	sim.invalidate_routes();
+	CHECK(send_one() == direct + 100000);
+	CHECK(cfg.num_routes == 2);
+}
+
+
+namespace {
+
+	// every packet goes through a 10 kB/s link first. Only the
+	// configuration holds on to the link
+	struct slow_link_config : default_config
+	{
+		virtual void build(simulation& sim) override
+		{
+			default_config::build(sim);
+			m_link = std::make_shared<queue>(std::ref(sim.get_io_service())
+				, 10000, duration_cast<high_resolution_clock::duration>(milliseconds(10))
+				, 0, "slow link");
+		}
+
+		virtual route channel_route(address src, address dst) override
+		{
+			return route().append(m_link)
+				.append(default_config::channel_route(src, dst));
+		}
+
+		std::shared_ptr<queue> m_link;
+	};
+}
+
+TEST_CASE("packets still queued are freed with the simulation", "udp_socket")
+{
+	slow_link_config cfg;
+	std::weak_ptr<queue> link;
+	{
+		simulation sim(cfg);
+		asio::io_service sender_ios(sim, address_v4::from_string("10.0.0.1"));
+		asio::io_service receiver_ios(sim, address_v4::from_string("10.0.0.2"));
+
+		udp::socket sender(sender_ios);
+		udp::socket receiver(receiver_ios);
+		boost::system::error_code ec;
+		sender.open(udp::v4(), ec);
+		sender.io_control(udp::socket::non_blocking_io(true), ec);
+		receiver.open(udp::v4(), ec);
+		receiver.bind(udp::endpoint(address(), 1337), ec);
+		REQUIRE(!ec);
+
+		// a datagram takes about 100 ms to pass the link. Most of them are
+		// still in its queue when the simulation ends
+		udp::endpoint const dst(address_v4::from_string("10.0.0.2"), 1337);
+		for (int i = 0; i < 10; ++i)
+			sender.send_to(asio::const_buffers_1(send_buf, 1000), dst, 0, ec);
+		sim.run_for(milliseconds(150));
+		link = cfg.m_link;
+	}
+
+	// the queued packets held their route, which holds the link. They must
+	// not keep it alive
+	cfg.m_link.reset();
+	CHECK(link.expired());
+}